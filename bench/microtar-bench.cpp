@@ -0,0 +1,658 @@
+// microtar-bench.cpp --- microtar benchmarks
+#define _CRT_SECURE_NO_WARNINGS
+#include "microtar.h"
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdarg>
+#include <chrono>
+#include <string>
+#include <vector>
+#ifdef HAVE_ZLIB
+    #include <zlib.h>
+#endif
+#ifdef _WIN32
+    #include <windows.h>
+    #define PSAPI_VERSION 2
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+using namespace std;
+
+static double now()
+{
+    return chrono::duration<double>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Every measurement is kept for the JSON report; the text goes to stdout
+// unless JSON was asked for.
+struct result_t
+{
+    string name;
+    double value;
+    const char *unit;
+};
+
+static vector<result_t> s_results;
+static bool s_json = false;
+
+static void say(const char *fmt, ...)
+{
+    va_list va;
+    if (s_json)
+        return;
+    va_start(va, fmt);
+    vprintf(fmt, va);
+    va_end(va);
+}
+
+static double result(const string& name, double value, const char *unit)
+{
+    result_t r = { name, value, unit };
+    s_results.push_back(r);
+    return value;
+}
+
+static double peak_rss_mib()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.PeakWorkingSetSize / (1024.0 * 1024);
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / (1024.0 * 1024);
+#else
+    return ru.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// Peak RSS so far, after each group of benchmarks
+static void report_rss(const char *group)
+{
+    double mib = result(string("rss.peak.") + group, peak_rss_mib(), "MiB");
+    say("%-16s peak RSS %8.1f MiB\n", group, mib);
+}
+
+// The header codec microtar used before the dedicated parser/formatter,
+// kept as the baseline to compare against.
+struct raw_header_t
+{
+    char name[100];
+    char mode[8];
+    char owner[8];
+    char group[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char _padding[255];
+};
+
+static unsigned libc_checksum(const raw_header_t *rh)
+{
+    const unsigned char *p = (const unsigned char *)rh;
+    unsigned res = 256;
+    for (size_t i = 0; i < offsetof(raw_header_t, checksum); i++)
+        res += p[i];
+    for (size_t i = offsetof(raw_header_t, type); i < sizeof(*rh); i++)
+        res += p[i];
+    return res;
+}
+
+static int libc_parse(mtar_header_t *h, const raw_header_t *rh)
+{
+    unsigned chksum;
+    unsigned long long size = 0;
+    if (*rh->checksum == '\0')
+        return MTAR_ENULLRECORD;
+    sscanf(rh->checksum, "%7o", &chksum);
+    if (libc_checksum(rh) != chksum)
+        return MTAR_EBADCHKSUM;
+    sscanf(rh->mode, "%7o", &h->mode);
+    sscanf(rh->owner, "%7o", &h->owner);
+    sscanf(rh->size, "%11llo", &size);
+    h->size = (size_t)size;
+    sscanf(rh->mtime, "%11o", &h->mtime);
+    h->type = (unsigned)rh->type;
+    strcpy(h->name, rh->name);
+    strcpy(h->linkname, rh->linkname);
+    return MTAR_ESUCCESS;
+}
+
+static void libc_format(raw_header_t *rh, const mtar_header_t *h)
+{
+    memset(rh, 0, sizeof(*rh));
+    sprintf(rh->mode, "%o", h->mode);
+    sprintf(rh->owner, "%o", h->owner);
+    sprintf(rh->size, "%llo", (unsigned long long)h->size);
+    sprintf(rh->mtime, "%o", h->mtime);
+    rh->type = (char)h->type;
+    strcpy(rh->name, h->name);
+    strcpy(rh->linkname, h->linkname);
+    sprintf(rh->checksum, "%06o", libc_checksum(rh));
+    rh->checksum[7] = ' ';
+}
+
+// Archive of `count` empty members, so that every record is a header
+static void make_headers(mtar_t *tar, int count)
+{
+    mtar_header_t h;
+    mtar_open_memory(tar, NULL, 0);
+    memset(&h, 0, sizeof(h));
+    h.mode = 0644;
+    h.mtime = 1500000000;
+    h.type = MTAR_TREG;
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(h.name, "assets/img/file-%08d.png", i);
+        mtar_write_header(tar, &h);
+    }
+    mtar_finalize(tar);
+}
+
+static void report(const char *what, int count, double libc_secs, double mtar_secs)
+{
+    result(string("codec.") + what + ".libc", count / libc_secs, "headers/s");
+    result(string("codec.") + what + ".microtar", count / mtar_secs, "headers/s");
+    say("%-16s libc %12.0f headers/sec   microtar %12.0f headers/sec   x%.1f\n",
+        what, count / libc_secs, count / mtar_secs, libc_secs / mtar_secs);
+}
+
+static void bench_header_codec(int count)
+{
+    mtar_t writer, reader;
+    mtar_header_t h;
+    make_headers(&writer, count);
+    const raw_header_t *raw = (const raw_header_t *)writer.memory;
+
+    // Parse; microtar also pays for reading through the memory backend
+    double t0 = now();
+    for (int i = 0; i < count; i++)
+    {
+        if (libc_parse(&h, &raw[i]))
+            abort();
+    }
+    double t1 = now();
+    mtar_open_memory(&reader, writer.memory, writer.memory_size);
+    for (int i = 0; i < count; i++)
+    {
+        if (mtar_read_header(&reader, &h) || mtar_seek(&reader, reader.pos + 512))
+            abort();
+    }
+    double t2 = now();
+    report("parse", count, t1 - t0, t2 - t1);
+    mtar_close(&reader);
+
+    // Format; microtar also pays for appending to the memory backend
+    vector<raw_header_t> out(count);
+    memset(&h, 0, sizeof(h));
+    h.mode = 0644;
+    h.mtime = 1500000000;
+    h.type = MTAR_TREG;
+    strcpy(h.name, "assets/img/file.png");
+    t0 = now();
+    for (int i = 0; i < count; i++)
+    {
+        h.size = i;
+        libc_format(&out[i], &h);
+    }
+    t1 = now();
+    mtar_close(&writer);
+    mtar_open_memory(&writer, NULL, 0);
+    for (int i = 0; i < count; i++)
+    {
+        h.size = i;
+        mtar_write_header(&writer, &h);
+    }
+    t2 = now();
+    report("format", count, t1 - t0, t2 - t1);
+    mtar_close(&writer);
+}
+
+// Text-like member data, so that compression has some work to do
+static string make_text(size_t size, unsigned seed)
+{
+    static const char *words[] = {
+        "archive ", "member ", "header ", "record ", "block ", "frame ",
+        "stream ", "offset ", "\n", "0x1f8b ", "tar ", "gzip "
+    };
+    string data;
+    while (data.size() < size)
+    {
+        seed = seed * 1103515245 + 12345;
+        data += words[(seed >> 16) % 12];
+    }
+    data.resize(size);
+    return data;
+}
+
+static void write_gz(const char *filename, int count, int threads)
+{
+    mtar_t tar;
+    char name[64];
+    mtar_open_gz(&tar, filename, "w6");
+    if (mtar_set_threads(&tar, threads) && threads != 1)
+        say("gzip             no threads, compressing serially\n");
+    for (int i = 0; i < count; i++)
+    {
+        string data = make_text(4096 + i % 97 * 1024, i);
+        sprintf(name, "logs/part-%06d.txt", i);
+        mtar_write_file_header(&tar, name, data.size());
+        mtar_write_data(&tar, data.data(), data.size());
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+}
+
+static void bench_gzip(int count, int threads)
+{
+    const char *filename = "microtar-bench.tar.gz";
+    mtar_t tar;
+    mtar_header_t h;
+    mtar_index_t idx;
+    vector<char> buf;
+    char name[64];
+
+    if (mtar_open_gz(&tar, filename, "w") == MTAR_EUNSUPPORTED)
+    {
+        say("gzip             skipped, built without zlib\n");
+        return;
+    }
+    mtar_close(&tar);
+
+    // Compression, on one thread and on the pool
+    double t0 = now();
+    write_gz(filename, count, 1);
+    double t1 = now();
+    write_gz(filename, count, threads);
+    double t2 = now();
+    mtar_open_gz(&tar, filename, "r");
+    mtar_index_build(&tar, &idx);
+    double mb = (double)idx.end / (1024 * 1024);
+    result("gzip.write.1", mb / (t1 - t0), "MB/s");
+    result("gzip.write." + to_string(threads), mb / (t2 - t1), "MB/s");
+    say("gzip write       1 thread %8.1f MB/s   %d threads %8.1f MB/s   x%.1f\n",
+        mb / (t1 - t0), threads, mb / (t2 - t1), (t1 - t0) / (t2 - t1));
+
+    // Decompression: every member in order, and the whole file through zlib
+    t0 = now();
+    mtar_rewind(&tar);
+    while (mtar_read_header(&tar, &h) == MTAR_ESUCCESS)
+    {
+        buf.resize(h.size + 1);
+        mtar_read_data(&tar, &buf[0], h.size);
+        mtar_next(&tar);
+    }
+    t1 = now();
+#ifdef HAVE_ZLIB
+    gzFile gz = gzopen(filename, "rb");
+    buf.resize(1024 * 1024);
+    while (gzread(gz, &buf[0], (unsigned)buf.size()) > 0)
+        ;
+    gzclose(gz);
+    t2 = now();
+    result("gzip.read.gzread", mb / (t2 - t1), "MB/s");
+    say("gzip read        microtar %8.1f MB/s   gzread %8.1f MB/s\n",
+        mb / (t1 - t0), mb / (t2 - t1));
+#else
+    say("gzip read        microtar %8.1f MB/s\n", mb / (t1 - t0));
+#endif
+    result("gzip.read.microtar", mb / (t1 - t0), "MB/s");
+
+    // Random access through the frame index
+    const int lookups = 2000;
+    t0 = now();
+    for (int i = 0; i < lookups; i++)
+    {
+        sprintf(name, "logs/part-%06d.txt", (int)((i * 7919LL) % count));
+        buf.resize(200 * 1024);
+        if (mtar_find(&tar, name, &h) || mtar_read_data(&tar, &buf[0], h.size))
+            abort();
+    }
+    t1 = now();
+    result("gzip.random", lookups / (t1 - t0), "members/s");
+    say("gzip random      %8.0f members/sec\n", lookups / (t1 - t0));
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+    remove(filename);
+}
+
+// Synthetic archive contents: member sizes, the data is a shared pattern
+struct dataset_t
+{
+    const char *name;
+    vector<size_t> sizes;
+    size_t archive_size;
+};
+
+static const size_t s_huge = 16 * 1024 * 1024;
+static vector<char> s_pattern;
+
+static void member_header(mtar_header_t *h, const dataset_t& ds, size_t i)
+{
+    memset(h, 0, sizeof(*h));
+    sprintf(h->name, "%s/%03d/member-%07d.bin", ds.name, (int)(i / 1000), (int)i);
+    h->size = ds.sizes[i];
+    h->mode = 0644;
+    h->mtime = 1500000000;
+    h->type = MTAR_TREG;
+}
+
+// Many tiny files, a few huge ones, and a mix of the two
+static vector<dataset_t> make_datasets(int count)
+{
+    vector<dataset_t> sets(3);
+    mtar_header_t h;
+    size_t tiny = count / 10 > 0 ? count / 10 : 1;
+    sets[0].name = "tiny";
+    for (size_t i = 0; i < tiny; i++)
+        sets[0].sizes.push_back(i * 37 % 1024);
+    sets[1].name = "huge";
+    sets[1].sizes.assign(4, s_huge);
+    sets[2].name = "mixed";
+    for (size_t i = 0; i < tiny / 2 + 1; i++)
+        sets[2].sizes.push_back(i % 250 == 0 ? 1024 * 1024 : i * 37 % 4096);
+    for (size_t k = 0; k < sets.size(); k++)
+    {
+        sets[k].archive_size = 1024;
+        for (size_t i = 0; i < sets[k].sizes.size(); i++)
+        {
+            member_header(&h, sets[k], i);
+            sets[k].archive_size += mtar_member_size(&h);
+        }
+    }
+    s_pattern.resize(s_huge);
+    for (size_t i = 0; i < s_huge; i++)
+        s_pattern[i] = (char)(i * 131 + (i >> 9));
+    return sets;
+}
+
+static void write_dataset(mtar_t *tar, const dataset_t& ds)
+{
+    mtar_header_t h;
+    for (size_t i = 0; i < ds.sizes.size(); i++)
+    {
+        member_header(&h, ds, i);
+        if (mtar_write_header(tar, &h) || mtar_write_data(tar, &s_pattern[0], h.size))
+            abort();
+    }
+    if (mtar_finalize(tar))
+        abort();
+}
+
+static void read_dataset(mtar_t *tar, const dataset_t& ds, vector<char>& buf)
+{
+    mtar_header_t h;
+    size_t n = 0;
+    buf.resize(s_huge);
+    while (mtar_read_header(tar, &h) == MTAR_ESUCCESS)
+    {
+        if (mtar_read_data(tar, &buf[0], h.size))
+            abort();
+        mtar_next(tar);
+        n++;
+    }
+    if (n != ds.sizes.size())
+        abort();
+}
+
+// The custom-callback backend from the README, over a vector
+struct vector_stream_t
+{
+    vector<char> data;
+    size_t pos;
+};
+
+static int vector_write(mtar_t *tar, const void *data, size_t size)
+{
+    vector_stream_t *vs = (vector_stream_t *)tar->stream;
+    if (vs->pos + size > vs->data.size())
+        vs->data.resize(vs->pos + size);
+    memcpy(&vs->data[vs->pos], data, size);
+    vs->pos += size;
+    return MTAR_ESUCCESS;
+}
+
+static int vector_read(mtar_t *tar, void *data, size_t size)
+{
+    vector_stream_t *vs = (vector_stream_t *)tar->stream;
+    if (vs->pos + size > vs->data.size())
+        return MTAR_EREADFAIL;
+    memcpy(data, &vs->data[vs->pos], size);
+    vs->pos += size;
+    return MTAR_ESUCCESS;
+}
+
+static int vector_seek(mtar_t *tar, size_t pos)
+{
+    ((vector_stream_t *)tar->stream)->pos = pos;
+    return MTAR_ESUCCESS;
+}
+
+static void open_vector(mtar_t *tar, vector_stream_t *vs)
+{
+    memset(tar, 0, sizeof(*tar));
+    vs->pos = 0;
+    tar->read = vector_read;
+    tar->write = vector_write;
+    tar->seek = vector_seek;
+    tar->stream = vs;
+}
+
+// Sequential write and read of each dataset through each backend
+static void bench_backends(const vector<dataset_t>& sets)
+{
+    const char *filename = "microtar-bench.tar";
+    static const char *backends[] = { "file", "memory", "callback" };
+    vector_stream_t vs;
+    vector<char> buf;
+    mtar_t tar, memory;
+
+    for (size_t k = 0; k < sets.size(); k++)
+    {
+        const dataset_t& ds = sets[k];
+        double mb = (double)ds.archive_size / (1024 * 1024);
+        double secs[2][3];
+        for (int b = 0; b < 3; b++)
+        {
+            double t0 = now();
+            if (b == 0)
+            {
+                mtar_open(&tar, filename, "w");
+                write_dataset(&tar, ds);
+                mtar_close(&tar);
+            }
+            else if (b == 1)
+            {
+                mtar_open_memory(&memory, NULL, 0);
+                write_dataset(&memory, ds);
+            }
+            else
+            {
+                vs.data.clear();
+                open_vector(&tar, &vs);
+                write_dataset(&tar, ds);
+            }
+            double t1 = now();
+            if (b == 0)
+                mtar_open(&tar, filename, "r");
+            else if (b == 1)
+                mtar_open_memory(&tar, memory.memory, memory.memory_size);
+            else
+                open_vector(&tar, &vs);
+            read_dataset(&tar, ds, buf);
+            mtar_close(&tar);
+            double t2 = now();
+            secs[0][b] = t1 - t0;
+            secs[1][b] = t2 - t1;
+            result(string("write.") + backends[b] + "." + ds.name, mb / (t1 - t0), "MB/s");
+            result(string("read.") + backends[b] + "." + ds.name, mb / (t2 - t1), "MB/s");
+            if (ds.sizes.size() > 100)
+                result(string("parse.") + backends[b] + "." + ds.name,
+                       ds.sizes.size() / (t2 - t1), "members/s");
+        }
+        mtar_close(&memory);
+        vector<char>().swap(vs.data);
+        for (int op = 0; op < 2; op++)
+        {
+            say("%-5s %-10s", op ? "read" : "write", ds.name);
+            for (int b = 0; b < 3; b++)
+                say(" %s %8.1f MB/s ", backends[b], mb / secs[op][b]);
+            say("\n");
+        }
+    }
+    remove(filename);
+}
+
+// mtar_find() cost as the archive grows, by scanning and through an index
+static void bench_find(int count)
+{
+    mtar_t writer, tar;
+    mtar_header_t h;
+    mtar_index_t idx;
+    char name[64];
+
+    for (int n = 100; n <= count; n *= 10)
+    {
+        make_headers(&writer, n);
+        mtar_open_memory(&tar, writer.memory, writer.memory_size);
+        int lookups = 1000000 / n > 10 ? 1000000 / n : 10;
+        double t0 = now();
+        for (int i = 0; i < lookups; i++)
+        {
+            sprintf(name, "assets/img/file-%08d.png", (int)((i * 7919LL) % n));
+            if (mtar_find(&tar, name, &h))
+                abort();
+        }
+        double t1 = now();
+        mtar_index_build(&tar, &idx);
+        const int indexed = 100000;
+        double t2 = now();
+        for (int i = 0; i < indexed; i++)
+        {
+            sprintf(name, "assets/img/file-%08d.png", (int)((i * 7919LL) % n));
+            if (mtar_find(&tar, name, &h))
+                abort();
+        }
+        double t3 = now();
+        double scan_us = result("find.scan." + to_string(n),
+                                (t1 - t0) * 1e6 / lookups, "us");
+        double index_us = result("find.index." + to_string(n),
+                                 (t3 - t2) * 1e6 / indexed, "us");
+        say("find %-11d scan %10.2f us   index %6.2f us\n", n, scan_us, index_us);
+        mtar_close(&tar);
+        mtar_close(&writer);
+        mtar_index_free(&idx);
+    }
+}
+
+// Growth of the memory backend's output, counted through the allocator hooks
+struct growth_t
+{
+    int reallocs;
+    size_t moved;
+};
+
+static void *growth_alloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *growth_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+    growth_t *g = (growth_t *)ctx;
+    g->reallocs++;
+    g->moved += old_size;
+    return realloc(ptr, size);
+}
+
+static void growth_free(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+static void bench_memory_growth(const dataset_t& ds)
+{
+    static const char *modes[] = { "grow", "reserve", "chunked" };
+    growth_t g;
+    mtar_allocator_t allocator = { growth_alloc, growth_realloc, growth_free, &g };
+    mtar_t tar;
+    double mb = (double)ds.archive_size / (1024 * 1024);
+
+    for (int m = 0; m < 3; m++)
+    {
+        memset(&g, 0, sizeof(g));
+        double t0 = now();
+        mtar_open_memory(&tar, NULL, 0);
+        mtar_set_allocator(&tar, &allocator);
+        if (m == 1)
+            mtar_memory_reserve(&tar, ds.archive_size);
+        else if (m == 2)
+            mtar_set_chunked(&tar, 1024 * 1024);
+        write_dataset(&tar, ds);
+        double t1 = now();
+        mtar_close(&tar);
+        result(string("memory_write.") + modes[m], mb / (t1 - t0), "MB/s");
+        result(string("memory_write.") + modes[m] + ".reallocs", g.reallocs, "calls");
+        result(string("memory_write.") + modes[m] + ".moved",
+               g.moved / (1024.0 * 1024), "MiB");
+        say("memory %-9s %8.1f MB/s   %4d reallocs   %8.1f MiB moved at most\n",
+            modes[m], mb / (t1 - t0), g.reallocs, g.moved / (1024.0 * 1024));
+    }
+}
+
+static void print_json(int count, int threads)
+{
+    printf("{\n  \"version\": \"%s\",\n", MTAR_VERSION);
+    printf("  \"count\": %d,\n  \"threads\": %d,\n", count, threads);
+    printf("  \"peak_rss_mib\": %.1f,\n  \"results\": [\n", peak_rss_mib());
+    for (size_t i = 0; i < s_results.size(); i++)
+    {
+        const result_t& r = s_results[i];
+        printf("    { \"name\": \"%s\", \"value\": %.9g, \"unit\": \"%s\" }%s\n",
+               r.name.c_str(), r.value, r.unit, i + 1 < s_results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "--json"))
+    {
+        s_json = true;
+        argc--;
+        argv++;
+    }
+    int count = (argc > 1) ? atoi(argv[1]) : 200000;
+    int threads = (argc > 2) ? atoi(argv[2]) : 4;
+    if (count <= 0 || threads <= 0)
+    {
+        printf("usage: microtar-bench [--json] [header-count [threads]]\n");
+        return 1;
+    }
+    vector<dataset_t> sets = make_datasets(count);
+    bench_header_codec(count);
+    bench_find(count);
+    report_rss("codec");
+    bench_backends(sets);
+    report_rss("backends");
+    bench_memory_growth(sets[2]);
+    report_rss("memory");
+    bench_gzip(count / 100 > 0 ? count / 100 : 1, threads);
+    report_rss("gzip");
+    if (s_json)
+        print_json(count, threads);
+    return 0;
+}
@@ -22,16 +22,79 @@
  */
 
 #define _CRT_SECURE_NO_WARNINGS
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE   /* copy_file_range(), splice() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define MTAR_SSE2
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+  #include <immintrin.h>
+  #define MTAR_AVX2
+#endif
+
+#ifdef _WIN32
+  #include <windows.h>
+#elif defined(HAVE_MMAP)
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+#endif
+
+/* Parallel extraction and creation need the POSIX *at() calls, pread() and
+ * pwrite() */
+#if !defined(_WIN32) && defined(HAVE_OPENAT) && defined(HAVE_PREAD)
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #define MTAR_PARALLEL
+  #ifdef HAVE_SENDFILE
+    #include <sys/sendfile.h>
+  #endif
+#endif
+#ifdef HAVE_PTHREAD
+  #include <pthread.h>
+#endif
+#ifdef HAVE_ZLIB
+  #include <zlib.h>
+#endif
+
+/* Batched reads use io_uring through raw syscalls, no liburing needed */
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H) && \
+    defined(MTAR_PARALLEL)
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <sys/uio.h>
+  #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+    #define MTAR_URING
+  #endif
+#endif
+
+/* Extraction resolves names with openat2() where the kernel headers have it */
+#if defined(__linux__) && defined(HAVE_LINUX_OPENAT2_H) && \
+    defined(MTAR_PARALLEL)
+  #include <linux/openat2.h>
+  #include <sys/syscall.h>
+  #ifdef __NR_openat2
+    #define MTAR_OPENAT2
+  #endif
+#endif
 
 #include "microtar.h"
 
 typedef struct {
-  char name[MTAR_NAMEMAX + 1];
+  char name[100];
   char mode[8];
   char owner[8];
   char group[8];
@@ -39,517 +102,6158 @@ typedef struct {
   char mtime[12];
   char checksum[8];
   char type;
-  char linkname[MTAR_NAMEMAX + 1];
-  char _padding[255];
+  char linkname[100];
+  char magic[6];        /* ustar only */
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char _padding[12];
 } mtar_raw_header_t;
 
+/* Extension header types, resolved when reading */
+#define MTAR_TPAX     'x'
+#define MTAR_TPAXG    'g'
+#define MTAR_TGNULONG 'L'
+#define MTAR_TGNULINK 'K'
+
+/* Largest extension header we are willing to load */
+#define MTAR_EXTMAX   (1024 * 1024)
+
+/* Data of a member of unknown size kept in memory when the output cannot
+ * seek; the rest goes to a temporary file */
+#ifndef MTAR_SPILLMAX
+  #define MTAR_SPILLMAX (1024 * 1024)
+#endif
+
+/* Largest pax data mtar_write_header() produces: path, linkpath, mtime and
+ * the tombstone mark */
+#define MTAR_PAXMAX   (2 * (MTAR_PATHMAX + 32) + 96)
+
+/* Vendor pax record marking a member deleted by a later tombstone */
+#define MTAR_PAXDELETED "MTAR.deleted"
+
+/* Largest encoded header: pax header and data, then the header itself */
+#define MTAR_HEADERMAX (512 + ((MTAR_PAXMAX + 511) / 512) * 512 + 512)
+
+/* Overrides collected from extension headers */
+enum {
+  MTAR_XPATH  = 1,
+  MTAR_XLINK  = 2,
+  MTAR_XSIZE  = 4,
+  MTAR_XMTIME = 8,
+  MTAR_XDELETED = 16
+};
+
+typedef struct {
+  unsigned flags;
+  size_t size;
+  unsigned mtime;
+  unsigned mtime_nsec;
+  char name[MTAR_PATHMAX + 1];
+  char linkname[MTAR_PATHMAX + 1];
+} mtar_ext_t;
+
 static size_t mtar_round_up(size_t n, size_t incr) {
   return n + (incr - n % incr) % incr;
 }
 
-static unsigned mtar_checksum(const mtar_raw_header_t* rh) {
-  unsigned i;
-  const unsigned char *p = (const unsigned char*) rh;
-  unsigned res = 256;
-  for (i = 0; i < offsetof(mtar_raw_header_t, checksum); i++) {
-    res += p[i];
-  }
-  for (i = offsetof(mtar_raw_header_t, type); i < sizeof(*rh); i++) {
-    res += p[i];
+#ifndef MTAR_SSE2
+static unsigned mtar_checksum_scalar(const unsigned char *p) {
+  unsigned i, res = 0;
+  for (i = 0; i < 512; i += 4) {
+    res += p[i] + p[i + 1] + p[i + 2] + p[i + 3];
   }
   return res;
 }
-
-static int mtar_tread(mtar_t *tar, void *data, size_t size) {
-  int err = tar->read(tar, data, size);
-  tar->pos += size;
-  return err;
+  #define mtar_checksum_base mtar_checksum_scalar
+#else
+static unsigned mtar_checksum_sse2(const unsigned char *p) {
+  __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+  unsigned i;
+  for (i = 0; i < 512; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+  }
+  return (unsigned)_mm_cvtsi128_si32(acc) +
+         (unsigned)_mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
 }
+  #define mtar_checksum_base mtar_checksum_sse2
+#endif
 
-static int mtar_twrite(mtar_t *tar, const void *data, size_t size) {
-  int err = tar->write(tar, data, size);
-  tar->pos += size;
-  return err;
+#ifdef MTAR_AVX2
+__attribute__((target("avx2")))
+static unsigned mtar_checksum_avx2(const unsigned char *p) {
+  __m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+  __m128i sum;
+  unsigned i;
+  for (i = 0; i < 512; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+  }
+  sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                      _mm256_extracti128_si256(acc, 1));
+  return (unsigned)_mm_cvtsi128_si32(sum) +
+         (unsigned)_mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
 }
 
-static int mtar_write_null_bytes(mtar_t *tar, size_t n) {
-  size_t i;
-  int err;
-  char nul = '\0';
-  for (i = 0; i < n; i++) {
-    err = mtar_twrite(tar, &nul, 1);
-    if (err) {
-      return err;
-    }
+/* Picked once at load time, before any thread can parse a header */
+static unsigned (*mtar_checksum_impl)(const unsigned char *p) =
+  mtar_checksum_base;
+
+__attribute__((constructor))
+static void mtar_checksum_init(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    mtar_checksum_impl = mtar_checksum_avx2;
   }
-  return MTAR_ESUCCESS;
 }
-
-static int mtar_raw_to_header(mtar_header_t *h, const mtar_raw_header_t *rh) {
-  unsigned chksum1, chksum2;
-#ifdef HAVE_LONG_LONG
-  long long size;
 #else
-  long size;
+  #define mtar_checksum_impl mtar_checksum_base
 #endif
 
-  if (strlen(rh->name) > MTAR_NAMEMAX || strlen(rh->linkname) > MTAR_NAMEMAX)
-    return MTAR_ENAMELONG;
-
-  /* If the checksum starts with a null byte we assume the record is NULL */
-  if (*rh->checksum == '\0') {
-    return MTAR_ENULLRECORD;
+static unsigned mtar_checksum(const mtar_raw_header_t* rh) {
+  const unsigned char *p = (const unsigned char*) rh;
+  unsigned i, res;
+  /* Sum the whole record, then count the checksum field as spaces */
+  res = mtar_checksum_impl(p) + 8 * ' ';
+  for (i = 0; i < sizeof(rh->checksum); i++) {
+    res -= (unsigned char)rh->checksum[i];
   }
+  return res;
+}
 
-  /* Build and compare checksum */
-  chksum1 = mtar_checksum(rh);
-  sscanf(rh->checksum, "%7o", &chksum2);
-  if (chksum1 != chksum2) {
-    return MTAR_EBADCHKSUM;
+static int mtar_parse_number(const char *p, size_t n, size_t *res) {
+  size_t i = 0, v = 0;
+  /* GNU base-256: high bit set, then a big-endian two's complement number */
+  if ((unsigned char)p[0] & 0x80) {
+    if ((unsigned char)p[0] & 0x40) {
+      return MTAR_EBADFIELD;
+    }
+    v = (unsigned char)p[0] & 0x3F;
+    for (i = 1; i < n; i++) {
+      if (v > ((size_t)-1 >> 8)) {
+        return MTAR_ETOOLARGE;
+      }
+      v = (v << 8) | (unsigned char)p[i];
+    }
+    *res = v;
+    return MTAR_ESUCCESS;
   }
-
-  /* Load raw header into header */
-  sscanf(rh->mode, "%7o", &h->mode);
-  sscanf(rh->owner, "%7o", &h->owner);
-  size = 0;
-#ifdef HAVE_LONG_LONG
-  sscanf(rh->size, "%11llo", &size);
-  h->size = (size_t)size;
-#else
-  sscanf(rh->size, "%11lo", &size);
-  h->size = (size_t)size;
-#endif
-  sscanf(rh->mtime, "%11o", &h->mtime);
-  h->type = (unsigned)rh->type;
-
-  if (h->size > MTAR_SIZEMAX)
-    return MTAR_ETOOLARGE;
-
-  strcpy(h->name, rh->name);
-  strcpy(h->linkname, rh->linkname);
-
+  /* Leading spaces, octal digits, then only NULs and spaces */
+  while (i < n && p[i] == ' ') {
+    i++;
+  }
+  for (; i < n && (unsigned)(p[i] - '0') < 8; i++) {
+    if (v > ((size_t)-1 >> 3)) {
+      return MTAR_ETOOLARGE;
+    }
+    v = (v << 3) | (size_t)(p[i] - '0');
+  }
+  for (; i < n; i++) {
+    if (p[i] != '\0' && p[i] != ' ') {
+      return MTAR_EBADFIELD;
+    }
+  }
+  *res = v;
   return MTAR_ESUCCESS;
 }
 
-static int mtar_header_to_raw(mtar_raw_header_t *rh, const mtar_header_t *h) {
-  unsigned chksum;
+static int mtar_parse_unsigned(const char *p, size_t n, unsigned *res) {
+  size_t v;
+  int err = mtar_parse_number(p, n, &v);
+  *res = (unsigned)v;
+  return err;
+}
 
-  if (h->size > MTAR_SIZEMAX) {
-    return MTAR_ETOOLARGE;
+static void mtar_format_number(char *p, size_t n, size_t v) {
+  char digits[24];
+  size_t len = 0, x = v;
+  /* Same as sprintf("%o"): no padding, NUL-terminated */
+  do {
+    digits[len++] = (char)('0' + (x & 7));
+    x >>= 3;
+  } while (x);
+  if (len < n) {
+    while (len) {
+      *p++ = digits[--len];
+    }
+    *p = '\0';
+    return;
   }
+  /* Too wide for octal, fall back to GNU base-256 */
+  while (--n) {
+    p[n] = (char)(v & 0xFF);
+    v >>= 8;
+  }
+  p[0] = (char)0x80;
+}
 
-  /* Load header into raw header */
-  memset(rh, 0, sizeof(*rh));
-  sprintf(rh->mode, "%o", h->mode);
-  sprintf(rh->owner, "%o", h->owner);
-#ifdef HAVE_LONG_LONG
-  sprintf(rh->size, "%llo", (unsigned long long)h->size);
-#else
-  sprintf(rh->size, "%lo", (unsigned long)h->size);
-#endif
-  sprintf(rh->mtime, "%o", h->mtime);
-  rh->type = (char)(h->type ? h->type : MTAR_TREG);
+static size_t mtar_field_len(const char *p, size_t n) {
+  /* Fields fill their whole width when they are not NUL-terminated */
+  const char *end = (const char *)memchr(p, '\0', n);
+  return end ? (size_t)(end - p) : n;
+}
 
-  if (strlen(h->name) > MTAR_NAMEMAX || strlen(h->linkname) > MTAR_NAMEMAX)
-    return MTAR_ENAMELONG;
+/* Set in mtar_t.flags while the current header is cached in stream mode */
+#define MTAR_FHEADER 0x8000
+/* Set in mtar_t.flags while the buffer holds data not yet written */
+#define MTAR_FDIRTY  0x4000
+/* Set in mtar_t.flags while a member of unknown size is being written */
+#define MTAR_FUNSIZED 0x2000
 
-  strcpy(rh->name, h->name);
-  strcpy(rh->linkname, h->linkname);
+static const char mtar_zero_record[512];
 
-  /* Calculate and write checksum */
-  chksum = mtar_checksum(rh);
-  sprintf(rh->checksum, "%06o", chksum);
-  rh->checksum[7] = ' ';
+/* Backend calls go through these, so that they can be counted */
+#ifdef MTAR_STATS
+  #define MTAR_READ(tar, data, size)  mtar_stats_read(tar, data, size)
+  #define MTAR_WRITE(tar, data, size) mtar_stats_write(tar, data, size)
+  #define MTAR_SEEK(tar, pos)         mtar_stats_seek(tar, pos)
+  #define MTAR_COUNT(tar, field, n) \
+    do { if ((tar)->stats) (tar)->stats->field += (n); } while (0)
 
-  return MTAR_ESUCCESS;
+/* Monotonic nanoseconds */
+static size_t mtar_clock(void) {
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (size_t)(now.QuadPart * 1e9 / freq.QuadPart);
+#elif defined(HAVE_CLOCK_GETTIME)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (size_t)ts.tv_sec * 1000000000 + (size_t)ts.tv_nsec;
+#else
+  return (size_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
 }
 
-const char* mtar_strerror(int err) {
-  switch (err) {
-    case MTAR_ESUCCESS     : return "success";
-    case MTAR_EFAILURE     : return "failure";
-    case MTAR_EOPENFAIL    : return "could not open";
-    case MTAR_EREADFAIL    : return "could not read";
-    case MTAR_EWRITEFAIL   : return "could not write";
-    case MTAR_ESEEKFAIL    : return "could not seek";
-    case MTAR_EBADCHKSUM   : return "bad checksum";
-    case MTAR_ENULLRECORD  : return "null record";
-    case MTAR_ENOTFOUND    : return "file not found";
-    case MTAR_ENAMELONG    : return "name too long";
-    case MTAR_ETOOLARGE    : return "file too large";
+static void mtar_stats_time(size_t *hist, double *total, size_t start) {
+  size_t ns = mtar_clock() - start;
+  int k = 0;
+  while (k < MTAR_HISTBUCKETS - 1 && (ns >> (k + 1))) {
+    k++;
   }
-  return "unknown error";
+  hist[k]++;
+  *total += ns / 1e9;
 }
 
-static int mtar_file_write(mtar_t *tar, const void *data, size_t size) {
-  size_t res = fwrite(data, 1, size, (FILE *)tar->stream);
-  return (res == size) ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+static int mtar_stats_read(mtar_t *tar, void *data, size_t size) {
+  mtar_stats_t *s = tar->stats;
+  size_t start;
+  int err;
+  if (!s) {
+    return tar->read(tar, data, size);
+  }
+  start = mtar_clock();
+  err = tar->read(tar, data, size);
+  mtar_stats_time(s->read_hist, &s->read_time, start);
+  s->reads++;
+  if (!err) {
+    s->bytes_read += size;
+    s->position += size;
+  }
+  return err;
 }
 
-static int mtar_file_read(mtar_t *tar, void *data, size_t size) {
-  size_t res = fread(data, 1, size, (FILE *)tar->stream);
-  return (res == size) ? MTAR_ESUCCESS : MTAR_EREADFAIL;
+static int mtar_stats_write(mtar_t *tar, const void *data, size_t size) {
+  mtar_stats_t *s = tar->stats;
+  size_t start;
+  int err;
+  if (!s) {
+    return tar->write(tar, data, size);
+  }
+  start = mtar_clock();
+  err = tar->write(tar, data, size);
+  mtar_stats_time(s->write_hist, &s->write_time, start);
+  s->writes++;
+  if (!err) {
+    s->bytes_written += size;
+    s->position += size;
+  }
+  return err;
 }
 
-static int mtar_file_seek(mtar_t *tar, size_t offset) {
-#if defined(HAVE__FSEEKI64) && (defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__))
-  int res = _fseeki64((FILE *)tar->stream, offset, SEEK_SET);
-#elif defined(HAVE_FSEEKO) && (defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__))
-  int res = fseeko((FILE *)tar->stream, offset, SEEK_SET);
+static int mtar_stats_seek(mtar_t *tar, size_t pos) {
+  mtar_stats_t *s = tar->stats;
+  size_t start;
+  int err;
+  if (!s) {
+    return tar->seek(tar, pos);
+  }
+  start = mtar_clock();
+  err = tar->seek(tar, pos);
+  mtar_stats_time(s->seek_hist, &s->seek_time, start);
+  s->seeks++;
+  if (!err) {
+    s->seek_distance += pos > s->position ? pos - s->position
+                                          : s->position - pos;
+    s->position = pos;
+  }
+  return err;
+}
 #else
-  int res = fseek((FILE *)tar->stream, offset, SEEK_SET);
+  #define MTAR_READ(tar, data, size)  (tar)->read(tar, data, size)
+  #define MTAR_WRITE(tar, data, size) (tar)->write(tar, data, size)
+  #define MTAR_SEEK(tar, pos)         (tar)->seek(tar, pos)
+  #define MTAR_COUNT(tar, field, n)   ((void)0)
 #endif
-  return (res == 0) ? MTAR_ESUCCESS : MTAR_ESEEKFAIL;
-}
 
-static int mtar_file_close(mtar_t *tar) {
-  fclose((FILE *)tar->stream);
-  return MTAR_ESUCCESS;
+static int mtar_flush_buffer(mtar_t *tar) {
+  int err = MTAR_ESUCCESS;
+  if (tar->flags & MTAR_FDIRTY) {
+    tar->flags &= ~MTAR_FDIRTY;
+    if (tar->buffer_len) {
+      err = MTAR_WRITE(tar, tar->buffer, tar->buffer_len);
+    }
+    tar->buffer_start += tar->buffer_len;
+    tar->buffer_len = 0;
+  }
+  return err;
 }
 
-int mtar_open_fp(mtar_t *tar, void *fp) {
-  /* Init tar struct and functions */
-  memset(tar, 0, sizeof(*tar));
-  if (!fp) return MTAR_EOPENFAIL;
-
-  tar->write = mtar_file_write;
-  tar->read = mtar_file_read;
-  tar->seek = mtar_file_seek;
-  tar->close = mtar_file_close;
-  tar->stream = fp;
+static int mtar_position(mtar_t *tar) {
+  int err;
+  /* The backend sits right after the buffered data; seeks are deferred until
+   * the backend is actually used */
+  if (tar->pos == tar->buffer_start + tar->buffer_len) {
+    return MTAR_ESUCCESS;
+  }
+  if (!tar->seek || (tar->flags & MTAR_FSTREAM)) {
+    return MTAR_ESEEKFAIL;
+  }
+  err = MTAR_SEEK(tar, tar->pos);
+  tar->buffer_start = err ? (size_t)-1 : tar->pos;
+  tar->buffer_len = 0;
+  return err;
+}
 
-  /* Return ok */
+static int mtar_fill(mtar_t *tar, size_t size) {
+  size_t n, keep = 0;
+  int err;
+  /* Keep the current header buffered when reading on from it, since readers
+   * seek back to it after the data */
+  if (tar->pos == tar->buffer_start + tar->buffer_len &&
+      tar->last_header >= tar->buffer_start && tar->last_header < tar->pos &&
+      tar->pos - tar->last_header + size <= tar->buffer_capacity) {
+    keep = tar->pos - tar->last_header;
+    memmove(tar->buffer, &tar->buffer[tar->last_header - tar->buffer_start],
+            keep);
+    tar->buffer_start = tar->last_header;
+    tar->buffer_len = keep;
+  } else {
+    err = mtar_position(tar);
+    if (err) {
+      return err;
+    }
+    tar->buffer_start = tar->pos;
+    tar->buffer_len = 0;
+  }
+  /* Read ahead as far as a valid archive is known to extend */
+  n = size;
+  if (tar->buffer_limit > tar->pos && tar->buffer_limit - tar->pos > n) {
+    n = tar->buffer_limit - tar->pos;
+  }
+  if (n > tar->buffer_capacity - keep) {
+    n = tar->buffer_capacity - keep;
+  }
+  err = MTAR_READ(tar, &tar->buffer[keep], n);
+  if (err && n > size && tar->seek && !(tar->flags & MTAR_FSTREAM)) {
+    /* Read-ahead ran past the end of a truncated archive */
+    n = size;
+    err = MTAR_SEEK(tar, tar->pos);
+    if (!err) {
+      err = MTAR_READ(tar, &tar->buffer[keep], n);
+    }
+  }
+  if (err) {
+    tar->buffer_start = (size_t)-1;
+    tar->buffer_len = 0;
+    return err;
+  }
+  tar->buffer_len += n;
   return MTAR_ESUCCESS;
 }
 
-int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
-  FILE *fp;
-  int err;
-  mtar_header_t h;
+static void mtar_extend_limit(mtar_t *tar, size_t header, size_t size) {
+  /* The data is followed by at least one more record */
+  size_t end = header + sizeof(mtar_raw_header_t) * 2 +
+               mtar_round_up(size, 512);
+  if (end > tar->buffer_limit) {
+    tar->buffer_limit = end;
+  }
+}
 
-  /* Assure mode is always binary */
-  if ( strchr(mode, 'r') ) mode = "rb";
-  if ( strchr(mode, 'w') ) mode = "wb";
-  if ( strchr(mode, 'a') ) mode = "ab";
+static int mtar_tread(mtar_t *tar, void *data, size_t size) {
+  char *p = (char *)data;
+  size_t n;
+  int err;
 
-  /* Open file */
-  fp = fopen(filename, mode);
-  if (!fp) {
-    return MTAR_EOPENFAIL;
+  if (!tar->buffer) {
+    err = MTAR_READ(tar, data, size);
+    tar->pos += size;
+    return err;
   }
 
-  err = mtar_open_fp(tar, fp);
+  err = mtar_flush_buffer(tar);
   if (err) {
     return err;
   }
-
-  /* Read first header to check it is valid if mode is `r` */
-  if (*mode == 'r') {
-    err = mtar_read_header(tar, &h);
-    if (err != MTAR_ESUCCESS) {
-      mtar_close(tar);
-      return err;
+  while (size) {
+    if (tar->pos >= tar->buffer_start &&
+        tar->pos < tar->buffer_start + tar->buffer_len) {
+      /* Serve from the buffer */
+      n = tar->buffer_start + tar->buffer_len - tar->pos;
+      if (n > size) {
+        n = size;
+      }
+      memcpy(p, &tar->buffer[tar->pos - tar->buffer_start], n);
+    } else if (size >= tar->buffer_capacity) {
+      /* Large reads bypass the buffer */
+      n = size;
+      err = mtar_position(tar);
+      if (!err) {
+        err = MTAR_READ(tar, p, n);
+      }
+      tar->buffer_start = err ? (size_t)-1 : tar->pos + n;
+      tar->buffer_len = 0;
+      if (err) {
+        return err;
+      }
+    } else {
+      err = mtar_fill(tar, size);
+      if (err) {
+        return err;
+      }
+      continue;
     }
+    p += n;
+    size -= n;
+    tar->pos += n;
   }
-
-  /* Return ok */
   return MTAR_ESUCCESS;
 }
 
-#ifdef _WIN32
-  int mtar_open_w(mtar_t *tar, const wchar_t *filename, const wchar_t *mode) {
-    FILE *fp;
-    int err;
-    mtar_header_t h;
+static int mtar_twrite(mtar_t *tar, const void *data, size_t size) {
+  int err;
 
-    /* Assure mode is always binary */
-    if ( wcschr(mode, L'r') ) mode = L"rb";
-    if ( wcschr(mode, L'w') ) mode = L"wb";
-    if ( wcschr(mode, L'a') ) mode = L"ab";
+  /* Read-only backends have no write callback */
+  if (!tar->write) {
+    return MTAR_EUNSUPPORTED;
+  }
+  if (!tar->buffer) {
+    err = MTAR_WRITE(tar, data, size);
+    tar->pos += size;
+    return err;
+  }
 
-    /* Open file */
-    fp = _wfopen(filename, mode);
-    if (!fp) {
-      return MTAR_EOPENFAIL;
+  if (!(tar->flags & MTAR_FDIRTY)) {
+    err = mtar_position(tar);
+    if (err) {
+      return err;
     }
-
-    err = mtar_open_fp(tar, fp);
+    tar->buffer_start = tar->pos;
+    tar->buffer_len = 0;
+    tar->flags |= MTAR_FDIRTY;
+  }
+  if (tar->buffer_len + size > tar->buffer_capacity) {
+    err = mtar_flush_buffer(tar);
     if (err) {
       return err;
     }
-
-    /* Read first header to check it is valid if mode is `r` */
-    if (*mode == L'r') {
-      err = mtar_read_header(tar, &h);
-      if (err != MTAR_ESUCCESS) {
-        mtar_close(tar);
-        return err;
-      }
+    /* Large writes bypass the buffer */
+    if (size >= tar->buffer_capacity) {
+      err = MTAR_WRITE(tar, data, size);
+      tar->pos += size;
+      tar->buffer_start = tar->pos;
+      return err;
     }
-
-    /* Return ok */
-    return MTAR_ESUCCESS;
+    tar->flags |= MTAR_FDIRTY;
   }
-#endif
-
-int mtar_close(mtar_t *tar) {
-  if (tar->close)
-    return tar->close(tar);
+  memcpy(&tar->buffer[tar->buffer_len], data, size);
+  tar->buffer_len += size;
+  tar->pos += size;
   return MTAR_ESUCCESS;
 }
 
-int mtar_seek(mtar_t *tar, size_t pos) {
-  int err = tar->seek(tar, pos);
-  tar->pos = pos;
-  return err;
+static int mtar_skip(mtar_t *tar, size_t n) {
+  char buf[4096];
+  int err;
+  /* Read and discard; used in stream mode instead of seeking */
+  while (n) {
+    size_t k = n < sizeof(buf) ? n : sizeof(buf);
+    err = mtar_tread(tar, buf, k);
+    if (err) {
+      return err;
+    }
+    n -= k;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_write_null_bytes(mtar_t *tar, size_t n) {
+  int err;
+  MTAR_COUNT(tar, padding_bytes, n);
+  /* Write whole records of zeros at a time */
+  while (n) {
+    size_t k = n < sizeof(mtar_zero_record) ? n : sizeof(mtar_zero_record);
+    err = mtar_twrite(tar, mtar_zero_record, k);
+    if (err) {
+      return err;
+    }
+    n -= k;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_index_add(mtar_index_t *idx, const mtar_header_t *h,
+                          size_t offset, size_t data_offset);
+
+/* Stores a name of `n` bytes in `field`, or in `*slots` when it does not fit
+ * there, with `field` keeping the start of it. The slots are allocated on
+ * first use and hold the name, then the link target */
+static int mtar_store_name(char *field, const char **longname, char **slots,
+                           int which, const char *src, size_t n) {
+  char *slot;
+  *longname = NULL;
+  if (n > MTAR_NAMEMAX) {
+    if (!*slots) {
+      *slots = (char *)malloc(2 * (MTAR_PATHMAX + 1));
+      if (!*slots) {
+        return MTAR_ENOMEM;
+      }
+    }
+    slot = *slots + which * (MTAR_PATHMAX + 1);
+    memcpy(slot, src, n);
+    slot[n] = '\0';
+    *longname = slot;
+    n = MTAR_NAMEMAX;
+  }
+  memcpy(field, src, n);
+  field[n] = '\0';
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_raw_to_header(mtar_header_t *h, const mtar_raw_header_t *rh,
+                              char **slots) {
+  char path[sizeof(rh->prefix) + 1 + sizeof(rh->name)];
+  unsigned chksum;
+  size_t n, k;
+  int err;
+
+  /* If the checksum starts with a null byte we assume the record is NULL */
+  if (*rh->checksum == '\0') {
+    return MTAR_ENULLRECORD;
+  }
+
+  /* Build and compare checksum */
+  err = mtar_parse_unsigned(rh->checksum, sizeof(rh->checksum), &chksum);
+  if (err) {
+    return err;
+  }
+  if (mtar_checksum(rh) != chksum) {
+    return MTAR_EBADCHKSUM;
+  }
+
+  /* Load raw header into header */
+  if ((err = mtar_parse_unsigned(rh->mode, sizeof(rh->mode), &h->mode)) ||
+      (err = mtar_parse_unsigned(rh->owner, sizeof(rh->owner), &h->owner)) ||
+      (err = mtar_parse_number(rh->size, sizeof(rh->size), &h->size)) ||
+      (err = mtar_parse_unsigned(rh->mtime, sizeof(rh->mtime), &h->mtime))) {
+    return err;
+  }
+  h->mtime_nsec = 0;
+  h->type = (unsigned)rh->type;
+
+  if (h->size > MTAR_SIZEMAX)
+    return MTAR_ETOOLARGE;
+
+  /* Names; ustar splits long ones into prefix and name */
+  k = 0;
+  if (rh->prefix[0] && !memcmp(rh->magic, "ustar", 5)) {
+    k = mtar_field_len(rh->prefix, sizeof(rh->prefix));
+    memcpy(path, rh->prefix, k);
+    path[k++] = '/';
+  }
+  n = mtar_field_len(rh->name, sizeof(rh->name));
+  memcpy(&path[k], rh->name, n);
+  err = mtar_store_name(h->name, &h->longname, slots, 0, path, k + n);
+  if (err) {
+    return err;
+  }
+  n = mtar_field_len(rh->linkname, sizeof(rh->linkname));
+  return mtar_store_name(h->linkname, &h->longlink, slots, 1, rh->linkname,
+                         n);
+}
+
+static void mtar_finish_raw(mtar_raw_header_t *rh) {
+  unsigned chksum = mtar_checksum(rh);
+  int i;
+  /* Same as sprintf("%06o") followed by a space */
+  for (i = 6; i-- > 0; chksum >>= 3) {
+    rh->checksum[i] = (char)('0' + (chksum & 7));
+  }
+  rh->checksum[6] = '\0';
+  rh->checksum[7] = ' ';
+}
+
+static size_t mtar_pax_record(char *p, const char *key, const char *value,
+                              size_t n) {
+  char digits[24];
+  size_t len, k, d, base = strlen(key) + n + 3;
+  /* "<len> <key>=<value>\n" where <len> counts its own digits too */
+  for (d = 1; ; d++) {
+    len = base + d;
+    for (k = 0; len; len /= 10) {
+      digits[k++] = (char)('0' + len % 10);
+    }
+    if (k == d) {
+      break;
+    }
+  }
+  len = base + d;
+  while (k) {
+    *p++ = digits[--k];
+  }
+  *p++ = ' ';
+  k = strlen(key);
+  memcpy(p, key, k);
+  p[k] = '=';
+  memcpy(&p[k + 1], value, n);
+  p[k + 1 + n] = '\n';
+  return len;
+}
+
+static size_t mtar_format_mtime(char *p, unsigned mtime, unsigned nsec) {
+  char digits[24];
+  size_t k = 0, n = 0;
+  int i;
+  do {
+    digits[k++] = (char)('0' + mtime % 10);
+    mtime /= 10;
+  } while (mtime);
+  while (k) {
+    p[n++] = digits[--k];
+  }
+  p[n++] = '.';
+  for (i = 8; i >= 0; i--, nsec /= 10) {
+    p[n + i] = (char)('0' + nsec % 10);
+  }
+  return n + 9;
+}
+
+static int mtar_encode_header(const mtar_header_t *h, char *out,
+                              size_t *len) {
+  mtar_raw_header_t *rh = (mtar_raw_header_t *)(void *)out;
+  char pax[MTAR_PAXMAX], mtime[32];
+  const char *name = mtar_header_name(h), *linkname = mtar_header_linkname(h);
+  size_t i, n, paxlen = 0;
+  size_t name_len = strlen(name), link_len = strlen(linkname);
+
+  if (h->size > MTAR_SIZEMAX) {
+    return MTAR_ETOOLARGE;
+  }
+  if (name_len > MTAR_PATHMAX || link_len > MTAR_PATHMAX) {
+    return MTAR_ENAMELONG;
+  }
+
+  /* Load header into raw header */
+  memset(rh, 0, sizeof(*rh));
+  mtar_format_number(rh->mode, sizeof(rh->mode), h->mode);
+  mtar_format_number(rh->owner, sizeof(rh->owner), h->owner);
+  mtar_format_number(rh->size, sizeof(rh->size), h->size);
+  mtar_format_number(rh->mtime, sizeof(rh->mtime), h->mtime);
+  rh->type = (char)(h->type && h->type != MTAR_TDELETED ? h->type : MTAR_TREG);
+
+  /* Names that do not fit are split at a slash into the ustar prefix, and
+   * failing that stored in a pax header */
+  if (name_len <= sizeof(rh->name)) {
+    memcpy(rh->name, name, name_len);
+  } else {
+    n = 0;
+    for (i = name_len - sizeof(rh->name) - 1;
+         i < name_len - 1 && i <= sizeof(rh->prefix); i++) {
+      if (name[i] == '/') {
+        n = i;
+        break;
+      }
+    }
+    if (n) {
+      memcpy(rh->prefix, name, n);
+      memcpy(rh->name, &name[n + 1], name_len - n - 1);
+      memcpy(rh->magic, "ustar", 6);
+      memcpy(rh->version, "00", 2);
+    } else {
+      memcpy(rh->name, name, sizeof(rh->name));
+      paxlen += mtar_pax_record(&pax[paxlen], "path", name, name_len);
+    }
+  }
+  if (link_len <= sizeof(rh->linkname)) {
+    memcpy(rh->linkname, linkname, link_len);
+  } else {
+    memcpy(rh->linkname, linkname, sizeof(rh->linkname));
+    paxlen += mtar_pax_record(&pax[paxlen], "linkpath", linkname, link_len);
+  }
+  if (h->mtime_nsec) {
+    n = mtar_format_mtime(mtime, h->mtime, h->mtime_nsec);
+    paxlen += mtar_pax_record(&pax[paxlen], "mtime", mtime, n);
+  }
+  if (h->type == MTAR_TDELETED) {
+    /* Other tools see an empty file */
+    paxlen += mtar_pax_record(&pax[paxlen], MTAR_PAXDELETED, "1", 1);
+  }
+
+  if (!paxlen) {
+    mtar_finish_raw(rh);
+    *len = sizeof(*rh);
+    return MTAR_ESUCCESS;
+  }
+
+  /* Move the header behind a pax header and its data */
+  n = sizeof(*rh) + mtar_round_up(paxlen, 512);
+  memmove(&out[n], out, sizeof(*rh));
+  memset(out, 0, n);
+  memcpy(rh->name, "././@PaxHeader", 14);
+  mtar_format_number(rh->mode, sizeof(rh->mode), 0644);
+  mtar_format_number(rh->size, sizeof(rh->size), paxlen);
+  mtar_format_number(rh->mtime, sizeof(rh->mtime), h->mtime);
+  rh->type = MTAR_TPAX;
+  memcpy(rh->magic, "ustar", 6);
+  memcpy(rh->version, "00", 2);
+  mtar_finish_raw(rh);
+  memcpy(&out[sizeof(*rh)], pax, paxlen);
+  rh = (mtar_raw_header_t *)(void *)&out[n];
+  memcpy(rh->magic, "ustar", 6);
+  memcpy(rh->version, "00", 2);
+  mtar_finish_raw(rh);
+  *len = n + sizeof(*rh);
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_parse_decimal(const char *p, size_t n, size_t *res) {
+  size_t i, v = 0;
+  if (!n) {
+    return MTAR_EBADFIELD;
+  }
+  for (i = 0; i < n; i++) {
+    if ((unsigned)(p[i] - '0') >= 10) {
+      return MTAR_EBADFIELD;
+    }
+    if (v > ((size_t)-1 - 9) / 10) {
+      return MTAR_ETOOLARGE;
+    }
+    v = v * 10 + (size_t)(p[i] - '0');
+  }
+  *res = v;
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_parse_pax(mtar_ext_t *x, const char *p, size_t n) {
+  size_t i, len, klen, vlen, v;
+  const char *key, *value;
+  int err;
+
+  while (n) {
+    /* "<len> <key>=<value>\n" */
+    for (i = 0; i < n && p[i] != ' '; i++) {}
+    if (i == n || mtar_parse_decimal(p, i, &len) || len <= i + 1 ||
+        len > n || p[len - 1] != '\n') {
+      return MTAR_EBADFIELD;
+    }
+    key = &p[i + 1];
+    value = (const char *)memchr(key, '=', len - i - 2);
+    if (!value) {
+      return MTAR_EBADFIELD;
+    }
+    klen = (size_t)(value - key);
+    value++;
+    vlen = (size_t)(&p[len - 1] - value);
+
+    if ((klen == 4 && !memcmp(key, "path", 4)) ||
+        (klen == 8 && !memcmp(key, "linkpath", 8))) {
+      char *dst = (klen == 4) ? x->name : x->linkname;
+      if (vlen > MTAR_PATHMAX) {
+        return MTAR_ENAMELONG;
+      }
+      memcpy(dst, value, vlen);
+      dst[vlen] = '\0';
+      x->flags |= (klen == 4) ? MTAR_XPATH : MTAR_XLINK;
+    } else if (klen == 4 && !memcmp(key, "size", 4)) {
+      err = mtar_parse_decimal(value, vlen, &x->size);
+      if (err) {
+        return err;
+      }
+      if (x->size > MTAR_SIZEMAX) {
+        return MTAR_ETOOLARGE;
+      }
+      x->flags |= MTAR_XSIZE;
+    } else if (klen == 5 && !memcmp(key, "mtime", 5)) {
+      /* Seconds with an optional fraction */
+      const char *dot = (const char *)memchr(value, '.', vlen);
+      size_t secs = dot ? (size_t)(dot - value) : vlen;
+      err = mtar_parse_decimal(value, secs, &v);
+      if (err) {
+        return err;
+      }
+      x->mtime = (unsigned)v;
+      x->mtime_nsec = 0;
+      if (dot) {
+        unsigned scale = 100000000;
+        for (i = secs + 1; i < vlen; i++, scale /= 10) {
+          if ((unsigned)(value[i] - '0') >= 10) {
+            return MTAR_EBADFIELD;
+          }
+          x->mtime_nsec += (unsigned)(value[i] - '0') * scale;
+        }
+      }
+      x->flags |= MTAR_XMTIME;
+    } else if (klen == sizeof(MTAR_PAXDELETED) - 1 &&
+               !memcmp(key, MTAR_PAXDELETED, klen)) {
+      x->flags |= MTAR_XDELETED;
+    }
+    p += len;
+    n -= len;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_parse_ext(mtar_ext_t *x, unsigned type, const char *p,
+                          size_t n) {
+  char *dst;
+  switch (type) {
+    case MTAR_TPAX:
+      return mtar_parse_pax(x, p, n);
+    case MTAR_TGNULONG:
+    case MTAR_TGNULINK:
+      /* GNU long names are NUL-terminated data */
+      n = mtar_field_len(p, n);
+      if (n > MTAR_PATHMAX) {
+        return MTAR_ENAMELONG;
+      }
+      dst = (type == MTAR_TGNULONG) ? x->name : x->linkname;
+      memcpy(dst, p, n);
+      dst[n] = '\0';
+      x->flags |= (type == MTAR_TGNULONG) ? MTAR_XPATH : MTAR_XLINK;
+      return MTAR_ESUCCESS;
+  }
+  /* Global headers are ignored */
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_apply_ext(mtar_header_t *h, const mtar_ext_t *x,
+                          char **slots) {
+  int err;
+  if (x->flags & MTAR_XPATH) {
+    err = mtar_store_name(h->name, &h->longname, slots, 0, x->name,
+                          strlen(x->name));
+    if (err) {
+      return err;
+    }
+  }
+  if (x->flags & MTAR_XLINK) {
+    err = mtar_store_name(h->linkname, &h->longlink, slots, 1, x->linkname,
+                          strlen(x->linkname));
+    if (err) {
+      return err;
+    }
+  }
+  if (x->flags & MTAR_XSIZE) {
+    h->size = x->size;
+  }
+  if (x->flags & MTAR_XMTIME) {
+    h->mtime = x->mtime;
+    h->mtime_nsec = x->mtime_nsec;
+  }
+  if (x->flags & MTAR_XDELETED) {
+    h->type = MTAR_TDELETED;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_is_ext(unsigned type) {
+  return type == MTAR_TPAX || type == MTAR_TPAXG ||
+         type == MTAR_TGNULONG || type == MTAR_TGNULINK;
+}
+
+static int mtar_load_ext(mtar_t *tar, mtar_header_t *h) {
+  mtar_raw_header_t rh;
+  mtar_ext_t x;
+  size_t offset;
+  char *data;
+  int err;
+
+  /* Collect overrides until the member's own header turns up */
+  x.flags = 0;
+  offset = tar->last_header;
+  while (mtar_is_ext(h->type)) {
+    if (h->size > MTAR_EXTMAX) {
+      return MTAR_ETOOLARGE;
+    }
+    data = (char *)malloc(h->size + 1);
+    if (!data) {
+      return MTAR_ENOMEM;
+    }
+    err = mtar_tread(tar, data, h->size);
+    if (!err) {
+      err = mtar_parse_ext(&x, h->type, data, h->size);
+    }
+    free(data);
+    if (!err) {
+      err = mtar_skip(tar, mtar_round_up(h->size, 512) - h->size);
+    }
+    if (err) {
+      return err;
+    }
+    offset = tar->pos;
+    err = mtar_tread(tar, &rh, sizeof(rh));
+    if (err) {
+      return err;
+    }
+    err = mtar_raw_to_header(h, &rh, &tar->longnames);
+    if (err) {
+      return err == MTAR_ENULLRECORD ? MTAR_EBADFIELD : err;
+    }
+    mtar_extend_limit(tar, offset, h->size);
+  }
+  err = mtar_apply_ext(h, &x, &tar->longnames);
+  if (err) {
+    return err;
+  }
+  if (x.flags & MTAR_XSIZE) {
+    mtar_extend_limit(tar, offset, h->size);
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_load_header(mtar_t *tar, mtar_header_t *h) {
+  mtar_raw_header_t rh;
+  int err;
+  /* Reads the member's header records, leaving the position at its data */
+  tar->last_header = tar->pos;
+  err = mtar_tread(tar, &rh, sizeof(rh));
+  if (err) {
+    return err;
+  }
+  err = mtar_raw_to_header(h, &rh, &tar->longnames);
+  if (err) {
+    if (err == MTAR_EBADCHKSUM) {
+      MTAR_COUNT(tar, checksum_errors, 1);
+    }
+    return err;
+  }
+  MTAR_COUNT(tar, headers, 1);
+  mtar_extend_limit(tar, tar->last_header, h->size);
+  if (mtar_is_ext(h->type)) {
+    return mtar_load_ext(tar, h);
+  }
+  return MTAR_ESUCCESS;
+}
+
+static void mtar_copy_header(mtar_header_t *dst, const mtar_header_t *src) {
+  /* Avoids copying the unused tails of the name buffers */
+  dst->mode = src->mode;
+  dst->owner = src->owner;
+  dst->size = src->size;
+  dst->mtime = src->mtime;
+  dst->mtime_nsec = src->mtime_nsec;
+  dst->type = src->type;
+  strcpy(dst->name, src->name);
+  strcpy(dst->linkname, src->linkname);
+  dst->longname = src->longname;
+  dst->longlink = src->longlink;
+}
+
+const char *mtar_header_name(const mtar_header_t *h) {
+  return h->longname ? h->longname : h->name;
+}
+
+const char *mtar_header_linkname(const mtar_header_t *h) {
+  return h->longlink ? h->longlink : h->linkname;
+}
+
+/* Long names are referenced, not copied */
+static int mtar_header_set_name(mtar_header_t *h, const char *name) {
+  size_t n = strlen(name);
+  if (n > MTAR_PATHMAX) {
+    return MTAR_ENAMELONG;
+  }
+  if (n > MTAR_NAMEMAX) {
+    h->longname = name;
+    n = MTAR_NAMEMAX;
+  }
+  memcpy(h->name, name, n);
+  h->name[n] = '\0';
+  return MTAR_ESUCCESS;
+}
+
+const char* mtar_strerror(int err) {
+  switch (err) {
+    case MTAR_ESUCCESS     : return "success";
+    case MTAR_EFAILURE     : return "failure";
+    case MTAR_EOPENFAIL    : return "could not open";
+    case MTAR_EREADFAIL    : return "could not read";
+    case MTAR_EWRITEFAIL   : return "could not write";
+    case MTAR_ESEEKFAIL    : return "could not seek";
+    case MTAR_EBADCHKSUM   : return "bad checksum";
+    case MTAR_ENULLRECORD  : return "null record";
+    case MTAR_ENOTFOUND    : return "file not found";
+    case MTAR_ENAMELONG    : return "name too long";
+    case MTAR_ETOOLARGE    : return "file too large";
+    case MTAR_ENOMEM       : return "out of memory";
+    case MTAR_EBADINDEX    : return "bad index";
+    case MTAR_ESTALE       : return "index is stale";
+    case MTAR_EUNSUPPORTED : return "operation not supported";
+    case MTAR_EBADFIELD    : return "bad header field";
+    case MTAR_EBADPATH     : return "unsafe path";
+    case MTAR_EBADDATA     : return "corrupt compressed data";
+  }
+  return "unknown error";
+}
+
+static int mtar_file_write(mtar_t *tar, const void *data, size_t size) {
+  size_t res = fwrite(data, 1, size, (FILE *)tar->stream);
+  return (res == size) ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+}
+
+static int mtar_file_read(mtar_t *tar, void *data, size_t size) {
+  size_t res = fread(data, 1, size, (FILE *)tar->stream);
+  return (res == size) ? MTAR_ESUCCESS : MTAR_EREADFAIL;
+}
+
+static int mtar_fseek(FILE *fp, size_t offset) {
+#if defined(HAVE__FSEEKI64) && (defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__))
+  int res = _fseeki64(fp, offset, SEEK_SET);
+#elif defined(HAVE_FSEEKO) && (defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__))
+  int res = fseeko(fp, offset, SEEK_SET);
+#else
+  int res = fseek(fp, offset, SEEK_SET);
+#endif
+  return (res == 0) ? MTAR_ESUCCESS : MTAR_ESEEKFAIL;
+}
+
+static int mtar_fsize(FILE *fp, size_t *size) {
+#if defined(HAVE__FSEEKI64) && (defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__))
+  __int64 n = (_fseeki64(fp, 0, SEEK_END) == 0) ? _ftelli64(fp) : -1;
+#elif defined(HAVE_FSEEKO) && (defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__))
+  off_t n = (fseeko(fp, 0, SEEK_END) == 0) ? ftello(fp) : -1;
+#else
+  long n = (fseek(fp, 0, SEEK_END) == 0) ? ftell(fp) : -1;
+#endif
+  if (n < 0) {
+    return MTAR_ESEEKFAIL;
+  }
+  *size = (size_t)n;
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_file_seek(mtar_t *tar, size_t offset) {
+  return mtar_fseek((FILE *)tar->stream, offset);
+}
+
+static int mtar_file_close(mtar_t *tar) {
+  fclose((FILE *)tar->stream);
+  return MTAR_ESUCCESS;
+}
+
+int mtar_open_fp(mtar_t *tar, void *fp) {
+  /* Init tar struct and functions */
+  memset(tar, 0, sizeof(*tar));
+  if (!fp) return MTAR_EOPENFAIL;
+
+  tar->write = mtar_file_write;
+  tar->read = mtar_file_read;
+  tar->seek = mtar_file_seek;
+  tar->close = mtar_file_close;
+  tar->stream = fp;
+  tar->flags = MTAR_FREWRITE;
+
+  /* Return ok */
+  return MTAR_ESUCCESS;
+}
+
+int mtar_open_stream(mtar_t *tar, void *fp) {
+  int err = mtar_open_fp(tar, fp);
+  if (err) {
+    return err;
+  }
+  /* Pipes and sockets cannot seek */
+  tar->seek = NULL;
+  tar->flags = MTAR_FSTREAM;
+  return MTAR_ESUCCESS;
+}
+
+/* Whether `idx` describes the archive: its last member must end at idx->end,
+ * where the end-of-archive marker (or the end of the file) is */
+static int mtar_append_check(mtar_t *tar, const mtar_index_t *idx,
+                             size_t size) {
+  const mtar_entry_t *e;
+  char record[512];
+  size_t end = 0;
+
+  if (idx->count) {
+    e = &idx->entries[idx->count - 1];
+    end = e->data_offset + mtar_round_up(e->size, 512);
+  }
+  if (end != idx->end || end > size) {
+    return 0;
+  }
+  if (end == size) {
+    return 1;
+  }
+  return !mtar_seek(tar, end) && !mtar_tread(tar, record, sizeof(record)) &&
+         !memcmp(record, mtar_zero_record, sizeof(record));
+}
+
+static int mtar_open_append_fp(mtar_t *tar, FILE *fp, mtar_index_t *idx) {
+  mtar_header_t h;
+  size_t size, end;
+  int err;
+
+  err = mtar_open_fp(tar, fp);
+  if (err) {
+    return err;
+  }
+  err = mtar_fsize(fp, &size);
+
+  /* Trust an index that matches the archive; otherwise hop from header to
+   * header to the end, (re)building the index on the way */
+  if (!err && idx && mtar_append_check(tar, idx, size)) {
+    end = idx->end;
+  } else if (!err) {
+    if (idx) {
+      mtar_index_free(idx);
+      mtar_index_init(idx);
+    }
+    err = mtar_rewind(tar);
+    while (!err && tar->pos < size &&
+           (err = mtar_load_header(tar, &h)) == MTAR_ESUCCESS) {
+      if (idx) {
+        err = mtar_index_add(idx, &h, tar->last_header, tar->pos);
+      }
+      if (!err) {
+        err = mtar_seek(tar, tar->pos + mtar_round_up(h.size, 512));
+      }
+    }
+    /* The marker itself, or the end of an archive without one */
+    end = (err == MTAR_ENULLRECORD) ? tar->last_header : tar->pos;
+    if (err == MTAR_ENULLRECORD || (!err && tar->pos == size)) {
+      err = MTAR_ESUCCESS;
+    } else if (!err) {
+      err = MTAR_EREADFAIL;
+    }
+  }
+
+  /* New members overwrite the marker; mtar_finalize() writes a new one */
+  if (!err) {
+    err = mtar_seek(tar, end);
+  }
+  if (err) {
+    mtar_close(tar);
+    return err;
+  }
+  tar->last_header = end;
+  tar->remaining_data = 0;
+  if (idx) {
+    idx->end = end;
+    tar->index = idx;
+  }
+  return MTAR_ESUCCESS;
+}
+
+int mtar_open_append(mtar_t *tar, const char *filename, mtar_index_t *idx) {
+  struct stat st;
+  /* Updated in place; only a missing archive is created */
+  FILE *fp = fopen(filename, "r+b");
+  if (!fp && stat(filename, &st) != 0) {
+    fp = fopen(filename, "w+b");
+  }
+  if (!fp) {
+    memset(tar, 0, sizeof(*tar));
+    return MTAR_EOPENFAIL;
+  }
+  return mtar_open_append_fp(tar, fp, idx);
+}
+
+int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
+  FILE *fp;
+  int err;
+  mtar_header_t h;
+
+  /* Appending continues the existing archive */
+  if ( strchr(mode, 'a') ) return mtar_open_append(tar, filename, NULL);
+
+  /* Assure mode is always binary */
+  if ( strchr(mode, 'r') ) mode = "rb";
+  if ( strchr(mode, 'w') ) mode = "wb";
+
+  /* Open file */
+  fp = fopen(filename, mode);
+  if (!fp) {
+    return MTAR_EOPENFAIL;
+  }
+
+  err = mtar_open_fp(tar, fp);
+  if (err) {
+    return err;
+  }
+
+  /* Read first header to check it is valid if mode is `r` */
+  if (*mode == 'r') {
+    err = mtar_read_header(tar, &h);
+    if (err != MTAR_ESUCCESS) {
+      mtar_close(tar);
+      return err;
+    }
+  }
+
+  /* Return ok */
+  return MTAR_ESUCCESS;
+}
+
+#ifdef _WIN32
+  int mtar_open_w(mtar_t *tar, const wchar_t *filename, const wchar_t *mode) {
+    FILE *fp;
+    int err;
+    mtar_header_t h;
+
+    /* Appending continues the existing archive, as for mtar_open() */
+    if ( wcschr(mode, L'a') ) {
+      struct _stat st;
+      fp = _wfopen(filename, L"r+b");
+      if (!fp && _wstat(filename, &st) != 0) {
+        fp = _wfopen(filename, L"w+b");
+      }
+      if (!fp) {
+        memset(tar, 0, sizeof(*tar));
+        return MTAR_EOPENFAIL;
+      }
+      return mtar_open_append_fp(tar, fp, NULL);
+    }
+
+    /* Assure mode is always binary */
+    if ( wcschr(mode, L'r') ) mode = L"rb";
+    if ( wcschr(mode, L'w') ) mode = L"wb";
+
+    /* Open file */
+    fp = _wfopen(filename, mode);
+    if (!fp) {
+      return MTAR_EOPENFAIL;
+    }
+
+    err = mtar_open_fp(tar, fp);
+    if (err) {
+      return err;
+    }
+
+    /* Read first header to check it is valid if mode is `r` */
+    if (*mode == L'r') {
+      err = mtar_read_header(tar, &h);
+      if (err != MTAR_ESUCCESS) {
+        mtar_close(tar);
+        return err;
+      }
+    }
+
+    /* Return ok */
+    return MTAR_ESUCCESS;
+  }
+#endif
+
+int mtar_close(mtar_t *tar) {
+  int err = mtar_flush_buffer(tar);
+  free(tar->spill);
+  tar->spill = NULL;
+  if (tar->spill_file) {
+    fclose((FILE *)tar->spill_file);
+    tar->spill_file = NULL;
+  }
+  free(tar->buffer);
+  tar->buffer = NULL;
+  tar->buffer_capacity = tar->buffer_len = 0;
+  free(tar->longnames);
+  tar->longnames = NULL;
+  free(tar->stats);
+  tar->stats = NULL;
+  if (tar->close) {
+    int res = tar->close(tar);
+    if (!err) {
+      err = res;
+    }
+  }
+  return err;
+}
+
+int mtar_enable_stats(mtar_t *tar) {
+#ifdef MTAR_STATS
+  /* Starts counting from zero, also when already counting */
+  if (!tar->stats) {
+    tar->stats = (mtar_stats_t *)malloc(sizeof(*tar->stats));
+    if (!tar->stats) {
+      return MTAR_ENOMEM;
+    }
+  }
+  memset(tar->stats, 0, sizeof(*tar->stats));
+  tar->stats->position = tar->buffer ? tar->buffer_start + tar->buffer_len
+                                     : tar->pos;
+  return MTAR_ESUCCESS;
+#else
+  (void)tar;
+  return MTAR_EUNSUPPORTED;
+#endif
+}
+
+int mtar_get_stats(const mtar_t *tar, mtar_stats_t *stats) {
+  if (!tar->stats) {
+    return MTAR_EUNSUPPORTED;
+  }
+  memcpy(stats, tar->stats, sizeof(*stats));
+  return MTAR_ESUCCESS;
+}
+
+int mtar_set_buffer(mtar_t *tar, size_t size) {
+  char *buffer = NULL;
+  int err = mtar_flush_buffer(tar);
+  if (err) {
+    return err;
+  }
+  /* Put the backend back where the caller expects it */
+  if (tar->buffer) {
+    err = mtar_position(tar);
+    if (err) {
+      return err;
+    }
+  }
+  size = mtar_round_up(size, 512);
+  if (size) {
+    buffer = (char *)malloc(size);
+    if (!buffer) {
+      return MTAR_ENOMEM;
+    }
+  }
+  free(tar->buffer);
+  tar->buffer = buffer;
+  tar->buffer_capacity = size;
+  tar->buffer_start = tar->pos;
+  tar->buffer_len = 0;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_seek(mtar_t *tar, size_t pos) {
+  int err;
+  if (tar->flags & MTAR_FSTREAM) {
+    /* Only forward seeks are possible on a stream */
+    if (pos < tar->pos) {
+      return MTAR_ESEEKFAIL;
+    }
+    tar->flags &= ~MTAR_FHEADER;
+    return mtar_skip(tar, pos - tar->pos);
+  }
+  if (tar->buffer) {
+    /* The backend is repositioned when it is next used */
+    err = mtar_flush_buffer(tar);
+    tar->pos = pos;
+    return err;
+  }
+  err = MTAR_SEEK(tar, pos);
+  tar->pos = pos;
+  return err;
 }
 
 int mtar_rewind(mtar_t *tar) {
   tar->remaining_data = 0;
-  tar->last_header = 0;
-  return mtar_seek(tar, 0);
+  tar->last_header = 0;
+  return mtar_seek(tar, 0);
+}
+
+static int mtar_stream_read_header(mtar_t *tar, mtar_header_t *h);
+
+int mtar_next(mtar_t *tar) {
+  int err;
+  size_t n;
+  mtar_header_t h;
+  if (tar->flags & MTAR_FSTREAM) {
+    /* Skip what is left of the current member */
+    err = mtar_stream_read_header(tar, NULL);
+    if (err) {
+      return err;
+    }
+    n = tar->pos + tar->remaining_data +
+        (mtar_round_up(tar->header.size, 512) - tar->header.size);
+    return mtar_seek(tar, n);
+  }
+  /* Load header */
+  err = mtar_load_header(tar, &h);
+  if (err) {
+    mtar_seek(tar, tar->last_header);
+    return err;
+  }
+  /* Seek to next record */
+  return mtar_seek(tar, tar->pos + mtar_round_up(h.size, 512));
+}
+
+int mtar_find(mtar_t *tar, const char *name, mtar_header_t *h) {
+  int err, deleted = 0;
+  size_t found = 0;
+  mtar_header_t header;
+
+  if (strlen(name) > MTAR_PATHMAX)
+    return MTAR_ENAMELONG;
+
+  /* Jump straight to the header if the archive is indexed */
+  if (tar->index) {
+    const mtar_entry_t *e;
+    err = mtar_index_lookup(tar->index, name, &e);
+    if (err) {
+      return err;
+    }
+    tar->remaining_data = 0;
+    err = mtar_seek(tar, e->offset);
+    if (err) {
+      return err;
+    }
+    tar->last_header = e->offset;
+    return h ? mtar_read_header(tar, h) : MTAR_ESUCCESS;
+  }
+
+  /* Streams are searched from the current member on */
+  if (tar->flags & MTAR_FSTREAM) {
+    while ( (err = mtar_stream_read_header(tar, NULL)) == MTAR_ESUCCESS ) {
+      if ( !strcmp(mtar_header_name(&tar->header), name) ) {
+        if (h) {
+          mtar_copy_header(h, &tar->header);
+        }
+        return MTAR_ESUCCESS;
+      }
+      mtar_next(tar);
+    }
+    return err == MTAR_ENULLRECORD ? MTAR_ENOTFOUND : err;
+  }
+
+  /* Start at beginning */
+  err = mtar_rewind(tar);
+  if (err) {
+    return err;
+  }
+  /* Iterate all files; a later member of the name replaces an earlier one */
+  while ( (err = mtar_load_header(tar, &header)) == MTAR_ESUCCESS ) {
+    if ( !strcmp(mtar_header_name(&header), name) ) {
+      found = tar->last_header + 1;
+      deleted = (header.type == MTAR_TDELETED);
+    }
+    err = mtar_seek(tar, tar->pos + mtar_round_up(header.size, 512));
+    if (err) {
+      break;
+    }
+  }
+  /* Return error; an archive without end records, not finalized or cut
+   * short, ends at the last header that could be read */
+  if (err != MTAR_ENULLRECORD && !(err == MTAR_EREADFAIL && found)) {
+    return err;
+  }
+  if (!found || deleted) {
+    return MTAR_ENOTFOUND;
+  }
+  tar->last_header = found - 1;
+  err = mtar_seek(tar, tar->last_header);
+  /* Read again, as later headers reused the space of long names */
+  return (err || !h) ? err : mtar_read_header(tar, h);
+}
+
+static int mtar_stream_read_header(mtar_t *tar, mtar_header_t *h) {
+  int err;
+  /* Each header is read exactly once and then served from the cache */
+  if (!(tar->flags & MTAR_FHEADER)) {
+    err = mtar_load_header(tar, &tar->header);
+    if (err) {
+      return err;
+    }
+    tar->remaining_data = tar->header.size;
+    tar->flags |= MTAR_FHEADER;
+  }
+  if (h) {
+    mtar_copy_header(h, &tar->header);
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_stream_read_data(mtar_t *tar, void *ptr, size_t size) {
+  int err;
+  if (!(tar->flags & MTAR_FHEADER)) {
+    err = mtar_stream_read_header(tar, NULL);
+    if (err) {
+      return err;
+    }
+  }
+  /* Data can only be read once, in order */
+  if (size > tar->remaining_data) {
+    return MTAR_EREADFAIL;
+  }
+  err = mtar_tread(tar, ptr, size);
+  if (err) {
+    return err;
+  }
+  tar->remaining_data -= size;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_read_header(mtar_t *tar, mtar_header_t *h) {
+  int err, seek_err;
+  if (tar->flags & MTAR_FSTREAM) {
+    return mtar_stream_read_header(tar, h);
+  }
+  /* Load header */
+  err = mtar_load_header(tar, h);
+  /* Seek back to start of header */
+  seek_err = mtar_seek(tar, tar->last_header);
+  return err ? err : seek_err;
+}
+
+int mtar_read_data(mtar_t *tar, void *ptr, size_t size) {
+  int err;
+  mtar_header_t h;
+  if (tar->flags & MTAR_FSTREAM) {
+    return mtar_stream_read_data(tar, ptr, size);
+  }
+  /* If we have no remaining data then this is the first read, we get the size,
+   * set the remaining data and seek to the beginning of the data */
+  if (tar->remaining_data == 0) {
+    /* Read header, leaving the position at the data */
+    err = mtar_load_header(tar, &h);
+    if (err) {
+      mtar_seek(tar, tar->last_header);
+      return err;
+    }
+    tar->remaining_data = h.size;
+  }
+  /* Read data */
+  err = mtar_tread(tar, ptr, size);
+  if (err) {
+    return err;
+  }
+  tar->remaining_data -= size;
+  /* If there is no remaining data we've finished reading and seek back to the
+   * header */
+  if (tar->remaining_data == 0) {
+    return mtar_seek(tar, tar->last_header);
+  }
+  return MTAR_ESUCCESS;
+}
+
+/* States of mtar_parser_t */
+enum {
+  MTAR_PHEADER,
+  MTAR_PEXT,
+  MTAR_PDATA,
+  MTAR_PPAD,
+  MTAR_PEND
+};
+
+void mtar_parser_init(mtar_parser_t *p) {
+  memset(p, 0, sizeof(*p));
+  p->state = MTAR_PHEADER;
+}
+
+static void mtar_parser_pad(mtar_parser_t *p, size_t size) {
+  p->remaining = mtar_round_up(size, 512) - size;
+  p->state = p->remaining ? MTAR_PPAD : MTAR_PHEADER;
+}
+
+static int mtar_parser_end_member(mtar_parser_t *p) {
+  /* An empty chunk marks the end of the data */
+  int err = p->on_data ? p->on_data(p, NULL, 0) : MTAR_ESUCCESS;
+  mtar_parser_pad(p, p->header.size);
+  return err;
+}
+
+static int mtar_parser_header(mtar_parser_t *p) {
+  mtar_header_t *h = &p->header;
+  int err = mtar_raw_to_header(h, (const mtar_raw_header_t *)p->record,
+                               &p->longnames);
+
+  if (err == MTAR_ENULLRECORD) {
+    if (p->overrides && ((mtar_ext_t *)p->overrides)->flags) {
+      return MTAR_EBADFIELD;
+    }
+    p->state = MTAR_PEND;
+    return MTAR_ESUCCESS;
+  }
+  if (err) {
+    return err;
+  }
+  /* Extension data is collected; the overrides apply to the next header */
+  if (mtar_is_ext(h->type)) {
+    if (h->size > MTAR_EXTMAX) {
+      return MTAR_ETOOLARGE;
+    }
+    if (!p->overrides) {
+      p->overrides = calloc(1, sizeof(mtar_ext_t));
+    }
+    free(p->ext);
+    p->ext = (char *)malloc(h->size + 1);
+    if (!p->ext || !p->overrides) {
+      return MTAR_ENOMEM;
+    }
+    p->ext_len = 0;
+    p->ext_type = h->type;
+    p->remaining = h->size;
+    p->state = MTAR_PEXT;
+    return MTAR_ESUCCESS;
+  }
+  if (p->overrides) {
+    err = mtar_apply_ext(h, (mtar_ext_t *)p->overrides, &p->longnames);
+    ((mtar_ext_t *)p->overrides)->flags = 0;
+    if (err) {
+      return err;
+    }
+  }
+  err = p->on_header ? p->on_header(p, h) : MTAR_ESUCCESS;
+  if (err) {
+    return err;
+  }
+  p->remaining = h->size;
+  p->state = MTAR_PDATA;
+  return h->size ? MTAR_ESUCCESS : mtar_parser_end_member(p);
+}
+
+int mtar_feed(mtar_parser_t *p, const void *data, size_t size) {
+  const char *s = (const char *)data;
+  size_t n;
+  int err = MTAR_ESUCCESS;
+
+  if (p->err) {
+    return p->err;
+  }
+  while (size && !err) {
+    /* Never beyond the current record, data or padding */
+    n = (p->state == MTAR_PHEADER) ? sizeof(p->record) - p->record_len
+                                    : p->remaining;
+    if (n > size || p->state == MTAR_PEND) {
+      n = size;
+    }
+    switch (p->state) {
+      case MTAR_PHEADER:
+        memcpy(&p->record[p->record_len], s, n);
+        p->record_len += n;
+        if (p->record_len == sizeof(p->record)) {
+          p->record_len = 0;
+          err = mtar_parser_header(p);
+        }
+        break;
+      case MTAR_PEXT:
+        memcpy(&p->ext[p->ext_len], s, n);
+        p->ext_len += n;
+        p->remaining -= n;
+        if (!p->remaining) {
+          err = mtar_parse_ext((mtar_ext_t *)p->overrides, p->ext_type, p->ext,
+                               p->ext_len);
+          free(p->ext);
+          p->ext = NULL;
+          mtar_parser_pad(p, p->ext_len);
+        }
+        break;
+      case MTAR_PDATA:
+        /* Straight from the caller's buffer */
+        err = p->on_data ? p->on_data(p, s, n) : MTAR_ESUCCESS;
+        p->remaining -= n;
+        if (!err && !p->remaining) {
+          err = mtar_parser_end_member(p);
+        }
+        break;
+      case MTAR_PPAD:
+        p->remaining -= n;
+        if (!p->remaining) {
+          p->state = MTAR_PHEADER;
+        }
+        break;
+      default:
+        /* Anything after the end-of-archive marker is ignored */
+        break;
+    }
+    s += n;
+    size -= n;
+    p->pos += n;
+  }
+  p->err = err;
+  return err;
+}
+
+int mtar_parser_finish(mtar_parser_t *p) {
+  int err = p->err;
+  free(p->ext);
+  free(p->overrides);
+  free(p->longnames);
+  p->ext = NULL;
+  p->overrides = NULL;
+  p->longnames = NULL;
+  /* Archives may stop at a member boundary without a marker */
+  if (!err && p->state != MTAR_PEND &&
+      (p->state != MTAR_PHEADER || p->record_len)) {
+    err = MTAR_EREADFAIL;
+  }
+  return err;
+}
+
+int mtar_member_open(mtar_t *tar, const char *name, mtar_member_t *m) {
+  const mtar_entry_t *e;
+  mtar_header_t h;
+  int err;
+
+  /* An indexed member is opened without any I/O */
+  if (tar->index && !(tar->flags & MTAR_FSTREAM)) {
+    err = mtar_index_lookup(tar->index, name, &e);
+    return err ? err : mtar_member_open_entry(tar, e, m);
+  }
+  if (tar->flags & MTAR_FSTREAM) {
+    /* The header is cached, and some of the data may have been read */
+    err = mtar_find(tar, name, NULL);
+    if (err) {
+      return err;
+    }
+    m->tar = tar;
+    m->header = tar->last_header;
+    m->size = tar->header.size;
+    m->pos = tar->header.size - tar->remaining_data;
+    m->data_offset = tar->pos - m->pos;
+    return MTAR_ESUCCESS;
+  }
+  err = mtar_find(tar, name, NULL);
+  if (!err) {
+    err = mtar_load_header(tar, &h);
+  }
+  if (err) {
+    return err;
+  }
+  tar->remaining_data = 0;
+  m->tar = tar;
+  m->header = tar->last_header;
+  m->data_offset = tar->pos;
+  m->size = h.size;
+  m->pos = 0;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_member_open_entry(mtar_t *tar, const mtar_entry_t *e,
+                           mtar_member_t *m) {
+  if (tar->flags & MTAR_FSTREAM) {
+    return MTAR_EUNSUPPORTED;
+  }
+  tar->remaining_data = 0;
+  tar->last_header = e->offset;
+  m->tar = tar;
+  m->header = e->offset;
+  m->data_offset = e->data_offset;
+  m->size = e->size;
+  m->pos = 0;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_member_read_at(mtar_member_t *m, size_t offset, void *data,
+                        size_t size) {
+  mtar_t *tar = m->tar;
+  size_t pos = m->data_offset + offset;
+  int err;
+
+  if (offset > m->size || size > m->size - offset) {
+    return MTAR_EREADFAIL;
+  }
+  /* Go straight to the bytes; the header is never looked at again */
+  if (tar->flags & MTAR_FSTREAM) {
+    if (pos < tar->pos) {
+      return MTAR_ESEEKFAIL;
+    }
+    err = mtar_skip(tar, pos - tar->pos);
+  } else {
+    err = (pos == tar->pos) ? MTAR_ESUCCESS : mtar_seek(tar, pos);
+  }
+  if (!err) {
+    err = mtar_tread(tar, data, size);
+  }
+  if (err) {
+    return err;
+  }
+  m->pos = offset + size;
+  /* Lets mtar_next() carry on after the member in stream mode */
+  if (tar->flags & MTAR_FSTREAM) {
+    tar->remaining_data = m->size - m->pos;
+  }
+  return MTAR_ESUCCESS;
+}
+
+int mtar_member_skip(mtar_member_t *m, size_t n) {
+  /* Nothing is read until the next mtar_member_read() */
+  if (n > m->size - m->pos) {
+    return MTAR_EREADFAIL;
+  }
+  m->pos += n;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_member_read(mtar_member_t *m, void *data, size_t size, size_t *n) {
+  size_t k = m->size - m->pos;
+  int err;
+  if (k > size) {
+    k = size;
+  }
+  *n = 0;
+  if (!k) {
+    return MTAR_ESUCCESS;
+  }
+  err = mtar_member_read_at(m, m->pos, data, k);
+  if (!err) {
+    *n = k;
+  }
+  return err;
+}
+
+int mtar_write_header(mtar_t *tar, const mtar_header_t *h) {
+  char buf[MTAR_HEADERMAX];
+  size_t len;
+  int err;
+  if (!tar->write) {
+    return MTAR_EUNSUPPORTED;
+  }
+  /* A member of unknown size ends where the next one starts */
+  if (tar->flags & MTAR_FUNSIZED) {
+    err = mtar_end_data(tar);
+    if (err) {
+      return err;
+    }
+  }
+  /* Build raw header, preceded by a pax header if needed */
+  err = mtar_encode_header(h, buf, &len);
+  if (err) {
+    return err;
+  }
+  /* Record the member if an index is attached */
+  if (tar->index) {
+    err = mtar_index_add(tar->index, h, tar->pos, tar->pos + len);
+    if (err) {
+      return err;
+    }
+  }
+  /* Write raw header */
+  tar->remaining_data = h->size;
+  return mtar_twrite(tar, buf, len);
+}
+
+size_t mtar_member_size(const mtar_header_t *h) {
+  char buf[MTAR_HEADERMAX];
+  size_t len;
+  /* Headers, including any pax header, and the padded data */
+  if (mtar_encode_header(h, buf, &len)) {
+    return 0;
+  }
+  return len + mtar_round_up(h->size, 512);
+}
+
+int mtar_write_file_header(mtar_t *tar, const char *name, size_t size) {
+  mtar_header_t h;
+  /* Build header */
+  memset(&h, 0, sizeof(h));
+  if (mtar_header_set_name(&h, name))
+    return MTAR_ENAMELONG;
+  h.size = size;
+  h.type = MTAR_TREG;
+  h.mode = 0664;
+  h.mtime = time(NULL);
+  /* Write header */
+  return mtar_write_header(tar, &h);
+}
+
+int mtar_write_dir_header(mtar_t *tar, const char *name) {
+  mtar_header_t h;
+  /* Build header */
+  memset(&h, 0, sizeof(h));
+  if (mtar_header_set_name(&h, name))
+    return MTAR_ENAMELONG;
+  h.type = MTAR_TDIR;
+  h.mode = 0775;
+  /* Write header */
+  return mtar_write_header(tar, &h);
+}
+
+static int mtar_spill(mtar_t *tar, const void *data, size_t size) {
+  FILE *fp = (FILE *)tar->spill_file;
+  size_t n = 0;
+  /* Fill the memory first, then append to a temporary file */
+  if (!fp) {
+    n = MTAR_SPILLMAX - tar->spill_len;
+    if (n > size) {
+      n = size;
+    }
+    memcpy(&tar->spill[tar->spill_len], data, n);
+    tar->spill_len += n;
+    if (n == size) {
+      return MTAR_ESUCCESS;
+    }
+    fp = tmpfile();
+    if (!fp) {
+      return MTAR_EOPENFAIL;
+    }
+    tar->spill_file = fp;
+  }
+  if (fwrite((const char *)data + n, 1, size - n, fp) != size - n) {
+    return MTAR_EWRITEFAIL;
+  }
+  return MTAR_ESUCCESS;
+}
+
+int mtar_write_data(mtar_t *tar, const void *data, size_t size) {
+  int err;
+  if (tar->flags & MTAR_FUNSIZED) {
+    if (size > MTAR_SIZEMAX - tar->header.size) {
+      return MTAR_ETOOLARGE;
+    }
+    err = tar->spill ? mtar_spill(tar, data, size)
+                     : mtar_twrite(tar, data, size);
+    if (!err) {
+      tar->header.size += size;
+    }
+    return err;
+  }
+  /* Write data */
+  err = mtar_twrite(tar, data, size);
+  if (err) {
+    return err;
+  }
+  tar->remaining_data -= size;
+  /* Write padding if we've written all the data for this file */
+  if (tar->remaining_data == 0) {
+    return mtar_write_null_bytes(tar, mtar_round_up(tar->pos, 512) - tar->pos);
+  }
+  return MTAR_ESUCCESS;
+}
+
+int mtar_write_unsized_header(mtar_t *tar, const mtar_header_t *h) {
+  const char *name, *linkname;
+  int err;
+  if (!tar->write) {
+    return MTAR_EUNSUPPORTED;
+  }
+  if (tar->flags & MTAR_FUNSIZED) {
+    err = mtar_end_data(tar);
+    if (err) {
+      return err;
+    }
+  }
+  if (strlen(mtar_header_name(h)) > MTAR_PATHMAX ||
+      strlen(mtar_header_linkname(h)) > MTAR_PATHMAX) {
+    return MTAR_ENAMELONG;
+  }
+  tar->header = *h;
+  tar->header.size = 0;
+  /* The caller's long names may be gone when the header is written */
+  name = mtar_header_name(h);
+  linkname = mtar_header_linkname(h);
+  if ((err = mtar_store_name(tar->header.name, &tar->header.longname,
+                             &tar->longnames, 0, name, strlen(name))) ||
+      (err = mtar_store_name(tar->header.linkname, &tar->header.longlink,
+                             &tar->longnames, 1, linkname,
+                             strlen(linkname)))) {
+    return err;
+  }
+  /* Only backends that can go back qualify, and files may still be pipes,
+   * so the backend is asked too */
+  err = mtar_flush_buffer(tar);
+  if (err) {
+    return err;
+  }
+  if (tar->seek && (tar->flags & MTAR_FREWRITE) &&
+      !(tar->flags & MTAR_FSTREAM) &&
+      MTAR_SEEK(tar, tar->pos) == MTAR_ESUCCESS) {
+    /* A placeholder, patched by mtar_end_data() */
+    err = mtar_write_header(tar, &tar->header);
+    tar->unsized_data = tar->pos;
+  } else {
+    /* The header goes out once the size is known */
+    tar->spill = (char *)malloc(MTAR_SPILLMAX);
+    tar->spill_len = 0;
+    err = tar->spill ? MTAR_ESUCCESS : MTAR_ENOMEM;
+  }
+  if (!err) {
+    tar->flags |= MTAR_FUNSIZED;
+  }
+  return err;
+}
+
+static int mtar_write_spill(mtar_t *tar) {
+  FILE *fp = (FILE *)tar->spill_file;
+  size_t n;
+  int err = mtar_twrite(tar, tar->spill, tar->spill_len);
+  /* The memory is reused to copy the temporary file */
+  if (!err && fp) {
+    if (fflush(fp) != 0 || fseek(fp, 0, SEEK_SET) != 0) {
+      return MTAR_EREADFAIL;
+    }
+    while (!err && (n = fread(tar->spill, 1, MTAR_SPILLMAX, fp)) > 0) {
+      err = mtar_twrite(tar, tar->spill, n);
+    }
+    if (!err && ferror(fp)) {
+      err = MTAR_EREADFAIL;
+    }
+  }
+  return err;
+}
+
+int mtar_end_data(mtar_t *tar) {
+  char buf[MTAR_HEADERMAX];
+  size_t len, end = tar->pos;
+  int err;
+
+  if (!(tar->flags & MTAR_FUNSIZED)) {
+    return MTAR_ESUCCESS;
+  }
+  tar->flags &= ~MTAR_FUNSIZED;
+  if (tar->spill) {
+    /* Header and data in one go */
+    err = mtar_write_header(tar, &tar->header);
+    if (!err) {
+      err = mtar_write_spill(tar);
+    }
+    free(tar->spill);
+    tar->spill = NULL;
+    tar->spill_len = 0;
+    if (tar->spill_file) {
+      fclose((FILE *)tar->spill_file);
+      tar->spill_file = NULL;
+    }
+  } else {
+    /* Only the size and checksum of the last record change; the size field
+     * switches to base-256 instead of growing, so the length is the same */
+    err = mtar_encode_header(&tar->header, buf, &len);
+    if (!err) {
+      err = mtar_seek(tar, tar->unsized_data - sizeof(mtar_raw_header_t));
+    }
+    if (!err) {
+      err = mtar_twrite(tar, &buf[len - sizeof(mtar_raw_header_t)],
+                        sizeof(mtar_raw_header_t));
+    }
+    if (!err) {
+      err = mtar_seek(tar, end);
+    }
+    if (!err && tar->index) {
+      tar->index->entries[tar->index->count - 1].size = tar->header.size;
+    }
+  }
+  if (err) {
+    return err;
+  }
+  tar->remaining_data = 0;
+  return mtar_write_null_bytes(tar, mtar_round_up(tar->pos, 512) - tar->pos);
+}
+
+/* Whether a live member of the name was written before the current
+ * position, by reading the archive back up to it */
+static int mtar_written(mtar_t *tar, const char *name) {
+  mtar_header_t h;
+  size_t end, last_header;
+  int err, seek_err, found = 0;
+
+  if (!tar->read || !tar->seek || (tar->flags & MTAR_FSTREAM)) {
+    return MTAR_EUNSUPPORTED;
+  }
+  err = mtar_end_data(tar);
+  if (err) {
+    return err;
+  }
+  end = tar->pos;
+  last_header = tar->last_header;
+  err = mtar_seek(tar, 0);
+  while (!err && tar->pos < end &&
+         (err = mtar_load_header(tar, &h)) == MTAR_ESUCCESS) {
+    if (!strcmp(mtar_header_name(&h), name)) {
+      found = (h.type != MTAR_TDELETED);
+    }
+    err = mtar_seek(tar, tar->pos + mtar_round_up(h.size, 512));
+  }
+  /* New members go where they would have gone */
+  seek_err = mtar_seek(tar, end);
+  tar->last_header = last_header;
+  tar->remaining_data = 0;
+  if (err || seek_err) {
+    return err ? err : seek_err;
+  }
+  return found ? MTAR_ESUCCESS : MTAR_ENOTFOUND;
+}
+
+int mtar_delete(mtar_t *tar, const char *name) {
+  mtar_header_t h;
+  int err;
+  if (strlen(name) > MTAR_PATHMAX)
+    return MTAR_ENAMELONG;
+  /* Without an index the archive is read back to look for the name */
+  err = tar->index ? mtar_index_lookup(tar->index, name, NULL) :
+                     mtar_written(tar, name);
+  if (err) {
+    return err;
+  }
+  /* An empty member that hides the earlier ones */
+  memset(&h, 0, sizeof(h));
+  mtar_header_set_name(&h, name);
+  h.type = MTAR_TDELETED;
+  h.mtime = time(NULL);
+  return mtar_write_header(tar, &h);
+}
+
+int mtar_finalize(mtar_t *tar) {
+  int err = mtar_end_data(tar);
+  if (err) {
+    return err;
+  }
+  if (tar->index) {
+    tar->index->end = tar->pos;
+  }
+  /* Write two NULL records */
+  err = mtar_write_null_bytes(tar, sizeof(mtar_raw_header_t) * 2);
+  if (err) {
+    return err;
+  }
+  return mtar_flush_buffer(tar);
+}
+
+static void *memory_alloc(mtar_t *tar, void *ptr, size_t old_size,
+                          size_t size) {
+  const mtar_allocator_t *a = tar->allocator;
+  if (!a) {
+    return realloc(ptr, size);
+  }
+  return ptr ? a->realloc(a->ctx, ptr, old_size, size) : a->alloc(a->ctx, size);
+}
+
+static void memory_free(mtar_t *tar, void *ptr, size_t size) {
+  const mtar_allocator_t *a = tar->allocator;
+  if (!ptr) {
+    return;
+  }
+  if (a) {
+    a->free(a->ctx, ptr, size);
+  } else {
+    free(ptr);
+  }
+}
+
+static int memory_grow(mtar_t *tar, size_t capacity) {
+  char *memory = (char *)memory_alloc(tar, tar->memory, tar->memory_capacity,
+                                      capacity);
+  if (!memory) {
+    return MTAR_EWRITEFAIL;
+  }
+  tar->memory = memory;
+  tar->memory_capacity = capacity;
+  return MTAR_ESUCCESS;
+}
+
+static int memory_grow_chunks(mtar_t *tar, size_t capacity) {
+  mtar_iovec_t *chunks;
+  size_t count = (capacity + tar->chunk_size - 1) / tar->chunk_size;
+  if (count > tar->chunk_capacity) {
+    size_t n = tar->chunk_capacity ? tar->chunk_capacity * 2 : 16;
+    while (n < count) {
+      n *= 2;
+    }
+    chunks = (mtar_iovec_t *)memory_alloc(
+      tar, tar->chunks, tar->chunk_capacity * sizeof(*chunks),
+      n * sizeof(*chunks));
+    if (!chunks) {
+      return MTAR_EWRITEFAIL;
+    }
+    tar->chunks = chunks;
+    tar->chunk_capacity = n;
+  }
+  /* Existing chunks never move */
+  while (tar->chunk_count < count) {
+    void *p = memory_alloc(tar, NULL, 0, tar->chunk_size);
+    if (!p) {
+      return MTAR_EWRITEFAIL;
+    }
+    tar->chunks[tar->chunk_count].iov_base = p;
+    tar->chunks[tar->chunk_count].iov_len = 0;
+    tar->chunk_count++;
+  }
+  tar->memory_capacity = tar->chunk_count * tar->chunk_size;
+  return MTAR_ESUCCESS;
+}
+
+static int memory_write_chunked(mtar_t *tar, const void *data, size_t size) {
+  const char *p = (const char *)data;
+  size_t i, n, request_size = tar->memory_pos + size;
+  int err;
+
+  if (request_size > tar->memory_capacity) {
+    err = memory_grow_chunks(tar, request_size);
+    if (err) {
+      return err;
+    }
+  }
+  while (size) {
+    i = tar->memory_pos / tar->chunk_size;
+    n = tar->chunk_size - tar->memory_pos % tar->chunk_size;
+    if (n > size) {
+      n = size;
+    }
+    memcpy((char *)tar->chunks[i].iov_base + tar->memory_pos % tar->chunk_size,
+           p, n);
+    p += n;
+    size -= n;
+    tar->memory_pos += n;
+  }
+  /* Chunks are full except for the last one in use */
+  for (i = tar->memory_size / tar->chunk_size;
+       tar->memory_size < request_size; i++) {
+    n = request_size - i * tar->chunk_size;
+    tar->chunks[i].iov_len = n < tar->chunk_size ? n : tar->chunk_size;
+    tar->memory_size = i * tar->chunk_size + tar->chunks[i].iov_len;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int memory_write(mtar_t *tar, const void *data, size_t size) {
+  char *memory;
+  size_t request_size, new_capacity;
+  int err;
+
+  if (tar->stream)
+    return MTAR_EWRITEFAIL;
+
+  if (!size)
+    return MTAR_ESUCCESS;
+
+  if (tar->chunk_size)
+    return memory_write_chunked(tar, data, size);
+
+  request_size = tar->memory_pos + size;
+  if (request_size > tar->memory_capacity) {
+    if (request_size <= 1024)
+      new_capacity = 1024;
+    else
+      new_capacity = request_size * 2;
+    err = memory_grow(tar, new_capacity);
+    if (err) {
+      return err;
+    }
+  }
+  memory = (char *)tar->memory;
+  if (request_size > tar->memory_size) {
+    tar->memory_size = request_size;
+  }
+
+  memcpy(&memory[tar->memory_pos], data, size);
+  tar->memory_pos += size;
+
+  return MTAR_ESUCCESS;
+}
+
+static int memory_read(mtar_t *tar, void *data, size_t size) {
+  char *memory;
+
+  if (!size)
+    return MTAR_ESUCCESS;
+
+  /* Output is not read back */
+  memory = (char *)tar->stream;
+  if (!memory || tar->memory_pos + size > tar->memory_size)
+    return MTAR_EREADFAIL;
+
+  memcpy(data, &memory[tar->memory_pos], size);
+  tar->memory_pos += size;
+
+  return MTAR_ESUCCESS;
+}
+
+static int memory_seek(mtar_t *tar, size_t offset) {
+  /* Output can be revisited up to what has been written */
+  if (offset > tar->memory_size)
+    return MTAR_ESEEKFAIL;
+
+  tar->memory_pos = offset;
+  return MTAR_ESUCCESS;
+}
+
+static int memory_close(mtar_t *tar) {
+  size_t i;
+  memory_free(tar, tar->memory, tar->memory_capacity);
+  tar->memory = NULL;
+  for (i = 0; i < tar->chunk_count; i++) {
+    memory_free(tar, tar->chunks[i].iov_base, tar->chunk_size);
+  }
+  memory_free(tar, tar->chunks, tar->chunk_capacity * sizeof(mtar_iovec_t));
+  tar->chunks = NULL;
+  tar->chunk_count = tar->chunk_capacity = 0;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_open_memory(mtar_t *tar, void *data, size_t size) {
+  if (!data || !size) {
+    data = NULL;
+    size = 0;
+  }
+
+  /* Init tar struct and functions */
+  memset(tar, 0, sizeof(*tar));
+  tar->write = memory_write;
+  tar->read = memory_read;
+  tar->seek = memory_seek;
+  tar->close = memory_close;
+  tar->flags = MTAR_FREWRITE;
+  tar->stream = data;   /* for input */
+  tar->memory = NULL;   /* for output */
+  tar->memory_pos = 0;
+  tar->memory_size = size;
+  tar->memory_capacity = 0;
+
+  /* Return ok */
+  return MTAR_ESUCCESS;
+}
+
+int mtar_set_allocator(mtar_t *tar, const mtar_allocator_t *allocator) {
+  /* Only memory output is allocated, and only before anything is written */
+  if (tar->write != memory_write || tar->memory || tar->chunk_count) {
+    return MTAR_EUNSUPPORTED;
+  }
+  tar->allocator = allocator;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_set_chunked(mtar_t *tar, size_t chunk_size) {
+  if (tar->write != memory_write || tar->memory || tar->chunk_count ||
+      !chunk_size) {
+    return MTAR_EUNSUPPORTED;
+  }
+  tar->chunk_size = chunk_size;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_memory_reserve(mtar_t *tar, size_t size) {
+  if (tar->write != memory_write) {
+    return MTAR_EUNSUPPORTED;
+  }
+  if (size <= tar->memory_capacity) {
+    return MTAR_ESUCCESS;
+  }
+  /* Exactly what was asked for, so that a known size never reallocates */
+  if (tar->chunk_size) {
+    return memory_grow_chunks(tar, size);
+  }
+  return memory_grow(tar, size);
+}
+
+int mtar_memory_chunks(const mtar_t *tar, const mtar_iovec_t **iov,
+                       size_t *count) {
+  if (!tar->chunk_size) {
+    return MTAR_EUNSUPPORTED;
+  }
+  *iov = tar->chunks;
+  *count = (tar->memory_size + tar->chunk_size - 1) / tar->chunk_size;
+  return MTAR_ESUCCESS;
+}
+
+static void mtar_unmap_file(void *data, size_t size) {
+  if (data) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#elif defined(HAVE_MMAP)
+    munmap(data, size);
+#else
+    (void)size;
+    free(data);
+#endif
+  }
+}
+
+static int mtar_mmap_close(mtar_t *tar) {
+  mtar_unmap_file(tar->stream, tar->memory_size);
+  tar->stream = NULL;
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_map_file(const char *filename, void **data, size_t *size) {
+#ifdef _WIN32
+  HANDLE file, mapping;
+  LARGE_INTEGER n;
+  file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return MTAR_EOPENFAIL;
+  }
+  if (!GetFileSizeEx(file, &n)) {
+    CloseHandle(file);
+    return MTAR_EOPENFAIL;
+  }
+  *size = (size_t)n.QuadPart;
+  *data = NULL;
+  if (*size) {
+    /* The view keeps the mapping alive after the handles are closed */
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+  return (*data || !*size) ? MTAR_ESUCCESS : MTAR_EOPENFAIL;
+#elif defined(HAVE_MMAP)
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return MTAR_EOPENFAIL;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return MTAR_EOPENFAIL;
+  }
+  *size = (size_t)st.st_size;
+  *data = NULL;
+  if (*size) {
+    *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*data == MAP_FAILED) {
+      *data = NULL;
+    }
+  }
+  close(fd);
+  return (*data || !*size) ? MTAR_ESUCCESS : MTAR_EOPENFAIL;
+#else
+  /* No mapping available; load the file into memory instead */
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    return MTAR_EOPENFAIL;
+  }
+  if (mtar_fsize(fp, size) || mtar_fseek(fp, 0)) {
+    fclose(fp);
+    return MTAR_EOPENFAIL;
+  }
+  *data = *size ? malloc(*size) : NULL;
+  if (*size && (!*data || fread(*data, 1, *size, fp) != *size)) {
+    free(*data);
+    fclose(fp);
+    return MTAR_EREADFAIL;
+  }
+  fclose(fp);
+  return MTAR_ESUCCESS;
+#endif
+}
+
+int mtar_open_mmap(mtar_t *tar, const char *filename) {
+  void *data;
+  size_t size;
+  int err;
+  mtar_header_t h;
+
+  memset(tar, 0, sizeof(*tar));
+
+  /* Map file */
+  err = mtar_map_file(filename, &data, &size);
+  if (err) {
+    return err;
+  }
+
+  /* Init tar struct and functions; reads go through the memory backend */
+  tar->read = memory_read;
+  tar->seek = memory_seek;
+  tar->close = mtar_mmap_close;
+  tar->stream = data;
+  tar->memory_size = size;
+
+  /* Read first header to check it is valid */
+  err = mtar_read_header(tar, &h);
+  if (err != MTAR_ESUCCESS) {
+    mtar_close(tar);
+    return err;
+  }
+
+  /* Return ok */
+  return MTAR_ESUCCESS;
+}
+
+#ifdef HAVE_ZLIB
+
+/* A compressed archive is a series of gzip members ("frames"), each holding
+ * up to MTAR_GZBLOCK bytes of the tar stream. The extra field of every frame
+ * records its compressed and uncompressed size, so frames can be located
+ * without decompressing anything, while gzip sees one ordinary stream */
+#define MTAR_GZBLOCK   (64 * 1024)
+#define MTAR_GZHEADER  24
+#define MTAR_GZTRAILER 8
+/* Largest frame accepted when reading */
+#define MTAR_GZMAXDATA (16 * 1024 * 1024)
+#define MTAR_GZMAXFRAME \
+  (MTAR_GZHEADER + compressBound(MTAR_GZMAXDATA) + MTAR_GZTRAILER)
+
+/* Frames can be compressed by a pool of threads */
+#if defined(HAVE_PTHREAD) && defined(MTAR_PARALLEL)
+  #define MTAR_GZTHREADS
+static int mtar_thread_count(int nthreads);
+#endif
+
+typedef struct {
+  size_t offset;        /* of the frame in the file */
+  size_t size;          /* of the frame, header and trailer included */
+  size_t data_offset;   /* of its data in the tar stream */
+  size_t data_size;
+} mtar_gz_frame_t;
+
+#ifdef MTAR_GZTHREADS
+enum {
+  MTAR_GZFREE,
+  MTAR_GZQUEUED,
+  MTAR_GZBUSY,
+  MTAR_GZDONE
+};
+
+/* A frame handed to the compression threads */
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  unsigned char *packed;
+  size_t size;          /* of the compressed frame, once done */
+  int state;
+  int err;
+} mtar_gz_job_t;
+#endif
+
+typedef struct {
+  FILE *fp;
+  z_stream z;
+  int mode;             /* 'w', 'r', or 's' when reading a plain gzip file */
+  int level;
+  mtar_gz_frame_t *frames;
+  size_t frame_count;
+  size_t frame_capacity;
+  size_t size;          /* of the tar stream in the frames */
+  size_t written;       /* of it handed over, frames in flight included */
+  size_t offset;        /* of the next frame in the file */
+  unsigned char *block; /* data of the frame being written, or of `cached` */
+  size_t block_len;
+  size_t block_capacity;
+  size_t cached;
+  unsigned char *spare; /* data of the frame read before `cached` */
+  size_t spare_capacity;
+  size_t spare_frame;
+  unsigned char *packed;
+  size_t packed_capacity;
+#ifdef MTAR_GZTHREADS
+  /* Ring of frames in flight, oldest at `head` */
+  mtar_gz_job_t *jobs;
+  size_t job_count;
+  size_t head;
+  size_t queued;
+  pthread_t *threads;
+  int nthreads;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+#endif
+} mtar_gz_t;
+
+static void mtar_gz_put32(unsigned char *p, unsigned long v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned long mtar_gz_get32(const unsigned char *p) {
+  return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+         ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static int mtar_gz_is_frame(const unsigned char *p) {
+  /* Only FEXTRA is set, and the extra field is exactly our subfield */
+  return p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && p[3] == 4 &&
+         p[10] == 12 && p[11] == 0 && p[12] == 'M' && p[13] == 'T' &&
+         p[14] == 8 && p[15] == 0;
+}
+
+static int mtar_gz_reserve(unsigned char **buf, size_t *capacity,
+                           size_t size) {
+  unsigned char *p;
+  if (size <= *capacity) {
+    return MTAR_ESUCCESS;
+  }
+  p = (unsigned char *)realloc(*buf, size);
+  if (!p) {
+    return MTAR_ENOMEM;
+  }
+  *buf = p;
+  *capacity = size;
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_gz_add_frame(mtar_gz_t *gz, size_t offset, size_t size,
+                             size_t data_size) {
+  mtar_gz_frame_t *f;
+  if (gz->frame_count == gz->frame_capacity) {
+    size_t n = gz->frame_capacity ? gz->frame_capacity * 2 : 64;
+    f = (mtar_gz_frame_t *)realloc(gz->frames, n * sizeof(*f));
+    if (!f) {
+      return MTAR_ENOMEM;
+    }
+    gz->frames = f;
+    gz->frame_capacity = n;
+  }
+  f = &gz->frames[gz->frame_count++];
+  f->offset = offset;
+  f->size = size;
+  f->data_offset = gz->size;
+  f->data_size = data_size;
+  gz->size += data_size;
+  return MTAR_ESUCCESS;
+}
+
+/* Compresses one frame into p, which holds capacity bytes */
+static int mtar_gz_deflate(z_stream *z, const unsigned char *data, size_t len,
+                           unsigned char *p, size_t capacity, size_t *size) {
+  deflateReset(z);
+  z->next_in = (Bytef *)data;
+  z->avail_in = (uInt)len;
+  z->next_out = p + MTAR_GZHEADER;
+  z->avail_out = (uInt)(capacity - MTAR_GZHEADER - MTAR_GZTRAILER);
+  if (deflate(z, Z_FINISH) != Z_STREAM_END) {
+    return MTAR_EWRITEFAIL;
+  }
+  *size = MTAR_GZHEADER + z->total_out + MTAR_GZTRAILER;
+
+  /* gzip header with the "MT" subfield, deflate data, CRC and size */
+  memset(p, 0, MTAR_GZHEADER);
+  p[0] = 0x1f;
+  p[1] = 0x8b;
+  p[2] = 8;
+  p[3] = 4;
+  p[9] = 255;
+  p[10] = 12;
+  p[12] = 'M';
+  p[13] = 'T';
+  p[14] = 8;
+  mtar_gz_put32(&p[16], (unsigned long)*size);
+  mtar_gz_put32(&p[20], (unsigned long)len);
+  mtar_gz_put32(&p[*size - 8], crc32(crc32(0L, Z_NULL, 0), data, (uInt)len));
+  mtar_gz_put32(&p[*size - 4], (unsigned long)len);
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_gz_emit(mtar_gz_t *gz, const unsigned char *p, size_t size,
+                        size_t data_size) {
+  if (fwrite(p, 1, size, gz->fp) != size) {
+    return MTAR_EWRITEFAIL;
+  }
+  gz->offset += size;
+  return mtar_gz_add_frame(gz, gz->offset - size, size, data_size);
+}
+
+#ifdef MTAR_GZTHREADS
+static void *mtar_gz_worker(void *arg) {
+  mtar_gz_t *gz = (mtar_gz_t *)arg;
+  mtar_gz_job_t *job;
+  z_stream z;
+  size_t i;
+  int ok;
+
+  memset(&z, 0, sizeof(z));
+  ok = deflateInit2(&z, gz->level, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) == Z_OK;
+  pthread_mutex_lock(&gz->lock);
+  for (;;) {
+    /* Oldest queued frame first */
+    job = NULL;
+    for (i = 0; i < gz->queued && !job; i++) {
+      job = &gz->jobs[(gz->head + i) % gz->job_count];
+      if (job->state != MTAR_GZQUEUED) {
+        job = NULL;
+      }
+    }
+    if (!job) {
+      if (gz->stop) {
+        break;
+      }
+      pthread_cond_wait(&gz->work, &gz->lock);
+      continue;
+    }
+    job->state = MTAR_GZBUSY;
+    pthread_mutex_unlock(&gz->lock);
+    job->err = ok ? mtar_gz_deflate(&z, job->data, job->len, job->packed,
+                                    gz->packed_capacity, &job->size)
+                  : MTAR_ENOMEM;
+    pthread_mutex_lock(&gz->lock);
+    job->state = MTAR_GZDONE;
+    pthread_cond_broadcast(&gz->done);
+  }
+  pthread_mutex_unlock(&gz->lock);
+  if (ok) {
+    deflateEnd(&z);
+  }
+  return NULL;
+}
+
+/* Writes out finished frames in order, waiting for the oldest while more than
+ * `limit` are in flight. Called with the lock held */
+static int mtar_gz_drain(mtar_gz_t *gz, size_t limit) {
+  mtar_gz_job_t *job;
+  int err = MTAR_ESUCCESS;
+  while (gz->queued && !err) {
+    job = &gz->jobs[gz->head];
+    if (job->state != MTAR_GZDONE) {
+      if (gz->queued <= limit) {
+        break;
+      }
+      pthread_cond_wait(&gz->done, &gz->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&gz->lock);
+    err = job->err ? job->err
+                   : mtar_gz_emit(gz, job->packed, job->size, job->len);
+    pthread_mutex_lock(&gz->lock);
+    job->state = MTAR_GZFREE;
+    gz->head = (gz->head + 1) % gz->job_count;
+    gz->queued--;
+  }
+  return err;
+}
+
+static int mtar_gz_submit(mtar_gz_t *gz) {
+  mtar_gz_job_t *job;
+  unsigned char *data;
+  int err;
+
+  pthread_mutex_lock(&gz->lock);
+  /* A full ring holds the writer back until the oldest frame is written */
+  err = mtar_gz_drain(gz, gz->job_count - 1);
+  if (!err) {
+    /* The frame changes hands without copying */
+    job = &gz->jobs[(gz->head + gz->queued) % gz->job_count];
+    data = job->data;
+    job->data = gz->block;
+    job->len = gz->block_len;
+    job->state = MTAR_GZQUEUED;
+    gz->block = data;
+    gz->queued++;
+    pthread_cond_signal(&gz->work);
+  }
+  pthread_mutex_unlock(&gz->lock);
+  gz->block_len = 0;
+  return err;
+}
+
+/* Writes out every frame in flight and stops the threads */
+static int mtar_gz_stop(mtar_gz_t *gz) {
+  size_t i;
+  int err;
+
+  pthread_mutex_lock(&gz->lock);
+  err = mtar_gz_drain(gz, 0);
+  gz->stop = 1;
+  pthread_cond_broadcast(&gz->work);
+  pthread_mutex_unlock(&gz->lock);
+  for (i = 0; i < (size_t)gz->nthreads; i++) {
+    pthread_join(gz->threads[i], NULL);
+  }
+  for (i = 0; i < gz->job_count; i++) {
+    free(gz->jobs[i].data);
+    free(gz->jobs[i].packed);
+  }
+  free(gz->jobs);
+  free(gz->threads);
+  gz->jobs = NULL;
+  gz->job_count = 0;
+  pthread_mutex_destroy(&gz->lock);
+  pthread_cond_destroy(&gz->work);
+  pthread_cond_destroy(&gz->done);
+  return err;
+}
+#endif
+
+static int mtar_gz_flush_frame(mtar_gz_t *gz) {
+  size_t size;
+  int err;
+  gz->written += gz->block_len;
+#ifdef MTAR_GZTHREADS
+  if (gz->jobs) {
+    return mtar_gz_submit(gz);
+  }
+#endif
+  err = mtar_gz_deflate(&gz->z, gz->block, gz->block_len, gz->packed,
+                        gz->packed_capacity, &size);
+  if (!err) {
+    err = mtar_gz_emit(gz, gz->packed, size, gz->block_len);
+  }
+  gz->block_len = 0;
+  return err;
+}
+
+static int mtar_gz_write(mtar_t *tar, const void *data, size_t size) {
+  mtar_gz_t *gz = (mtar_gz_t *)tar->stream;
+  const char *p = (const char *)data;
+  int err;
+  while (size) {
+    size_t n = MTAR_GZBLOCK - gz->block_len;
+    if (n > size) {
+      n = size;
+    }
+    memcpy(&gz->block[gz->block_len], p, n);
+    gz->block_len += n;
+    p += n;
+    size -= n;
+    if (gz->block_len == MTAR_GZBLOCK) {
+      err = mtar_gz_flush_frame(gz);
+      if (err) {
+        return err;
+      }
+    }
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_gz_load_frame(mtar_gz_t *gz, size_t i) {
+  const mtar_gz_frame_t *f = &gz->frames[i];
+  unsigned char *p;
+  size_t n;
+  int err;
+
+  if (gz->cached == i) {
+    return MTAR_ESUCCESS;
+  }
+  /* The previous frame is kept too: a header is read again after the data of
+   * its member, which often ends in the next frame */
+  p = gz->block;
+  gz->block = gz->spare;
+  gz->spare = p;
+  n = gz->block_capacity;
+  gz->block_capacity = gz->spare_capacity;
+  gz->spare_capacity = n;
+  n = gz->cached;
+  gz->cached = gz->spare_frame;
+  gz->spare_frame = n;
+  if (gz->cached == i) {
+    return MTAR_ESUCCESS;
+  }
+  gz->cached = (size_t)-1;
+  err = mtar_gz_reserve(&gz->block, &gz->block_capacity, f->data_size);
+  if (!err) {
+    err = mtar_gz_reserve(&gz->packed, &gz->packed_capacity, f->size);
+  }
+  if (err) {
+    return err;
+  }
+  p = gz->packed;
+  err = mtar_fseek(gz->fp, f->offset);
+  if (err) {
+    return err;
+  }
+  if (fread(p, 1, f->size, gz->fp) != f->size) {
+    return MTAR_EREADFAIL;
+  }
+  inflateReset(&gz->z);
+  gz->z.next_in = p + MTAR_GZHEADER;
+  gz->z.avail_in = (uInt)(f->size - MTAR_GZHEADER - MTAR_GZTRAILER);
+  gz->z.next_out = gz->block;
+  gz->z.avail_out = (uInt)f->data_size;
+  if (inflate(&gz->z, Z_FINISH) != Z_STREAM_END ||
+      gz->z.total_out != f->data_size ||
+      mtar_gz_get32(&p[f->size - 8]) !=
+        crc32(crc32(0L, Z_NULL, 0), gz->block, (uInt)f->data_size)) {
+    return MTAR_EBADDATA;
+  }
+  gz->cached = i;
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_gz_read(mtar_t *tar, void *data, size_t size) {
+  mtar_gz_t *gz = (mtar_gz_t *)tar->stream;
+  char *p = (char *)data;
+  size_t lo, hi, i, n;
+  int err;
+
+  if (size > gz->size || tar->memory_pos > gz->size - size) {
+    return MTAR_EREADFAIL;
+  }
+  while (size) {
+    /* Find the frame holding the position */
+    i = gz->cached;
+    if (i >= gz->frame_count || tar->memory_pos < gz->frames[i].data_offset ||
+        tar->memory_pos - gz->frames[i].data_offset >=
+          gz->frames[i].data_size) {
+      lo = 0;
+      hi = gz->frame_count;
+      while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gz->frames[mid].data_offset <= tar->memory_pos) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+      i = lo;
+    }
+    err = mtar_gz_load_frame(gz, i);
+    if (err) {
+      return err;
+    }
+    n = tar->memory_pos - gz->frames[i].data_offset;
+    if (size < gz->frames[i].data_size - n) {
+      memcpy(p, &gz->block[n], size);
+      n = size;
+    } else {
+      memcpy(p, &gz->block[n], gz->frames[i].data_size - n);
+      n = gz->frames[i].data_size - n;
+    }
+    p += n;
+    size -= n;
+    tar->memory_pos += n;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_gz_read_stream(mtar_t *tar, void *data, size_t size) {
+  mtar_gz_t *gz = (mtar_gz_t *)tar->stream;
+  int res;
+
+  /* Plain gzip files are inflated in order; concatenated members are read
+   * as one stream, as gzip does */
+  gz->z.next_out = (Bytef *)data;
+  gz->z.avail_out = (uInt)size;
+  while (gz->z.avail_out) {
+    if (!gz->z.avail_in) {
+      gz->z.avail_in = (uInt)fread(gz->packed, 1, gz->packed_capacity,
+                                   gz->fp);
+      gz->z.next_in = gz->packed;
+      if (!gz->z.avail_in) {
+        return MTAR_EREADFAIL;
+      }
+    }
+    res = inflate(&gz->z, Z_NO_FLUSH);
+    if (res == Z_STREAM_END) {
+      inflateReset(&gz->z);
+    } else if (res != Z_OK && res != Z_BUF_ERROR) {
+      return MTAR_EBADDATA;
+    }
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_gz_seek(mtar_t *tar, size_t offset) {
+  mtar_gz_t *gz = (mtar_gz_t *)tar->stream;
+  /* Output only ever grows at the end */
+  if (gz->mode == 'w') {
+    return (offset == gz->written + gz->block_len) ? MTAR_ESUCCESS
+                                                    : MTAR_ESEEKFAIL;
+  }
+  if (offset > gz->size) {
+    return MTAR_ESEEKFAIL;
+  }
+  tar->memory_pos = offset;
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_gz_free(mtar_gz_t *gz) {
+  int res = fclose(gz->fp);
+  free(gz->frames);
+  free(gz->block);
+  free(gz->spare);
+  free(gz->packed);
+  free(gz);
+  return res;
+}
+
+static int mtar_gz_close(mtar_t *tar) {
+  mtar_gz_t *gz = (mtar_gz_t *)tar->stream;
+  int err = MTAR_ESUCCESS;
+
+  if (gz->mode == 'w') {
+    if (gz->block_len) {
+      err = mtar_gz_flush_frame(gz);
+    }
+#ifdef MTAR_GZTHREADS
+    if (gz->jobs) {
+      int res = mtar_gz_stop(gz);
+      if (!err) {
+        err = res;
+      }
+    }
+#endif
+    /* An empty archive is still one (empty) gzip member */
+    if (!gz->offset && !err) {
+      err = mtar_gz_flush_frame(gz);
+    }
+    deflateEnd(&gz->z);
+    if (mtar_gz_free(gz) != 0 && !err) {
+      err = MTAR_EWRITEFAIL;
+    }
+  } else {
+    inflateEnd(&gz->z);
+    mtar_gz_free(gz);
+  }
+  tar->stream = NULL;
+  return err;
+}
+
+static int mtar_gz_scan(mtar_gz_t *gz) {
+  unsigned char p[MTAR_GZHEADER];
+  size_t offset = 0, end, size, data_size, n;
+  int err;
+
+  err = mtar_fsize(gz->fp, &end);
+  if (err) {
+    return err;
+  }
+
+  /* Hop from frame header to frame header */
+  for (;;) {
+    err = mtar_fseek(gz->fp, offset);
+    if (err) {
+      return err;
+    }
+    n = fread(p, 1, sizeof(p), gz->fp);
+    if (n == 0 && gz->frame_count) {
+      return MTAR_ESUCCESS;
+    }
+    if (n != sizeof(p) || !mtar_gz_is_frame(p)) {
+      return MTAR_EUNSUPPORTED;
+    }
+    size = mtar_gz_get32(&p[16]);
+    data_size = mtar_gz_get32(&p[20]);
+    /* No larger than the data could compress to, and inside the file */
+    if (size < MTAR_GZHEADER + MTAR_GZTRAILER || data_size > MTAR_GZMAXDATA ||
+        size > MTAR_GZMAXFRAME || size > end - offset) {
+      return MTAR_EBADDATA;
+    }
+    err = mtar_gz_add_frame(gz, offset, size, data_size);
+    if (err) {
+      return err;
+    }
+    offset += size;
+  }
+}
+
+int mtar_open_gz_fp(mtar_t *tar, void *fp, const char *mode) {
+  mtar_gz_t *gz;
+  const char *digit;
+  int res, err;
+  mtar_header_t h;
+
+  memset(tar, 0, sizeof(*tar));
+  if (!fp) {
+    return MTAR_EOPENFAIL;
+  }
+  gz = (mtar_gz_t *)calloc(1, sizeof(*gz));
+  if (!gz) {
+    fclose((FILE *)fp);
+    return MTAR_ENOMEM;
+  }
+  gz->fp = (FILE *)fp;
+  gz->mode = strchr(mode, 'w') ? 'w' : 'r';
+  gz->level = Z_DEFAULT_COMPRESSION;
+  gz->cached = gz->spare_frame = (size_t)-1;
+  tar->stream = gz;
+  tar->close = mtar_gz_close;
+
+  if (gz->mode == 'w') {
+    /* A digit in the mode is the compression level, as for gzopen() */
+    for (digit = mode; *digit && (*digit < '0' || *digit > '9'); digit++)
+      ;
+    if (*digit) {
+      gz->level = *digit - '0';
+    }
+    if (deflateInit2(&gz->z, gz->level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      mtar_gz_free(gz);
+      tar->stream = NULL;
+      return MTAR_ENOMEM;
+    }
+    err = mtar_gz_reserve(&gz->block, &gz->block_capacity, MTAR_GZBLOCK);
+    if (!err) {
+      err = mtar_gz_reserve(&gz->packed, &gz->packed_capacity,
+                            MTAR_GZHEADER + deflateBound(&gz->z, MTAR_GZBLOCK) +
+                            MTAR_GZTRAILER);
+    }
+    if (err) {
+      deflateEnd(&gz->z);
+      mtar_gz_free(gz);
+      tar->stream = NULL;
+      return err;
+    }
+    tar->write = mtar_gz_write;
+    tar->seek = mtar_gz_seek;
+    return MTAR_ESUCCESS;
+  }
+
+  /* Framed archives are read at random; anything else, or anything that
+   * cannot seek, in order */
+  err = mtar_fseek(gz->fp, 0);
+  if (!err) {
+    err = mtar_gz_scan(gz);
+    if (err == MTAR_EUNSUPPORTED) {
+      err = mtar_fseek(gz->fp, 0);
+      gz->mode = 's';
+    }
+  } else {
+    err = MTAR_ESUCCESS;
+    gz->mode = 's';
+  }
+  if (gz->mode == 's') {
+    gz->frame_count = 0;
+    if (!err) {
+      err = mtar_gz_reserve(&gz->packed, &gz->packed_capacity, 64 * 1024);
+    }
+    res = inflateInit2(&gz->z, 15 + 32);
+    tar->read = mtar_gz_read_stream;
+    tar->flags = MTAR_FSTREAM;
+  } else {
+    res = inflateInit2(&gz->z, -15);
+    tar->read = mtar_gz_read;
+    tar->seek = mtar_gz_seek;
+  }
+  if (res != Z_OK) {
+    mtar_gz_free(gz);
+    tar->stream = NULL;
+    return MTAR_ENOMEM;
+  }
+
+  /* Read first header to check it is valid */
+  if (!err) {
+    err = mtar_read_header(tar, &h);
+  }
+  if (err) {
+    mtar_close(tar);
+  }
+  return err;
+}
+
+int mtar_open_gz(mtar_t *tar, const char *filename, const char *mode) {
+  FILE *fp = fopen(filename, strchr(mode, 'w') ? "wb" : "rb");
+  if (!fp) {
+    memset(tar, 0, sizeof(*tar));
+    return MTAR_EOPENFAIL;
+  }
+  return mtar_open_gz_fp(tar, fp, mode);
+}
+
+int mtar_set_threads(mtar_t *tar, int nthreads) {
+#ifdef MTAR_GZTHREADS
+  mtar_gz_t *gz = (mtar_gz_t *)tar->stream;
+  size_t i;
+  int err = MTAR_ESUCCESS;
+
+  /* Only before anything is written to a compressed archive */
+  if (tar->write != mtar_gz_write || gz->jobs || gz->block_len ||
+      gz->offset) {
+    return MTAR_EUNSUPPORTED;
+  }
+  nthreads = mtar_thread_count(nthreads);
+  if (nthreads == 1) {
+    return MTAR_ESUCCESS;
+  }
+  /* Two frames per thread keep the threads busy while frames are written */
+  gz->job_count = (size_t)nthreads * 2;
+  gz->jobs = (mtar_gz_job_t *)calloc(gz->job_count, sizeof(mtar_gz_job_t));
+  gz->threads = (pthread_t *)calloc((size_t)nthreads, sizeof(pthread_t));
+  if (!gz->jobs || !gz->threads) {
+    err = MTAR_ENOMEM;
+  }
+  for (i = 0; i < gz->job_count && !err; i++) {
+    gz->jobs[i].data = (unsigned char *)malloc(MTAR_GZBLOCK);
+    gz->jobs[i].packed = (unsigned char *)malloc(gz->packed_capacity);
+    if (!gz->jobs[i].data || !gz->jobs[i].packed) {
+      err = MTAR_ENOMEM;
+    }
+  }
+  pthread_mutex_init(&gz->lock, NULL);
+  pthread_cond_init(&gz->work, NULL);
+  pthread_cond_init(&gz->done, NULL);
+  gz->head = gz->queued = 0;
+  gz->stop = 0;
+  gz->nthreads = 0;
+  while (gz->nthreads < nthreads && !err &&
+         pthread_create(&gz->threads[gz->nthreads], NULL, mtar_gz_worker,
+                        gz) == 0) {
+    gz->nthreads++;
+  }
+  if (!err && !gz->nthreads) {
+    err = MTAR_EFAILURE;
+  }
+  if (err) {
+    if (gz->jobs) {
+      mtar_gz_stop(gz);
+    } else {
+      free(gz->threads);
+      gz->threads = NULL;
+    }
+  }
+  return err;
+#else
+  (void)tar;
+  (void)nthreads;
+  return MTAR_EUNSUPPORTED;
+#endif
+}
+
+#else
+
+int mtar_open_gz(mtar_t *tar, const char *filename, const char *mode) {
+  (void)filename;
+  (void)mode;
+  memset(tar, 0, sizeof(*tar));
+  return MTAR_EUNSUPPORTED;
+}
+
+int mtar_open_gz_fp(mtar_t *tar, void *fp, const char *mode) {
+  (void)fp;
+  (void)mode;
+  memset(tar, 0, sizeof(*tar));
+  return MTAR_EUNSUPPORTED;
+}
+
+int mtar_set_threads(mtar_t *tar, int nthreads) {
+  (void)tar;
+  (void)nthreads;
+  return MTAR_EUNSUPPORTED;
+}
+
+#endif
+
+int mtar_data_view(mtar_t *tar, const void **ptr, size_t *size) {
+  int err;
+  mtar_header_t h;
+  size_t offset;
+
+  /* Only memory-backed archives can hand out pointers */
+  if (tar->read != memory_read || !tar->stream) {
+    return MTAR_EUNSUPPORTED;
+  }
+  err = mtar_load_header(tar, &h);
+  offset = tar->pos;
+  if (!err) {
+    err = mtar_seek(tar, tar->last_header);
+  }
+  if (err) {
+    return err;
+  }
+  if (h.size > tar->memory_size - offset) {
+    return MTAR_EREADFAIL;
+  }
+  *ptr = (const char *)tar->stream + offset;
+  *size = h.size;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_entry_view(mtar_t *tar, const mtar_entry_t *e, const void **ptr) {
+  if (tar->read != memory_read || !tar->stream) {
+    return MTAR_EUNSUPPORTED;
+  }
+  if (e->data_offset > tar->memory_size ||
+      e->size > tar->memory_size - e->data_offset) {
+    return MTAR_EREADFAIL;
+  }
+  *ptr = (const char *)tar->stream + e->data_offset;
+  return MTAR_ESUCCESS;
+}
+
+static size_t mtar_hash(const char *name) {
+  /* FNV-1a, with the 64-bit parameters where size_t has the room */
+  const unsigned char *p = (const unsigned char *)name;
+  size_t h, prime;
+  if (sizeof(size_t) > 4) {
+    h = ((size_t)0xCBF29CE4UL << 16 << 16) | 0x84222325UL;
+    prime = ((size_t)0x100UL << 16 << 16) | 0x1B3UL;
+  } else {
+    h = (size_t)2166136261UL;
+    prime = (size_t)16777619UL;
+  }
+  while (*p) {
+    h ^= *p++;
+    h *= prime;
+  }
+  return h;
+}
+
+static int mtar_index_grow_slots(mtar_index_t *idx) {
+  size_t i, j, mask, count = idx->slot_count ? idx->slot_count * 2 : 64;
+  size_t *slots = (size_t *)calloc(count, sizeof(size_t));
+  if (!slots) {
+    return MTAR_ENOMEM;
+  }
+  /* Rehash the occupied slots */
+  mask = count - 1;
+  for (i = 0; i < idx->slot_count; i++) {
+    size_t n = idx->slots[i];
+    if (n) {
+      j = idx->entries[n - 1].hash & mask;
+      while (slots[j]) {
+        j = (j + 1) & mask;
+      }
+      slots[j] = n;
+    }
+  }
+  free(idx->slots);
+  idx->slots = slots;
+  idx->slot_count = count;
+  return MTAR_ESUCCESS;
+}
+
+static void mtar_index_insert(mtar_index_t *idx, size_t n) {
+  const mtar_entry_t *e = &idx->entries[n];
+  size_t mask = idx->slot_count - 1;
+  size_t j = e->hash & mask;
+  /* Like the linear mtar_find() the last member of a name wins */
+  while (idx->slots[j]) {
+    const mtar_entry_t *o = &idx->entries[idx->slots[j] - 1];
+    if (o->hash == e->hash &&
+        !strcmp(&idx->names[o->name], &idx->names[e->name])) {
+      idx->slots[j] = n + 1;
+      return;
+    }
+    j = (j + 1) & mask;
+  }
+  idx->slots[j] = n + 1;
+}
+
+static int mtar_index_add(mtar_index_t *idx, const mtar_header_t *h,
+                          size_t offset, size_t data_offset) {
+  const char *name;
+  size_t len, hash;
+  mtar_entry_t *e;
+  int err;
+
+  /* Name order is rebuilt on next use */
+  free(idx->sorted);
+  idx->sorted = NULL;
+
+  /* Keep the load factor below one half */
+  if ((idx->count + 1) * 2 > idx->slot_count) {
+    err = mtar_index_grow_slots(idx);
+    if (err) {
+      return err;
+    }
+  }
+  if (idx->count == idx->capacity) {
+    size_t capacity = idx->capacity ? idx->capacity * 2 : 64;
+    e = (mtar_entry_t *)realloc(idx->entries, capacity * sizeof(*e));
+    if (!e) {
+      return MTAR_ENOMEM;
+    }
+    idx->entries = e;
+    idx->capacity = capacity;
+  }
+  name = mtar_header_name(h);
+  len = strlen(name) + 1;
+  if (idx->names_size + len > idx->names_capacity) {
+    size_t capacity = idx->names_capacity ? idx->names_capacity * 2 : 4096;
+    char *names;
+    while (capacity < idx->names_size + len) {
+      capacity *= 2;
+    }
+    names = (char *)realloc(idx->names, capacity);
+    if (!names) {
+      return MTAR_ENOMEM;
+    }
+    idx->names = names;
+    idx->names_capacity = capacity;
+  }
+
+  /* Store entry */
+  hash = mtar_hash(name);
+  e = &idx->entries[idx->count];
+  e->name = idx->names_size;
+  e->hash = hash;
+  e->offset = offset;
+  e->data_offset = data_offset;
+  e->size = h->size;
+  e->type = h->type;
+  e->mtime = h->mtime;
+  memcpy(&idx->names[idx->names_size], name, len);
+  idx->names_size += len;
+  idx->count++;
+  mtar_index_insert(idx, idx->count - 1);
+  return MTAR_ESUCCESS;
+}
+
+void mtar_index_init(mtar_index_t *idx) {
+  memset(idx, 0, sizeof(*idx));
+}
+
+void mtar_index_free(mtar_index_t *idx) {
+  free(idx->sorted);
+  free(idx->entries);
+  free(idx->slots);
+  free(idx->names);
+  mtar_index_init(idx);
+}
+
+int mtar_index_build(mtar_t *tar, mtar_index_t *idx) {
+  int err;
+  mtar_header_t h;
+
+  mtar_index_init(idx);
+  tar->index = NULL;
+
+  /* Walk every header once, recording where it lives */
+  err = mtar_rewind(tar);
+  while (!err && (err = mtar_load_header(tar, &h)) == MTAR_ESUCCESS) {
+    err = mtar_index_add(idx, &h, tar->last_header, tar->pos);
+    if (!err) {
+      err = mtar_seek(tar, tar->pos + mtar_round_up(h.size, 512));
+    }
+  }
+  if (err != MTAR_ENULLRECORD) {
+    mtar_index_free(idx);
+    return err;
+  }
+  idx->end = tar->last_header;
+
+  /* Attach index and go back to the start */
+  tar->index = idx;
+  return mtar_rewind(tar);
+}
+
+/* The newest entry of a name, tombstones included */
+static const mtar_entry_t *mtar_index_newest(const mtar_index_t *idx,
+                                             const char *name, size_t hash) {
+  size_t j, mask;
+
+  if (!idx->slot_count) {
+    return NULL;
+  }
+  mask = idx->slot_count - 1;
+  for (j = hash & mask; idx->slots[j]; j = (j + 1) & mask) {
+    const mtar_entry_t *o = &idx->entries[idx->slots[j] - 1];
+    if (o->hash == hash && !strcmp(&idx->names[o->name], name)) {
+      return o;
+    }
+  }
+  return NULL;
+}
+
+int mtar_index_lookup(const mtar_index_t *idx, const char *name,
+                      const mtar_entry_t **e) {
+  const mtar_entry_t *o = mtar_index_newest(idx, name, mtar_hash(name));
+  if (!o || o->type == MTAR_TDELETED) {
+    return MTAR_ENOTFOUND;
+  }
+  if (e) {
+    *e = o;
+  }
+  return MTAR_ESUCCESS;
+}
+
+const char *mtar_entry_name(const mtar_index_t *idx, const mtar_entry_t *e) {
+  return &idx->names[e->name];
+}
+
+/* Whether the entry is the one a lookup of its name finds */
+static int mtar_entry_live(const mtar_index_t *idx, const mtar_entry_t *e) {
+  return e->type != MTAR_TDELETED &&
+         mtar_index_newest(idx, &idx->names[e->name], e->hash) == e;
+}
+
+size_t mtar_index_dead(const mtar_index_t *idx) {
+  size_t i, dead = 0;
+  /* Replaced and deleted members, and the tombstones themselves */
+  for (i = 0; i < idx->count; i++) {
+    const mtar_entry_t *e = &idx->entries[i];
+    if (!mtar_entry_live(idx, e)) {
+      dead += e->data_offset + mtar_round_up(e->size, 512) - e->offset;
+    }
+  }
+  return dead;
+}
+
+/* Path order is strcmp() order with '/' before every other character, so
+ * that a directory is directly followed by everything below it */
+static int mtar_path_rank(unsigned char c) {
+  return c == '/' ? 1 : c ? c + 1 : 0;
+}
+
+static int mtar_path_cmp(const char *a, const char *b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  return mtar_path_rank((unsigned char)*a) - mtar_path_rank((unsigned char)*b);
+}
+
+typedef struct {
+  const char *name;
+  size_t n;
+} mtar_sort_item_t;
+
+static int mtar_sort_cmp(const void *a, const void *b) {
+  return mtar_path_cmp(((const mtar_sort_item_t *)a)->name,
+                       ((const mtar_sort_item_t *)b)->name);
+}
+
+int mtar_index_sort(mtar_index_t *idx) {
+  mtar_sort_item_t *items;
+  size_t i, n = 0;
+
+  if (idx->sorted) {
+    return MTAR_ESUCCESS;
+  }
+  /* One extra so that an empty order is not NULL */
+  items = (mtar_sort_item_t *)malloc((idx->count + 1) * sizeof(*items));
+  idx->sorted = (size_t *)malloc((idx->count + 1) * sizeof(size_t));
+  if (!items || !idx->sorted) {
+    free(items);
+    free(idx->sorted);
+    idx->sorted = NULL;
+    return MTAR_ENOMEM;
+  }
+  /* Only what a lookup finds: no tombstones, no replaced versions */
+  for (i = 0; i < idx->count; i++) {
+    if (mtar_entry_live(idx, &idx->entries[i])) {
+      items[n].name = &idx->names[idx->entries[i].name];
+      items[n].n = i;
+      n++;
+    }
+  }
+  qsort(items, n, sizeof(*items), mtar_sort_cmp);
+  for (i = 0; i < n; i++) {
+    idx->sorted[i] = items[i].n;
+  }
+  idx->sorted_count = n;
+  free(items);
+  return MTAR_ESUCCESS;
+}
+
+static const char *mtar_sorted_name(const mtar_index_t *idx, size_t i) {
+  return &idx->names[idx->entries[idx->sorted[i]].name];
+}
+
+/* First position in [lo, hi) whose name, cut to n characters, sorts after
+ * `path` (upper) or not before it */
+static size_t mtar_index_bound(const mtar_index_t *idx, size_t lo, size_t hi,
+                               const char *path, size_t n, int upper) {
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const char *s = mtar_sorted_name(idx, mid);
+    size_t i;
+    int c = 0;
+    for (i = 0; i < n && !c; i++) {
+      c = mtar_path_rank((unsigned char)s[i]) -
+          mtar_path_rank((unsigned char)path[i]);
+      if (!s[i]) {
+        break;
+      }
+    }
+    if (c < 0 || (upper && !c)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static int mtar_query_init(mtar_query_t *q, mtar_index_t *idx,
+                           const char *prefix, size_t n) {
+  int err = mtar_index_sort(idx);
+  memset(q, 0, sizeof(*q));
+  if (err) {
+    return err;
+  }
+  q->idx = idx;
+  q->dir_len = (size_t)-1;
+  q->pos = mtar_index_bound(idx, 0, idx->sorted_count, prefix, n, 0);
+  q->end = mtar_index_bound(idx, q->pos, idx->sorted_count, prefix, n, 1);
+  return MTAR_ESUCCESS;
+}
+
+int mtar_index_prefix(mtar_query_t *q, mtar_index_t *idx, const char *prefix) {
+  return mtar_query_init(q, idx, prefix, strlen(prefix));
+}
+
+int mtar_index_children(mtar_query_t *q, mtar_index_t *idx, const char *dir) {
+  char path[MTAR_PATHMAX + 2];
+  size_t n = strlen(dir);
+  int err;
+  if (n > MTAR_PATHMAX) {
+    return MTAR_ENAMELONG;
+  }
+  /* Everything under "dir/", or the whole archive for "" */
+  memcpy(path, dir, n);
+  if (n && path[n - 1] != '/') {
+    path[n++] = '/';
+  }
+  err = mtar_query_init(q, idx, path, n);
+  q->dir_len = n;
+  return err;
+}
+
+int mtar_index_glob(mtar_query_t *q, mtar_index_t *idx, const char *pattern) {
+  size_t n = strcspn(pattern, "*?[");
+  const char *p;
+  int err = mtar_query_init(q, idx, pattern, n);
+  q->pattern = pattern;
+  /* Without "**", names with more slashes than the pattern cannot match */
+  q->depth = 0;
+  for (p = pattern; *p; p++) {
+    if (*p == '/') {
+      q->depth++;
+    } else if (p[0] == '*' && p[1] == '*') {
+      q->depth = (size_t)-1;
+      break;
+    }
+  }
+  return err;
+}
+
+/* '*' and '?' stop at slashes, "**" does not */
+static int mtar_glob_match(const char *p, const char *s) {
+  const char *c, *first;
+  int any, neg;
+  for (; *p; p++, s++) {
+    switch (*p) {
+      case '*':
+        any = p[1] == '*';
+        p += any ? 2 : 1;
+        for (;; s++) {
+          if (mtar_glob_match(p, s)) {
+            return 1;
+          }
+          if (!*s || (*s == '/' && !any)) {
+            return 0;
+          }
+        }
+      case '?':
+        if (!*s || *s == '/') {
+          return 0;
+        }
+        break;
+      case '[':
+        /* [abc], [a-z], [!a] or [^a]; a lone '[' is literal */
+        c = p + 1;
+        neg = *c == '!' || *c == '^';
+        c += neg;
+        any = 0;
+        /* A ']' right at the start is part of the set */
+        for (first = c; *c && (*c != ']' || c == first); ) {
+          if (c[1] == '-' && c[2] && c[2] != ']') {
+            any |= (unsigned char)*s >= (unsigned char)c[0] &&
+                   (unsigned char)*s <= (unsigned char)c[2];
+            c += 3;
+          } else {
+            any |= *s == *c;
+            c++;
+          }
+        }
+        if (!*c) {
+          if (*s != '[') {
+            return 0;
+          }
+          break;
+        }
+        if (!*s || *s == '/' || any == neg) {
+          return 0;
+        }
+        p = c;
+        break;
+      default:
+        if (*p != *s) {
+          return 0;
+        }
+    }
+  }
+  return !*s;
+}
+
+int mtar_query_next(mtar_query_t *q) {
+  const mtar_index_t *idx = q->idx;
+  const char *s, *slash;
+  size_t i, n, depth;
+
+  while (q->pos < q->end) {
+    q->entry = &idx->entries[idx->sorted[q->pos]];
+    s = &idx->names[q->entry->name];
+    n = strlen(s);
+    if (q->dir_len != (size_t)-1) {
+      /* One child per name below the directory; the directory itself is
+       * left out */
+      if (!s[q->dir_len]) {
+        q->pos++;
+        continue;
+      }
+      slash = strchr(&s[q->dir_len], '/');
+      n = slash ? (size_t)(slash - s) : n;
+      if (s[n] && s[n + 1]) {
+        q->entry = NULL;
+      }
+      memcpy(q->name, s, n);
+      q->name[n] = '/';
+      q->pos = mtar_index_bound(idx, q->pos + 1, q->end, q->name, n + 1, 1);
+      q->name[n] = '\0';
+      return MTAR_ESUCCESS;
+    }
+    q->pos++;
+    if (q->pattern) {
+      /* Skip whatever lies below a name too deep to match */
+      for (i = 0, depth = 0; s[i] && depth <= q->depth; i++) {
+        depth += s[i] == '/';
+      }
+      if (depth > q->depth) {
+        q->pos = mtar_index_bound(idx, q->pos, q->end, s, i, 1);
+        continue;
+      }
+      if (!mtar_glob_match(q->pattern, s)) {
+        continue;
+      }
+    }
+    memcpy(q->name, s, n + 1);
+    return MTAR_ESUCCESS;
+  }
+  q->entry = NULL;
+  return MTAR_ENOTFOUND;
+}
+
+/* Sidecar index file layout, all integers little-endian:
+ *
+ *   0  magic "MTARIDX\0"
+ *   8  version (4 bytes), reserved (4 bytes)
+ *  16  archive size, archive mtime, end offset, entry count, names size
+ *  56  entries, MTAR_IDX_ENTRY bytes each
+ *  ..  names, NUL-terminated */
+#define MTAR_IDX_MAGIC    "MTARIDX"
+#define MTAR_IDX_VERSION  1
+#define MTAR_IDX_HEADER   56
+#define MTAR_IDX_ENTRY    40
+
+static void mtar_put_le(unsigned char *p, size_t v, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    p[i] = (unsigned char)(v & 0xFF);
+    v >>= 8;
+  }
+}
+
+static size_t mtar_get_le(const unsigned char *p, int n) {
+  size_t v = 0;
+  while (n--) {
+    v = (v << 8) | p[n];
+  }
+  return v;
+}
+
+static int mtar_stat_archive(const char *tarname, size_t *size,
+                             size_t *mtime) {
+  struct stat st;
+  *size = *mtime = 0;
+  if (!tarname) {
+    return MTAR_ESUCCESS;
+  }
+  if (stat(tarname, &st) != 0) {
+    return MTAR_EOPENFAIL;
+  }
+  *size = (size_t)st.st_size;
+  *mtime = (size_t)st.st_mtime;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_index_save(const mtar_index_t *idx, const char *filename,
+                    const char *tarname) {
+  FILE *fp;
+  unsigned char *buf, *p;
+  size_t i, n, size, mtime;
+  int err;
+
+  err = mtar_stat_archive(tarname, &size, &mtime);
+  if (err) {
+    return err;
+  }
+
+  /* Encode the whole file in memory so it can be written at once */
+  n = MTAR_IDX_HEADER + idx->count * MTAR_IDX_ENTRY + idx->names_size;
+  buf = (unsigned char *)calloc(1, n);
+  if (!buf) {
+    return MTAR_ENOMEM;
+  }
+  memcpy(buf, MTAR_IDX_MAGIC, sizeof(MTAR_IDX_MAGIC));
+  mtar_put_le(buf + 8, MTAR_IDX_VERSION, 4);
+  mtar_put_le(buf + 16, size, 8);
+  mtar_put_le(buf + 24, mtime, 8);
+  mtar_put_le(buf + 32, idx->end, 8);
+  mtar_put_le(buf + 40, idx->count, 8);
+  mtar_put_le(buf + 48, idx->names_size, 8);
+  p = buf + MTAR_IDX_HEADER;
+  for (i = 0; i < idx->count; i++, p += MTAR_IDX_ENTRY) {
+    const mtar_entry_t *e = &idx->entries[i];
+    mtar_put_le(p, e->name, 8);
+    mtar_put_le(p + 8, e->offset, 8);
+    mtar_put_le(p + 16, e->data_offset, 8);
+    mtar_put_le(p + 24, e->size, 8);
+    mtar_put_le(p + 32, e->type, 4);
+    mtar_put_le(p + 36, e->mtime, 4);
+  }
+  if (idx->names_size) {
+    memcpy(p, idx->names, idx->names_size);
+  }
+
+  fp = fopen(filename, "wb");
+  if (!fp) {
+    free(buf);
+    return MTAR_EOPENFAIL;
+  }
+  err = (fwrite(buf, 1, n, fp) == n) ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+  if (fclose(fp) != 0 && !err) {
+    err = MTAR_EWRITEFAIL;
+  }
+  free(buf);
+  return err;
+}
+
+static int mtar_index_decode(mtar_index_t *idx, const unsigned char *buf,
+                             size_t n, const char *tarname) {
+  size_t i, count, names_size, size, mtime;
+  const unsigned char *p;
+  int err;
+
+  /* Check header */
+  if (n < MTAR_IDX_HEADER || memcmp(buf, MTAR_IDX_MAGIC, 8) != 0 ||
+      mtar_get_le(buf + 8, 4) != MTAR_IDX_VERSION) {
+    return MTAR_EBADINDEX;
+  }
+  count = mtar_get_le(buf + 40, 8);
+  names_size = mtar_get_le(buf + 48, 8);
+  if (count > (n - MTAR_IDX_HEADER) / MTAR_IDX_ENTRY ||
+      n - MTAR_IDX_HEADER - count * MTAR_IDX_ENTRY != names_size ||
+      (count && (!names_size || buf[n - 1] != '\0'))) {
+    return MTAR_EBADINDEX;
+  }
+
+  /* Check the index still describes the archive */
+  err = mtar_stat_archive(tarname, &size, &mtime);
+  if (err) {
+    return err;
+  }
+  if (tarname && (mtar_get_le(buf + 16, 8) != size ||
+                  mtar_get_le(buf + 24, 8) != mtime)) {
+    return MTAR_ESTALE;
+  }
+
+  /* Load entries and names */
+  idx->end = mtar_get_le(buf + 32, 8);
+  idx->entries = (mtar_entry_t *)malloc((count ? count : 1) * sizeof(mtar_entry_t));
+  idx->names = (char *)malloc(names_size ? names_size : 1);
+  if (!idx->entries || !idx->names) {
+    return MTAR_ENOMEM;
+  }
+  idx->capacity = count;
+  idx->names_capacity = names_size;
+  idx->names_size = names_size;
+  p = buf + MTAR_IDX_HEADER;
+  memcpy(idx->names, p + count * MTAR_IDX_ENTRY, names_size);
+  for (i = 0; i < count; i++, p += MTAR_IDX_ENTRY) {
+    mtar_entry_t *e = &idx->entries[i];
+    e->name = mtar_get_le(p, 8);
+    if (e->name >= names_size) {
+      return MTAR_EBADINDEX;
+    }
+    e->hash = mtar_hash(&idx->names[e->name]);
+    e->offset = mtar_get_le(p + 8, 8);
+    e->data_offset = mtar_get_le(p + 16, 8);
+    e->size = mtar_get_le(p + 24, 8);
+    e->type = (unsigned)mtar_get_le(p + 32, 4);
+    e->mtime = (unsigned)mtar_get_le(p + 36, 4);
+  }
+
+  /* Build the hash table */
+  while (idx->slot_count < count * 2 || !idx->slot_count) {
+    err = mtar_index_grow_slots(idx);
+    if (err) {
+      return err;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    mtar_index_insert(idx, i);
+  }
+  idx->count = count;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_index_load(mtar_index_t *idx, const char *filename,
+                    const char *tarname) {
+  FILE *fp;
+  unsigned char *buf;
+  size_t n;
+  int err;
+
+  mtar_index_init(idx);
+
+  /* Read the whole file with a single read */
+  fp = fopen(filename, "rb");
+  if (!fp) {
+    return MTAR_EOPENFAIL;
+  }
+  err = mtar_fsize(fp, &n);
+  if (!err) {
+    err = mtar_fseek(fp, 0);
+  }
+  if (err) {
+    fclose(fp);
+    return err;
+  }
+  buf = (unsigned char *)malloc(n ? n : 1);
+  if (!buf) {
+    fclose(fp);
+    return MTAR_ENOMEM;
+  }
+  if (fread(buf, 1, n, fp) != n) {
+    free(buf);
+    fclose(fp);
+    return MTAR_EREADFAIL;
+  }
+  fclose(fp);
+
+  err = mtar_index_decode(idx, buf, n, tarname);
+  free(buf);
+  if (err) {
+    mtar_index_free(idx);
+  }
+  return err;
+}
+
+static int mtar_archive_index(mtar_archive_t *ar, const char *filename,
+                              const char *index_file) {
+  mtar_t tar;
+  int err;
+  /* Scan the archive once unless a sidecar index is given */
+  if (index_file) {
+    return mtar_index_load(&ar->index, index_file, filename);
+  }
+  mtar_open_archive(&tar, ar);
+  tar.index = NULL;
+  if (ar->fd >= 0) {
+    mtar_set_buffer(&tar, 64 * 1024);
+  }
+  err = mtar_index_build(&tar, &ar->index);
+  mtar_close(&tar);
+  return err;
+}
+
+#ifdef MTAR_PARALLEL
+static int mtar_pread(int fd, void *data, size_t size, size_t offset) {
+  char *p = (char *)data;
+  while (size) {
+    ssize_t n = pread(fd, p, size, (off_t)offset);
+    if (n <= 0) {
+      return MTAR_EREADFAIL;
+    }
+    p += n;
+    size -= (size_t)n;
+    offset += (size_t)n;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_cursor_read(mtar_t *tar, void *data, size_t size) {
+  const mtar_archive_t *ar = (const mtar_archive_t *)tar->stream;
+  int err;
+  /* The cursor position lives in the mtar_t, never in the shared fd */
+  if (size > ar->size || tar->memory_pos > ar->size - size) {
+    return MTAR_EREADFAIL;
+  }
+  err = mtar_pread(ar->fd, data, size, tar->memory_pos);
+  if (!err) {
+    tar->memory_pos += size;
+  }
+  return err;
+}
+
+static int mtar_cursor_seek(mtar_t *tar, size_t offset) {
+  const mtar_archive_t *ar = (const mtar_archive_t *)tar->stream;
+  if (offset > ar->size) {
+    return MTAR_ESEEKFAIL;
+  }
+  tar->memory_pos = offset;
+  return MTAR_ESUCCESS;
+}
+#endif
+
+int mtar_archive_open(mtar_archive_t *ar, const char *filename,
+                      const char *index_file) {
+#ifdef MTAR_PARALLEL
+  struct stat st;
+  int err;
+
+  memset(ar, 0, sizeof(*ar));
+  mtar_index_init(&ar->index);
+  ar->fd = open(filename, O_RDONLY);
+  if (ar->fd < 0) {
+    return MTAR_EOPENFAIL;
+  }
+  if (fstat(ar->fd, &st) != 0) {
+    mtar_archive_close(ar);
+    return MTAR_EOPENFAIL;
+  }
+  ar->size = (size_t)st.st_size;
+  err = mtar_archive_index(ar, filename, index_file);
+  if (err) {
+    mtar_archive_close(ar);
+  }
+  return err;
+#else
+  /* Without pread() the archive is shared through a mapping */
+  return mtar_archive_open_mmap(ar, filename, index_file);
+#endif
+}
+
+int mtar_archive_open_mmap(mtar_archive_t *ar, const char *filename,
+                           const char *index_file) {
+  void *data;
+  int err;
+
+  memset(ar, 0, sizeof(*ar));
+  mtar_index_init(&ar->index);
+  ar->fd = -1;
+  err = mtar_map_file(filename, &data, &ar->size);
+  if (err) {
+    return err;
+  }
+  ar->data = data;
+  err = mtar_archive_index(ar, filename, index_file);
+  if (err) {
+    mtar_archive_close(ar);
+  }
+  return err;
+}
+
+int mtar_archive_close(mtar_archive_t *ar) {
+  int err = MTAR_ESUCCESS;
+#ifdef MTAR_PARALLEL
+  if (ar->fd >= 0 && close(ar->fd) != 0) {
+    err = MTAR_EFAILURE;
+  }
+#endif
+  mtar_unmap_file((void *)ar->data, ar->size);
+  mtar_index_free(&ar->index);
+  ar->fd = -1;
+  ar->data = NULL;
+  ar->size = 0;
+  return err;
+}
+
+int mtar_open_archive(mtar_t *tar, const mtar_archive_t *ar) {
+  memset(tar, 0, sizeof(*tar));
+
+  /* Mapped archives read through the memory backend, so views work */
+  if (ar->data) {
+    tar->read = memory_read;
+    tar->seek = memory_seek;
+    tar->stream = (void *)ar->data;
+    tar->memory_size = ar->size;
+  } else {
+#ifdef MTAR_PARALLEL
+    tar->read = mtar_cursor_read;
+    tar->seek = mtar_cursor_seek;
+    tar->stream = (void *)ar;
+#else
+    return MTAR_EUNSUPPORTED;
+#endif
+  }
+  /* Only lookups are done on the shared index */
+  tar->index = (mtar_index_t *)&ar->index;
+  return MTAR_ESUCCESS;
+}
+
+int mtar_archive_read_at(const mtar_archive_t *ar, const mtar_entry_t *e,
+                         size_t offset, void *data, size_t size) {
+  if (offset > e->size || size > e->size - offset ||
+      e->data_offset + e->size > ar->size) {
+    return MTAR_EREADFAIL;
+  }
+  if (ar->data) {
+    memcpy(data, (const char *)ar->data + e->data_offset + offset, size);
+    return MTAR_ESUCCESS;
+  }
+#ifdef MTAR_PARALLEL
+  return mtar_pread(ar->fd, data, size, e->data_offset + offset);
+#else
+  return MTAR_EUNSUPPORTED;
+#endif
+}
+
+int mtar_archive_view(const mtar_archive_t *ar, const mtar_entry_t *e,
+                      const void **ptr) {
+  if (!ar->data) {
+    return MTAR_EUNSUPPORTED;
+  }
+  if (e->data_offset > ar->size || e->size > ar->size - e->data_offset) {
+    return MTAR_EREADFAIL;
+  }
+  *ptr = (const char *)ar->data + e->data_offset;
+  return MTAR_ESUCCESS;
+}
+
+/* Catalog file layout, all integers little-endian:
+ *
+ *   0  magic "MTARCAT\0"
+ *   8  version (4 bytes), reserved (4 bytes)
+ *  16  record count
+ *  24  records, each:
+ *       0  record size, a multiple of 8
+ *       8  live members, their data bytes, filter size in bits
+ *      32  path length (4 bytes), hash count (2 bytes), flags (2 bytes)
+ *      40  path, NUL-terminated and padded to 8 bytes
+ *      ..  Bloom filter over the member names
+ *
+ * Records are only ever appended; adding an archive again marks its older
+ * record MTAR_CAT_DEAD. */
+#define MTAR_CAT_MAGIC    "MTARCAT"
+#define MTAR_CAT_VERSION  1
+#define MTAR_CAT_HEADER   24
+#define MTAR_CAT_RECORD   40
+#define MTAR_CAT_DEAD     1
+
+/* About 1% false positives at 10 bits per member */
+#define MTAR_CAT_BITS     10
+#define MTAR_CAT_HASHES   7
+
+/* 32-bit FNV-1a and a mix of it, the same on every platform, combined as
+ * h1 + i * h2 */
+static void mtar_bloom_hash(const char *name, unsigned long *h1,
+                            unsigned long *h2) {
+  const unsigned char *p = (const unsigned char *)name;
+  unsigned long h = 2166136261UL;
+  while (*p) {
+    h = ((h ^ *p++) * 16777619UL) & 0xFFFFFFFFUL;
+  }
+  *h1 = h;
+  h ^= h >> 16;
+  h = (h * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+  h ^= h >> 13;
+  h = (h * 0xC2B2AE35UL) & 0xFFFFFFFFUL;
+  h ^= h >> 16;
+  *h2 = h | 1;
+}
+
+static int mtar_bloom_test(const unsigned char *filter, size_t bits,
+                           unsigned hashes, unsigned long h1,
+                           unsigned long h2) {
+  unsigned i;
+  for (i = 0; i < hashes; i++) {
+    size_t b = (size_t)((h1 + i * h2) & 0xFFFFFFFFUL) & (bits - 1);
+    if (!(filter[b / 8] & (1 << (b % 8)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void mtar_catalog_init(mtar_catalog_t *cat) {
+  memset(cat, 0, sizeof(*cat));
+}
+
+void mtar_catalog_free(mtar_catalog_t *cat) {
+  if (cat->mapped) {
+    mtar_unmap_file(cat->data, cat->size);
+  } else {
+    free(cat->data);
+  }
+  mtar_catalog_init(cat);
+}
+
+/* Summary of the live members of an index */
+static int mtar_catalog_record(const char *path, const mtar_index_t *idx,
+                               unsigned char **rec, size_t *n) {
+  size_t i, members = 0, bytes = 0, bits = 64, len = strlen(path);
+  size_t name_size = mtar_round_up(len + 1, 8);
+  unsigned long h1, h2;
+  unsigned char *p;
+  unsigned k;
+
+  for (i = 0; i < idx->count; i++) {
+    if (mtar_entry_live(idx, &idx->entries[i])) {
+      members++;
+      bytes += idx->entries[i].size;
+    }
+  }
+  while (bits < members * MTAR_CAT_BITS) {
+    bits *= 2;
+  }
+  *n = MTAR_CAT_RECORD + name_size + bits / 8;
+  *rec = p = (unsigned char *)calloc(1, *n);
+  if (!p) {
+    return MTAR_ENOMEM;
+  }
+  mtar_put_le(p, *n, 8);
+  mtar_put_le(p + 8, members, 8);
+  mtar_put_le(p + 16, bytes, 8);
+  mtar_put_le(p + 24, bits, 8);
+  mtar_put_le(p + 32, len, 4);
+  mtar_put_le(p + 36, MTAR_CAT_HASHES, 2);
+  memcpy(p + MTAR_CAT_RECORD, path, len);
+  p += MTAR_CAT_RECORD + name_size;
+  for (i = 0; i < idx->count; i++) {
+    const mtar_entry_t *e = &idx->entries[i];
+    if (mtar_entry_live(idx, e)) {
+      mtar_bloom_hash(&idx->names[e->name], &h1, &h2);
+      for (k = 0; k < MTAR_CAT_HASHES; k++) {
+        size_t b = (size_t)((h1 + k * h2) & 0xFFFFFFFFUL) & (bits - 1);
+        p[b / 8] |= (unsigned char)(1 << (b % 8));
+      }
+    }
+  }
+  return MTAR_ESUCCESS;
+}
+
+/* A record for `path`, from `idx` or else from reading the archive */
+static int mtar_catalog_summarize(const char *path, const mtar_index_t *idx,
+                                  unsigned char **rec, size_t *n) {
+  mtar_t tar;
+  mtar_index_t own;
+  int err;
+  if (idx) {
+    return mtar_catalog_record(path, idx, rec, n);
+  }
+  err = mtar_open(&tar, path, "r");
+  if (err) {
+    return err;
+  }
+  mtar_set_buffer(&tar, 64 * 1024);
+  err = mtar_index_build(&tar, &own);
+  mtar_close(&tar);
+  if (!err) {
+    err = mtar_catalog_record(path, &own, rec, n);
+    mtar_index_free(&own);
+  }
+  return err;
+}
+
+static int mtar_catalog_check(const unsigned char *data, size_t size,
+                              size_t *count) {
+  size_t i, pos = MTAR_CAT_HEADER, n, len, bits;
+  if (size < MTAR_CAT_HEADER ||
+      memcmp(data, MTAR_CAT_MAGIC, sizeof(MTAR_CAT_MAGIC)) != 0 ||
+      mtar_get_le(data + 8, 4) != MTAR_CAT_VERSION) {
+    return MTAR_EBADINDEX;
+  }
+  /* Every record must fit, and the file must end with the last one */
+  *count = mtar_get_le(data + 16, 8);
+  for (i = 0; i < *count; i++, pos += n) {
+    if (size - pos < MTAR_CAT_RECORD) {
+      return MTAR_EBADINDEX;
+    }
+    n = mtar_get_le(data + pos, 8);
+    len = mtar_get_le(data + pos + 32, 4);
+    bits = mtar_get_le(data + pos + 24, 8);
+    if (n % 8 || n > size - pos || len >= n || bits < 8 ||
+        (bits & (bits - 1)) || n != MTAR_CAT_RECORD +
+        mtar_round_up(len + 1, 8) + bits / 8 ||
+        data[pos + MTAR_CAT_RECORD + len] != '\0') {
+      return MTAR_EBADINDEX;
+    }
+  }
+  return pos == size ? MTAR_ESUCCESS : MTAR_EBADINDEX;
+}
+
+int mtar_catalog_add(mtar_catalog_t *cat, const char *path,
+                     const mtar_index_t *idx) {
+  unsigned char *rec, *data;
+  size_t n, pos, capacity;
+  int err = mtar_catalog_summarize(path, idx, &rec, &n);
+  if (err) {
+    return err;
+  }
+  /* A mapped catalog is copied before it changes */
+  capacity = cat->mapped || !cat->data ? 0 : cat->capacity;
+  if (cat->size + n > capacity || !cat->data) {
+    capacity = capacity ? capacity * 2 : 4096;
+    while (capacity < MTAR_CAT_HEADER + cat->size + n) {
+      capacity *= 2;
+    }
+    data = (unsigned char *)malloc(capacity);
+    if (!data) {
+      free(rec);
+      return MTAR_ENOMEM;
+    }
+    if (cat->data) {
+      memcpy(data, cat->data, cat->size);
+    } else {
+      memset(data, 0, MTAR_CAT_HEADER);
+      memcpy(data, MTAR_CAT_MAGIC, sizeof(MTAR_CAT_MAGIC));
+      mtar_put_le(data + 8, MTAR_CAT_VERSION, 4);
+      cat->size = MTAR_CAT_HEADER;
+    }
+    if (cat->mapped) {
+      mtar_unmap_file(cat->data, cat->size);
+    } else {
+      free(cat->data);
+    }
+    cat->data = data;
+    cat->capacity = capacity;
+    cat->mapped = 0;
+  }
+  /* The newest record of a path is the one used */
+  for (pos = MTAR_CAT_HEADER; pos < cat->size;
+       pos += mtar_get_le(cat->data + pos, 8)) {
+    if (!strcmp((const char *)cat->data + pos + MTAR_CAT_RECORD, path)) {
+      mtar_put_le(cat->data + pos + 38, MTAR_CAT_DEAD, 2);
+    }
+  }
+  memcpy(cat->data + cat->size, rec, n);
+  cat->size += n;
+  cat->count++;
+  mtar_put_le(cat->data + 16, cat->count, 8);
+  free(rec);
+  return MTAR_ESUCCESS;
+}
+
+int mtar_catalog_save(const mtar_catalog_t *cat, const char *filename) {
+  unsigned char header[MTAR_CAT_HEADER];
+  size_t pos, n, count = 0;
+  FILE *fp = fopen(filename, "wb");
+  int err = MTAR_ESUCCESS;
+
+  if (!fp) {
+    return MTAR_EOPENFAIL;
+  }
+  /* Only the records in use */
+  memset(header, 0, sizeof(header));
+  memcpy(header, MTAR_CAT_MAGIC, sizeof(MTAR_CAT_MAGIC));
+  mtar_put_le(header + 8, MTAR_CAT_VERSION, 4);
+  if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+    err = MTAR_EWRITEFAIL;
+  }
+  for (pos = MTAR_CAT_HEADER; !err && pos < cat->size; pos += n) {
+    n = mtar_get_le(cat->data + pos, 8);
+    if (mtar_get_le(cat->data + pos + 38, 2) & MTAR_CAT_DEAD) {
+      continue;
+    }
+    if (fwrite(cat->data + pos, 1, n, fp) != n) {
+      err = MTAR_EWRITEFAIL;
+    }
+    count++;
+  }
+  mtar_put_le(header + 16, count, 8);
+  if (!err && (mtar_fseek(fp, 0) ||
+               fwrite(header, 1, sizeof(header), fp) != sizeof(header))) {
+    err = MTAR_EWRITEFAIL;
+  }
+  if (fclose(fp) != 0 && !err) {
+    err = MTAR_EWRITEFAIL;
+  }
+  return err;
+}
+
+int mtar_catalog_update(const char *filename, const char *path,
+                        const mtar_index_t *idx) {
+  unsigned char header[MTAR_CAT_HEADER], rec[MTAR_CAT_RECORD];
+  unsigned char *p, flags[2];
+  char *name;
+  size_t i, n, count, pos = MTAR_CAT_HEADER, len = strlen(path);
+  FILE *fp;
+  int err = mtar_catalog_summarize(path, idx, &p, &n);
+
+  if (err) {
+    return err;
+  }
+  name = (char *)malloc(len + 1);
+  fp = fopen(filename, "r+b");
+  if (!fp) {
+    fp = fopen(filename, "w+b");
+    memset(header, 0, sizeof(header));
+    memcpy(header, MTAR_CAT_MAGIC, sizeof(MTAR_CAT_MAGIC));
+    mtar_put_le(header + 8, MTAR_CAT_VERSION, 4);
+  } else if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+             memcmp(header, MTAR_CAT_MAGIC, sizeof(MTAR_CAT_MAGIC)) != 0 ||
+             mtar_get_le(header + 8, 4) != MTAR_CAT_VERSION) {
+    err = MTAR_EBADINDEX;
+  }
+  if (!fp || !name) {
+    err = fp ? MTAR_ENOMEM : MTAR_EOPENFAIL;
+  }
+
+  /* Only the fixed part and the path of each record are read, to retire an
+   * older record of the same archive */
+  count = err ? 0 : mtar_get_le(header + 16, 8);
+  for (i = 0; !err && i < count; i++) {
+    if (mtar_fseek(fp, pos) || fread(rec, 1, sizeof(rec), fp) != sizeof(rec)) {
+      err = MTAR_EBADINDEX;
+      break;
+    }
+    if (mtar_get_le(rec + 32, 4) == len &&
+        !(mtar_get_le(rec + 38, 2) & MTAR_CAT_DEAD) &&
+        fread(name, 1, len + 1, fp) == len + 1 && !memcmp(name, path, len + 1)) {
+      mtar_put_le(flags, MTAR_CAT_DEAD, 2);
+      if (mtar_fseek(fp, pos + 38) || fwrite(flags, 1, 2, fp) != 2) {
+        err = MTAR_EWRITEFAIL;
+      }
+    }
+    pos += mtar_get_le(rec, 8);
+  }
+
+  /* Then the new record goes at the end, and the count is bumped */
+  mtar_put_le(header + 16, count + 1, 8);
+  if (!err && (mtar_fseek(fp, pos) || fwrite(p, 1, n, fp) != n ||
+               mtar_fseek(fp, 0) ||
+               fwrite(header, 1, sizeof(header), fp) != sizeof(header))) {
+    err = MTAR_EWRITEFAIL;
+  }
+  if (fp && fclose(fp) != 0 && !err) {
+    err = MTAR_EWRITEFAIL;
+  }
+  free(name);
+  free(p);
+  return err;
+}
+
+int mtar_catalog_load(mtar_catalog_t *cat, const char *filename) {
+  FILE *fp;
+  size_t n;
+  int err;
+
+  mtar_catalog_init(cat);
+  fp = fopen(filename, "rb");
+  if (!fp) {
+    return MTAR_EOPENFAIL;
+  }
+  err = mtar_fsize(fp, &n);
+  if (!err) {
+    err = mtar_fseek(fp, 0);
+  }
+  if (err) {
+    fclose(fp);
+    return err;
+  }
+  cat->data = (unsigned char *)malloc(n ? n : 1);
+  if (!cat->data) {
+    fclose(fp);
+    return MTAR_ENOMEM;
+  }
+  cat->size = cat->capacity = n;
+  if (fread(cat->data, 1, cat->size, fp) != cat->size) {
+    fclose(fp);
+    mtar_catalog_free(cat);
+    return MTAR_EREADFAIL;
+  }
+  fclose(fp);
+  err = mtar_catalog_check(cat->data, cat->size, &cat->count);
+  if (err) {
+    mtar_catalog_free(cat);
+  }
+  return err;
+}
+
+int mtar_catalog_load_mmap(mtar_catalog_t *cat, const char *filename) {
+  void *data;
+  int err;
+
+  mtar_catalog_init(cat);
+  err = mtar_map_file(filename, &data, &cat->size);
+  if (err) {
+    return err;
+  }
+  /* Queries read the records in place */
+  cat->data = (unsigned char *)data;
+  cat->mapped = 1;
+  err = mtar_catalog_check(cat->data, cat->size, &cat->count);
+  if (err) {
+    mtar_catalog_free(cat);
+  }
+  return err;
+}
+
+int mtar_catalog_next(const mtar_catalog_t *cat, const char *name,
+                      size_t *pos, mtar_summary_t *s) {
+  const unsigned char *p;
+  unsigned long h1 = 0, h2 = 0;
+
+  if (name) {
+    mtar_bloom_hash(name, &h1, &h2);
+  }
+  if (*pos < MTAR_CAT_HEADER) {
+    *pos = MTAR_CAT_HEADER;
+  }
+  while (*pos < cat->size) {
+    p = cat->data + *pos;
+    *pos += mtar_get_le(p, 8);
+    if (mtar_get_le(p + 38, 2) & MTAR_CAT_DEAD) {
+      continue;
+    }
+    if (name && !mtar_bloom_test(p + MTAR_CAT_RECORD +
+                                 mtar_round_up(mtar_get_le(p + 32, 4) + 1, 8),
+                                 mtar_get_le(p + 24, 8),
+                                 (unsigned)mtar_get_le(p + 36, 2), h1, h2)) {
+      continue;
+    }
+    s->path = (const char *)p + MTAR_CAT_RECORD;
+    s->members = mtar_get_le(p + 8, 8);
+    s->bytes = mtar_get_le(p + 16, 8);
+    return MTAR_ESUCCESS;
+  }
+  return MTAR_ENOTFOUND;
+}
+
+int mtar_catalog_locate(const mtar_catalog_t *cat, const char *name,
+                        mtar_archive_t *ar, const mtar_entry_t **e) {
+  mtar_summary_t s;
+  struct stat st;
+  size_t pos = 0, len;
+  char *sidecar;
+  int err;
+
+  /* Each archive the filter lets through is confirmed by its own index,
+   * from a sidecar "<path>.idx" when there is one */
+  while (mtar_catalog_next(cat, name, &pos, &s) == MTAR_ESUCCESS) {
+    len = strlen(s.path);
+    sidecar = (char *)malloc(len + 5);
+    if (!sidecar) {
+      return MTAR_ENOMEM;
+    }
+    memcpy(sidecar, s.path, len);
+    memcpy(sidecar + len, ".idx", 5);
+    err = stat(sidecar, &st) == 0 ?
+          mtar_archive_open(ar, s.path, sidecar) : MTAR_EOPENFAIL;
+    if (err) {
+      err = mtar_archive_open(ar, s.path, NULL);
+    }
+    free(sidecar);
+    if (err) {
+      continue;
+    }
+    if (mtar_index_lookup(&ar->index, name, e) == MTAR_ESUCCESS) {
+      return MTAR_ESUCCESS;
+    }
+    mtar_archive_close(ar);
+  }
+  return MTAR_ENOTFOUND;
+}
+
+enum {
+  MTAR_BATCH_SYNC,      /* completed on submission */
+  MTAR_BATCH_URING,
+  MTAR_BATCH_THREADS
+};
+
+#define MTAR_BATCH_MAXTHREADS 16
+
+/* Largest single read handed to the kernel; longer members take several */
+#define MTAR_BATCH_CHUNK ((size_t)1 << 30)
+
+#ifdef MTAR_URING
+typedef struct {
+  mtar_request_t *req;  /* NULL if the slot is free */
+  size_t done;
+  struct iovec iov;
+} mtar_slot_t;
+#endif
+
+struct mtar_batch_t {
+  const mtar_archive_t *ar;
+  int mode;             /* MTAR_BATCH_... */
+  mtar_request_t **pending;
+  size_t pending_head, pending_count, pending_capacity;
+  mtar_request_t **done;
+  size_t done_count, done_capacity;
+  size_t outstanding;   /* submitted but not yet returned by poll */
+#ifdef MTAR_URING
+  int ring;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  mtar_slot_t *slots;
+  unsigned slot_count, inflight, to_submit;
+#endif
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+  pthread_cond_t work, finished;
+  pthread_t threads[MTAR_BATCH_MAXTHREADS];
+  int thread_count, quit;
+#endif
+};
+
+static int mtar_push(mtar_request_t ***list, size_t *count,
+                     size_t *capacity, mtar_request_t *req) {
+  if (*count == *capacity) {
+    size_t n = *capacity ? *capacity * 2 : 64;
+    mtar_request_t **p = (mtar_request_t **)realloc(*list, n * sizeof(*p));
+    if (!p) {
+      return MTAR_ENOMEM;
+    }
+    *list = p;
+    *capacity = n;
+  }
+  (*list)[(*count)++] = req;
+  return MTAR_ESUCCESS;
+}
+
+/* Room in the done list for `n` requests. Every outstanding request has a
+ * place reserved there, so completing one never fails */
+static int mtar_reserve_done(mtar_batch_t *b, size_t n) {
+  size_t capacity = b->done_capacity ? b->done_capacity : 64;
+  mtar_request_t **p;
+  if (n <= b->done_capacity) {
+    return MTAR_ESUCCESS;
+  }
+  while (capacity < n) {
+    capacity *= 2;
+  }
+  p = (mtar_request_t **)realloc(b->done, capacity * sizeof(*p));
+  if (!p) {
+    return MTAR_ENOMEM;
+  }
+  b->done = p;
+  b->done_capacity = capacity;
+  return MTAR_ESUCCESS;
+}
+
+#if defined(MTAR_URING) || defined(HAVE_PTHREAD)
+static mtar_request_t *mtar_pop_pending(mtar_batch_t *b) {
+  mtar_request_t *req;
+  if (b->pending_head == b->pending_count) {
+    return NULL;
+  }
+  req = b->pending[b->pending_head++];
+  /* Reuse the array once it has been drained */
+  if (b->pending_head == b->pending_count) {
+    b->pending_head = b->pending_count = 0;
+  }
+  return req;
+}
+#endif
+
+static void mtar_read_request(const mtar_archive_t *ar, mtar_request_t *req) {
+  req->err = mtar_archive_read_at(ar, req->entry, 0, req->data,
+                                  req->entry->size);
+}
+
+#ifdef MTAR_URING
+static int mtar_uring_open(mtar_batch_t *b, unsigned depth) {
+  struct io_uring_params p;
+  long fd;
+  char *sq;
+
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, depth, &p);
+  if (fd < 0) {
+    return MTAR_EUNSUPPORTED;
+  }
+  b->ring = (int)fd;
+  b->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  b->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (b->cq_ring_size > b->sq_ring_size) {
+      b->sq_ring_size = b->cq_ring_size;
+    }
+    b->cq_ring_size = 0;
+  }
+  b->sq_ring = mmap(NULL, b->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, b->ring, IORING_OFF_SQ_RING);
+  if (b->sq_ring == MAP_FAILED) {
+    b->sq_ring = NULL;
+    return MTAR_EUNSUPPORTED;
+  }
+  b->cq_ring = b->sq_ring;
+  if (b->cq_ring_size) {
+    b->cq_ring = mmap(NULL, b->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, b->ring, IORING_OFF_CQ_RING);
+    if (b->cq_ring == MAP_FAILED) {
+      b->cq_ring = NULL;
+      return MTAR_EUNSUPPORTED;
+    }
+  }
+  b->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  b->sqes = (struct io_uring_sqe *)mmap(NULL, b->sqes_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, b->ring,
+                                        IORING_OFF_SQES);
+  if (b->sqes == MAP_FAILED) {
+    b->sqes = NULL;
+    return MTAR_EUNSUPPORTED;
+  }
+
+  sq = (char *)b->sq_ring;
+  b->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  b->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  b->sq_array = (unsigned *)(sq + p.sq_off.array);
+  b->cq_head = (unsigned *)((char *)b->cq_ring + p.cq_off.head);
+  b->cq_tail = (unsigned *)((char *)b->cq_ring + p.cq_off.tail);
+  b->cq_mask = (unsigned *)((char *)b->cq_ring + p.cq_off.ring_mask);
+  b->cqes = (struct io_uring_cqe *)((char *)b->cq_ring + p.cq_off.cqes);
+
+  /* One read in flight per submission queue entry */
+  b->slot_count = p.sq_entries;
+  b->slots = (mtar_slot_t *)calloc(b->slot_count, sizeof(mtar_slot_t));
+  return b->slots ? MTAR_ESUCCESS : MTAR_ENOMEM;
+}
+
+static void mtar_uring_close(mtar_batch_t *b) {
+  if (b->sqes) {
+    munmap(b->sqes, b->sqes_size);
+  }
+  if (b->cq_ring && b->cq_ring != b->sq_ring) {
+    munmap(b->cq_ring, b->cq_ring_size);
+  }
+  if (b->sq_ring) {
+    munmap(b->sq_ring, b->sq_ring_size);
+  }
+  if (b->ring >= 0) {
+    close(b->ring);
+  }
+  free(b->slots);
+}
+
+static void mtar_uring_queue(mtar_batch_t *b, unsigned slot) {
+  mtar_slot_t *s = &b->slots[slot];
+  const mtar_entry_t *e = s->req->entry;
+  unsigned tail = *b->sq_tail, idx = tail & *b->sq_mask;
+  struct io_uring_sqe *sqe = &b->sqes[idx];
+  size_t n = e->size - s->done;
+
+  /* READV rather than READ works back to the first io_uring kernels */
+  s->iov.iov_base = (char *)s->req->data + s->done;
+  s->iov.iov_len = n < MTAR_BATCH_CHUNK ? n : MTAR_BATCH_CHUNK;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = b->ar->fd;
+  sqe->addr = (unsigned long)&s->iov;
+  sqe->len = 1;
+  sqe->off = e->data_offset + s->done;
+  sqe->user_data = slot;
+  b->sq_array[idx] = idx;
+  __atomic_store_n(b->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  b->to_submit++;
+}
+
+static void mtar_uring_fill(mtar_batch_t *b) {
+  unsigned i;
+  mtar_request_t *req;
+  /* Move pending requests into free slots */
+  for (i = 0; i < b->slot_count && b->inflight < b->slot_count; i++) {
+    if (b->slots[i].req) {
+      continue;
+    }
+    req = mtar_pop_pending(b);
+    if (!req) {
+      break;
+    }
+    b->slots[i].req = req;
+    b->slots[i].done = 0;
+    b->inflight++;
+    mtar_uring_queue(b, i);
+  }
+}
+
+static int mtar_uring_poll(mtar_batch_t *b, int wait) {
+  unsigned head, tail;
+  long rc;
+
+  mtar_uring_fill(b);
+  if (!b->to_submit && !b->inflight) {
+    return MTAR_ESUCCESS;
+  }
+  do {
+    rc = syscall(__NR_io_uring_enter, b->ring, b->to_submit,
+                 (wait && b->inflight) ? 1 : 0,
+                 (wait && b->inflight) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rc < 0 && errno == EINTR);
+  if (rc < 0) {
+    return MTAR_EREADFAIL;
+  }
+  b->to_submit -= (unsigned)rc;
+
+  /* Reap completions; short reads are resubmitted for the rest */
+  head = *b->cq_head;
+  tail = __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &b->cqes[head & *b->cq_mask];
+    mtar_slot_t *s = &b->slots[cqe->user_data];
+    int res = cqe->res;
+    head++;
+    if (res > 0) {
+      s->done += (size_t)res;
+      if (s->done < s->req->entry->size) {
+        mtar_uring_queue(b, (unsigned)cqe->user_data);
+        continue;
+      }
+    }
+    s->req->err = (res > 0 || !s->req->entry->size) ? MTAR_ESUCCESS
+                                                    : MTAR_EREADFAIL;
+    b->done[b->done_count++] = s->req;
+    s->req = NULL;
+    b->inflight--;
+  }
+  __atomic_store_n(b->cq_head, head, __ATOMIC_RELEASE);
+  mtar_uring_fill(b);
+  return MTAR_ESUCCESS;
+}
+#endif
+
+#ifdef HAVE_PTHREAD
+static void *mtar_batch_worker(void *arg) {
+  mtar_batch_t *b = (mtar_batch_t *)arg;
+  mtar_request_t *req;
+  pthread_mutex_lock(&b->lock);
+  for (;;) {
+    while (!b->quit && b->pending_head == b->pending_count) {
+      pthread_cond_wait(&b->work, &b->lock);
+    }
+    if (b->quit) {
+      break;
+    }
+    req = mtar_pop_pending(b);
+    pthread_mutex_unlock(&b->lock);
+    mtar_read_request(b->ar, req);
+    pthread_mutex_lock(&b->lock);
+    b->done[b->done_count++] = req;
+    pthread_cond_signal(&b->finished);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+#endif
+
+int mtar_batch_open(mtar_batch_t **batch, const mtar_archive_t *ar,
+                    unsigned depth, unsigned flags) {
+  mtar_batch_t *b = (mtar_batch_t *)calloc(1, sizeof(mtar_batch_t));
+  *batch = b;
+  if (!b) {
+    return MTAR_ENOMEM;
+  }
+  b->ar = ar;
+  b->mode = MTAR_BATCH_SYNC;
+  if (!depth) {
+    depth = 64;
+  }
+#ifdef MTAR_URING
+  b->ring = -1;
+  /* Mapped archives are copied directly; there is nothing to wait for */
+  if (!ar->data && !(flags & MTAR_BATCH_NOURING)) {
+    if (mtar_uring_open(b, depth) == MTAR_ESUCCESS) {
+      b->mode = MTAR_BATCH_URING;
+      return MTAR_ESUCCESS;
+    }
+    mtar_uring_close(b);
+    b->ring = -1;
+    b->sq_ring = b->cq_ring = NULL;
+    b->sqes = NULL;
+    b->slots = NULL;
+  }
+#else
+  (void)flags;
+#endif
+#ifdef HAVE_PTHREAD
+  /* Otherwise a few threads keep reads in flight */
+  if (!ar->data) {
+    int i, n = (int)(depth < MTAR_BATCH_MAXTHREADS ? depth
+                                                   : MTAR_BATCH_MAXTHREADS);
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->work, NULL);
+    pthread_cond_init(&b->finished, NULL);
+    b->mode = MTAR_BATCH_THREADS;
+    for (i = 0; i < n; i++) {
+      if (pthread_create(&b->threads[b->thread_count], NULL,
+                         mtar_batch_worker, b) == 0) {
+        b->thread_count++;
+      }
+    }
+    if (!b->thread_count) {
+      mtar_batch_close(b);
+      *batch = NULL;
+      return MTAR_EFAILURE;
+    }
+  }
+#endif
+  return MTAR_ESUCCESS;
+}
+
+void mtar_batch_close(mtar_batch_t *b) {
+  int i;
+  if (!b) {
+    return;
+  }
+#ifdef MTAR_URING
+  if (b->mode == MTAR_BATCH_URING) {
+    /* The kernel may still write into the buffers of requests in flight */
+    while (b->inflight && mtar_uring_poll(b, 1) == MTAR_ESUCCESS) {}
+    mtar_uring_close(b);
+  }
+#endif
+#ifdef HAVE_PTHREAD
+  if (b->mode == MTAR_BATCH_THREADS) {
+    pthread_mutex_lock(&b->lock);
+    b->quit = 1;
+    pthread_cond_broadcast(&b->work);
+    pthread_mutex_unlock(&b->lock);
+    for (i = 0; i < b->thread_count; i++) {
+      pthread_join(b->threads[i], NULL);
+    }
+    pthread_cond_destroy(&b->work);
+    pthread_cond_destroy(&b->finished);
+    pthread_mutex_destroy(&b->lock);
+  }
+#endif
+  (void)i;
+  free(b->pending);
+  free(b->done);
+  free(b);
+}
+
+const char *mtar_batch_backend(const mtar_batch_t *b) {
+  switch (b->mode) {
+    case MTAR_BATCH_URING   : return "io_uring";
+    case MTAR_BATCH_THREADS : return "threads";
+  }
+  return "sync";
+}
+
+int mtar_batch_submit(mtar_batch_t *b, mtar_request_t *reqs, size_t count) {
+  size_t i;
+  int err = MTAR_ESUCCESS;
+
+#ifdef HAVE_PTHREAD
+  if (b->mode == MTAR_BATCH_THREADS) {
+    pthread_mutex_lock(&b->lock);
+  }
+#endif
+  for (i = 0; i < count && !err; i++) {
+    mtar_request_t *req = &reqs[i];
+    int queued = 0;
+    req->err = MTAR_ESUCCESS;
+    if (!req->entry) {
+      req->err = mtar_index_lookup(&b->ar->index, req->name, &req->entry);
+    }
+    if (!req->err && !req->data) {
+      req->data = malloc(req->entry->size ? req->entry->size : 1);
+      if (!req->data) {
+        req->err = MTAR_ENOMEM;
+      }
+    }
+    err = mtar_reserve_done(b, b->outstanding + 1);
+    /* Failed lookups complete at once, as do reads from a mapping */
+    if (!err && !req->err && b->mode != MTAR_BATCH_SYNC) {
+      err = mtar_push(&b->pending, &b->pending_count, &b->pending_capacity,
+                      req);
+      queued = !err;
+    } else if (!err && !req->err) {
+      mtar_read_request(b->ar, req);
+    }
+    if (!queued && !err) {
+      b->done[b->done_count++] = req;
+    }
+    if (!err) {
+      b->outstanding++;
+    }
+  }
+#ifdef HAVE_PTHREAD
+  if (b->mode == MTAR_BATCH_THREADS) {
+    pthread_cond_broadcast(&b->work);
+    pthread_mutex_unlock(&b->lock);
+  }
+#endif
+#ifdef MTAR_URING
+  if (!err && b->mode == MTAR_BATCH_URING) {
+    err = mtar_uring_poll(b, 0);
+  }
+#endif
+  return err;
+}
+
+int mtar_batch_poll(mtar_batch_t *b, int wait) {
+  mtar_request_t **done;
+  size_t i, n, remaining;
+  int err = MTAR_ESUCCESS;
+
+  (void)wait;
+  if (!b->outstanding) {
+    return 0;
+  }
+#ifdef MTAR_URING
+  if (b->mode == MTAR_BATCH_URING) {
+    err = mtar_uring_poll(b, wait && !b->done_count);
+  }
+#endif
+#ifdef HAVE_PTHREAD
+  if (b->mode == MTAR_BATCH_THREADS) {
+    pthread_mutex_lock(&b->lock);
+    while (wait && !b->done_count && b->outstanding) {
+      pthread_cond_wait(&b->finished, &b->lock);
+    }
+  }
+#endif
+  /* Callbacks run without the lock, so they may submit more requests. The
+   * list goes to them; a new one keeps room for the rest */
+  done = b->done;
+  n = b->done_count;
+  remaining = b->outstanding - n;
+  if (n) {
+    b->done = remaining ? (mtar_request_t **)malloc(remaining * sizeof(*done))
+                        : NULL;
+    if (remaining && !b->done) {
+      b->done = done;
+      n = 0;
+      err = MTAR_ENOMEM;
+    } else {
+      b->done_count = 0;
+      b->done_capacity = remaining;
+      b->outstanding = remaining;
+    }
+  }
+#ifdef HAVE_PTHREAD
+  if (b->mode == MTAR_BATCH_THREADS) {
+    pthread_mutex_unlock(&b->lock);
+  }
+#endif
+  for (i = 0; i < n; i++) {
+    if (done[i]->done) {
+      done[i]->done(done[i]);
+    }
+  }
+  if (n) {
+    free(done);
+  }
+  return err ? err : (int)n;
+}
+
+int mtar_batch_wait(mtar_batch_t *b) {
+  int n;
+  while (b->outstanding) {
+    n = mtar_batch_poll(b, 1);
+    if (n < 0) {
+      return n;
+    }
+  }
+  return MTAR_ESUCCESS;
+}
+
+#ifdef MTAR_PARALLEL
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SPLICE) || \
+    defined(HAVE_SENDFILE)
+/* Errors after which the next way of copying is tried; nothing has been
+ * transferred by the failed call */
+static int mtar_copy_retry(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF ||
+         err == ESPIPE || err == EOPNOTSUPP;
+}
+#endif
+
+static void mtar_copy_advance(off_t *in_off, off_t *out_off, size_t *size,
+                              size_t n) {
+  if (in_off) {
+    *in_off += (off_t)n;
+  }
+  if (out_off) {
+    *out_off += (off_t)n;
+  }
+  *size -= n;
+}
+
+static int mtar_write_fd(int fd, off_t *offset, const void *data,
+                         size_t size) {
+  const char *p = (const char *)data;
+  ssize_t n;
+  while (size) {
+    n = offset ? pwrite(fd, p, size, *offset) : write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return MTAR_EWRITEFAIL;
+    }
+    if (offset) {
+      *offset += n;
+    }
+    p += n;
+    size -= (size_t)n;
+  }
+  return MTAR_ESUCCESS;
+}
+
+/* Copies size bytes between file descriptors, in the kernel where possible.
+ * A NULL offset means the descriptor's own position is used and advanced;
+ * otherwise the offset is used and advanced instead. buf is used if the data
+ * has to pass through user space, and allocated if NULL */
+static int mtar_copy_fd(int in, off_t *in_off, int out, off_t *out_off,
+                        size_t size, char *buf, size_t buf_size) {
+  char *p = buf;
+  ssize_t n;
+  int err = MTAR_ESUCCESS;
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SPLICE)
+  loff_t in_pos, out_pos;
+#endif
+#ifdef HAVE_SPLICE
+  struct stat in_st, out_st;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  /* Between files; some filesystems share the blocks instead of copying */
+  while (size) {
+    in_pos = in_off ? *in_off : 0;
+    out_pos = out_off ? *out_off : 0;
+    n = copy_file_range(in, in_off ? &in_pos : NULL,
+                        out, out_off ? &out_pos : NULL, size, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && !mtar_copy_retry(errno)) {
+      return MTAR_EWRITEFAIL;
+    }
+    if (n <= 0) {
+      break;
+    }
+    mtar_copy_advance(in_off, out_off, &size, (size_t)n);
+  }
+#endif
+#ifdef HAVE_SPLICE
+  /* From or to a pipe */
+  if (size && fstat(in, &in_st) == 0 && fstat(out, &out_st) == 0 &&
+      (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))) {
+    while (size) {
+      in_pos = in_off ? *in_off : 0;
+      out_pos = out_off ? *out_off : 0;
+      n = splice(in, in_off ? &in_pos : NULL,
+                 out, out_off ? &out_pos : NULL, size, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && !mtar_copy_retry(errno)) {
+        return MTAR_EWRITEFAIL;
+      }
+      if (n <= 0) {
+        break;
+      }
+      mtar_copy_advance(in_off, out_off, &size, (size_t)n);
+    }
+  }
+#endif
+#ifdef HAVE_SENDFILE
+  /* From a file to anything written in order, such as a socket */
+  while (size && !out_off) {
+    n = sendfile(out, in, in_off, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && !mtar_copy_retry(errno)) {
+      return MTAR_EWRITEFAIL;
+    }
+    if (n <= 0) {
+      break;
+    }
+    /* sendfile() has already advanced in_off */
+    mtar_copy_advance(NULL, NULL, &size, (size_t)n);
+  }
+#endif
+
+  /* Through user space */
+  if (size && !p) {
+    buf_size = 64 * 1024;
+    p = (char *)malloc(buf_size);
+    if (!p) {
+      return MTAR_ENOMEM;
+    }
+  }
+  while (size && !err) {
+    size_t k = size < buf_size ? size : buf_size;
+    n = in_off ? pread(in, p, k, *in_off) : read(in, p, k);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      err = MTAR_EREADFAIL;
+      break;
+    }
+    err = mtar_write_fd(out, out_off, p, (size_t)n);
+    mtar_copy_advance(in_off, NULL, &size, (size_t)n);
+  }
+  if (p != buf) {
+    free(p);
+  }
+  return err;
+}
+
+#define MTAR_MAXTHREADS 64
+
+static int mtar_thread_count(int nthreads) {
+  /* Zero or less means one thread per online processor */
+#ifdef _SC_NPROCESSORS_ONLN
+  if (nthreads <= 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (n > 0) ? (int)n : 1;
+  }
+#endif
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  return nthreads < MTAR_MAXTHREADS ? nthreads : MTAR_MAXTHREADS;
+}
+
+static void mtar_run_workers(int nthreads, void *(*fn)(void *), void *arg) {
+#ifdef HAVE_PTHREAD
+  pthread_t threads[MTAR_MAXTHREADS];
+  int i, n = 0;
+  /* The calling thread is one of the workers; if a thread cannot be started
+   * the others simply take on more of the work */
+  for (i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[n], NULL, fn, arg) == 0) {
+      n++;
+    }
+  }
+  fn(arg);
+  for (i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+  }
+#else
+  (void)nthreads;
+  fn(arg);
+#endif
+}
+
+/* Jobs handed out to workers one at a time, in order */
+typedef struct {
+  size_t next;
+  size_t count;
+  int err;              /* first error of any worker */
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+} mtar_queue_t;
+
+static void mtar_queue_init(mtar_queue_t *q, size_t count) {
+  q->next = 0;
+  q->count = count;
+  q->err = MTAR_ESUCCESS;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&q->lock, NULL);
+#endif
+}
+
+static void mtar_queue_free(mtar_queue_t *q) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_destroy(&q->lock);
+#else
+  (void)q;
+#endif
+}
+
+static int mtar_queue_claim(mtar_queue_t *q, size_t *i) {
+  int ok;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&q->lock);
+#endif
+  /* Stop handing out jobs after the first error */
+  ok = !q->err && q->next < q->count;
+  if (ok) {
+    *i = q->next++;
+  }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&q->lock);
+#endif
+  return ok;
+}
+
+static void mtar_queue_fail(mtar_queue_t *q, int err) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&q->lock);
+#endif
+  if (!q->err) {
+    q->err = err;
+  }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&q->lock);
+#endif
+}
+
+typedef struct {
+  size_t name;          /* offset into mtar_extract_t.names */
+  size_t linkname;
+  size_t data_offset;
+  size_t size;
+  unsigned mode;
+  unsigned mtime;
+  unsigned mtime_nsec;
+  unsigned type;        /* MTAR_T..., 0 if the member is skipped */
+} mtar_job_t;
+
+typedef struct {
+  mtar_job_t *jobs;
+  size_t count, capacity;
+  char *names;
+  size_t names_size, names_capacity;
+  int fd;               /* archive */
+  int dir;              /* destination directory */
+  unsigned flags;       /* MTAR_EXTRACT_... */
+  mtar_queue_t queue;
+} mtar_extract_t;
+
+static int mtar_safe_path(char *name) {
+  char *p, *q;
+  size_t n;
+  /* Strip leading "./" and trailing slashes; an empty result is the
+   * destination directory itself */
+  while (name[0] == '.' && name[1] == '/') {
+    memmove(name, name + 2, strlen(name + 2) + 1);
+    while (name[0] == '/') {
+      memmove(name, name + 1, strlen(name));
+    }
+  }
+  n = strlen(name);
+  while (n && name[n - 1] == '/') {
+    name[--n] = '\0';
+  }
+  if (!strcmp(name, ".")) {
+    name[0] = '\0';
+  }
+  /* Absolute paths and ".." components could leave the destination */
+  if (name[0] == '/') {
+    return MTAR_EBADPATH;
+  }
+  for (p = name; *p; p = q + (*q == '/')) {
+    q = strchr(p, '/');
+    if (!q) {
+      q = p + strlen(p);
+    }
+    if (q - p == 2 && p[0] == '.' && p[1] == '.') {
+      return MTAR_EBADPATH;
+    }
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_extract_name(mtar_extract_t *ex, const char *name,
+                             size_t *offset) {
+  size_t len = strlen(name) + 1;
+  if (ex->names_size + len > ex->names_capacity) {
+    size_t capacity = ex->names_capacity ? ex->names_capacity * 2 : 4096;
+    char *names;
+    while (capacity < ex->names_size + len) {
+      capacity *= 2;
+    }
+    names = (char *)realloc(ex->names, capacity);
+    if (!names) {
+      return MTAR_ENOMEM;
+    }
+    ex->names = names;
+    ex->names_capacity = capacity;
+  }
+  memcpy(&ex->names[ex->names_size], name, len);
+  *offset = ex->names_size;
+  ex->names_size += len;
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_extract_plan(mtar_extract_t *ex, const char *path) {
+  char name[MTAR_PATHMAX + 1], linkname[MTAR_PATHMAX + 1];
+  mtar_t tar;
+  mtar_header_t h;
+  mtar_job_t *job;
+  int err;
+
+  err = mtar_open(&tar, path, "r");
+  if (err) {
+    return err;
+  }
+  mtar_set_buffer(&tar, 64 * 1024);
+
+  /* One pass over the headers; data is left for the workers */
+  while ((err = mtar_load_header(&tar, &h)) == MTAR_ESUCCESS) {
+    strcpy(name, mtar_header_name(&h));
+    strcpy(linkname, mtar_header_linkname(&h));
+    err = mtar_safe_path(name);
+    if (!err && h.type == MTAR_TLNK) {
+      err = mtar_safe_path(linkname);
+    }
+    /* Device nodes are not created, but never dropped without notice */
+    if (!err && (h.type == MTAR_TCHR || h.type == MTAR_TBLK) &&
+        !(ex->flags & MTAR_EXTRACT_SKIPDEV)) {
+      err = MTAR_EUNSUPPORTED;
+    }
+    if (err) {
+      break;
+    }
+    if (ex->count == ex->capacity) {
+      size_t capacity = ex->capacity ? ex->capacity * 2 : 64;
+      job = (mtar_job_t *)realloc(ex->jobs, capacity * sizeof(*job));
+      if (!job) {
+        err = MTAR_ENOMEM;
+        break;
+      }
+      ex->jobs = job;
+      ex->capacity = capacity;
+    }
+    job = &ex->jobs[ex->count];
+    if ((err = mtar_extract_name(ex, name, &job->name)) ||
+        (err = mtar_extract_name(ex, linkname, &job->linkname))) {
+      break;
+    }
+    job->data_offset = tar.pos;
+    job->size = h.size;
+    job->mode = h.mode & ((ex->flags & MTAR_EXTRACT_PERMS) ? 07777 : 0777);
+    job->mtime = h.mtime;
+    job->mtime_nsec = h.mtime_nsec;
+    job->type = name[0] ? (h.type ? h.type : MTAR_TREG) : 0;
+    ex->count++;
+    err = mtar_seek(&tar, tar.pos + mtar_round_up(h.size, 512));
+    if (err) {
+      break;
+    }
+  }
+  mtar_close(&tar);
+  return err == MTAR_ENULLRECORD ? MTAR_ESUCCESS : err;
+}
+
+static int mtar_extract_dedup(mtar_extract_t *ex) {
+  mtar_index_t seen;
+  const mtar_entry_t *e;
+  mtar_header_t h;
+  size_t i;
+  int err = MTAR_ESUCCESS;
+
+  /* Later members replace earlier ones of the same name; keep only the last
+   * so that no two workers write the same file */
+  mtar_index_init(&seen);
+  memset(&h, 0, sizeof(h));
+  for (i = ex->count; i-- > 0 && !err; ) {
+    mtar_job_t *job = &ex->jobs[i];
+    if (!job->type) {
+      continue;
+    }
+    if (!mtar_index_lookup(&seen, &ex->names[job->name], &e)) {
+      job->type = 0;
+      continue;
+    }
+    h.longname = &ex->names[job->name];
+    err = mtar_index_add(&seen, &h, 0, 0);
+  }
+  mtar_index_free(&seen);
+  return err;
+}
+
+static int mtar_beneath_error(int error) {
+  /* A symlink on the way, or a path resolving outside the destination */
+  return (error == ELOOP || error == EMLINK || error == EXDEV) ?
+         MTAR_EBADPATH : MTAR_EOPENFAIL;
+}
+
+/* Opens the first `len` bytes of `name` as a directory below `dir` without
+ * following any symlink, and creates missing components with `mode` unless
+ * it is zero */
+static int mtar_open_beneath(int dir, char *name, size_t len, mode_t mode,
+                             int *fd) {
+  char *p, *q, *end = name + len, c = *end;
+  struct stat st;
+  int next, cur = dir;
+#ifdef MTAR_OPENAT2
+  struct open_how how;
+#endif
+
+  *fd = -1;
+  if (!len) {
+    *fd = dup(dir);
+    return *fd < 0 ? MTAR_EOPENFAIL : MTAR_ESUCCESS;
+  }
+#ifdef MTAR_OPENAT2
+  /* One call when nothing is created; older kernels take the walk below */
+  if (!mode) {
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_DIRECTORY;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    *end = '\0';
+    next = (int)syscall(__NR_openat2, dir, name, &how, sizeof(how));
+    *end = c;
+    if (next >= 0) {
+      *fd = next;
+      return MTAR_ESUCCESS;
+    }
+    if (errno != ENOSYS && errno != EPERM) {
+      return mtar_beneath_error(errno);
+    }
+  }
+#endif
+  /* One component at a time, each opened relative to the last */
+  for (p = name; p < end; p = q + 1) {
+    q = (char *)memchr(p, '/', (size_t)(end - p));
+    if (!q) {
+      q = end;
+    }
+    if (q == p || (q - p == 1 && *p == '.')) {
+      continue;
+    }
+    *q = '\0';
+    if (mode && mkdirat(cur, p, mode) != 0 && errno != EEXIST) {
+      next = -1;
+    } else {
+      next = openat(cur, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    /* Linux reports a symlink opened this way as ENOTDIR */
+    if (next < 0 && errno == ENOTDIR &&
+        fstatat(cur, p, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISLNK(st.st_mode)) {
+      errno = ELOOP;
+    }
+    *q = q == end ? c : '/';
+    if (next < 0) {
+      next = errno;
+      if (cur != dir) {
+        close(cur);
+      }
+      return mtar_beneath_error(next);
+    }
+    if (cur != dir) {
+      close(cur);
+    }
+    cur = next;
+  }
+  if (cur == dir) {
+    cur = dup(dir);
+  }
+  *fd = cur;
+  return cur < 0 ? MTAR_EOPENFAIL : MTAR_ESUCCESS;
+}
+
+/* The directory holding `name`, and its last component */
+static int mtar_open_parent(const mtar_extract_t *ex, char *name, int *fd,
+                            const char **base) {
+  char *slash = strrchr(name, '/');
+  *base = slash ? slash + 1 : name;
+  return mtar_open_beneath(ex->dir, name,
+                           slash ? (size_t)(slash - name) : 0, 0, fd);
+}
+
+static void mtar_job_times(const mtar_job_t *job, struct timespec *times) {
+  times[0].tv_sec = times[1].tv_sec = (time_t)job->mtime;
+  times[0].tv_nsec = times[1].tv_nsec = (long)job->mtime_nsec;
+}
+
+static int mtar_extract_dirs(mtar_extract_t *ex) {
+  const char *prev = NULL;
+  size_t i, n, prev_n = 0;
+  int fd, err;
+
+  for (i = 0; i < ex->count; i++) {
+    mtar_job_t *job = &ex->jobs[i];
+    char *name = &ex->names[job->name];
+    if (!job->type) {
+      continue;
+    }
+    /* Archives list siblings together; skip parents just created */
+    n = strrchr(name, '/') ? (size_t)(strrchr(name, '/') - name) : 0;
+    if (n && !(prev && n == prev_n && !memcmp(name, prev, n))) {
+      err = mtar_open_beneath(ex->dir, name, n, 0777, &fd);
+      if (err) {
+        return err;
+      }
+      close(fd);
+      prev = name;
+      prev_n = n;
+    }
+    /* Directories stay writable until everything is extracted */
+    if (job->type == MTAR_TDIR) {
+      err = mtar_open_beneath(ex->dir, name, strlen(name), 0700, &fd);
+      if (err) {
+        return err;
+      }
+      close(fd);
+    }
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int mtar_extract_file(mtar_extract_t *ex, const mtar_job_t *job,
+                             char *buf, size_t buf_size) {
+  const char *base;
+  struct timespec times[2];
+  off_t offset = (off_t)job->data_offset;
+  int dir, fd, err;
+
+  /* Never follow a symlink at the destination, replace it instead */
+  err = mtar_open_parent(ex, &ex->names[job->name], &dir, &base);
+  if (err) {
+    return err;
+  }
+  fd = openat(dir, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd < 0 && errno == EEXIST && unlinkat(dir, base, 0) == 0) {
+    fd = openat(dir, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  }
+  close(dir);
+  if (fd < 0) {
+    return MTAR_EOPENFAIL;
+  }
+  err = mtar_copy_fd(ex->fd, &offset, fd, NULL, job->size, buf, buf_size);
+  if (!err) {
+    mtar_job_times(job, times);
+    fchmod(fd, (mode_t)job->mode);
+    futimens(fd, times);
+  }
+  if (close(fd) != 0 && !err) {
+    err = MTAR_EWRITEFAIL;
+  }
+  return err;
+}
+
+static void *mtar_extract_worker(void *arg) {
+  mtar_extract_t *ex = (mtar_extract_t *)arg;
+  size_t i, buf_size = 256 * 1024;
+  char *buf = (char *)malloc(buf_size);
+  int err;
+
+  if (!buf) {
+    mtar_queue_fail(&ex->queue, MTAR_ENOMEM);
+    return NULL;
+  }
+  while (mtar_queue_claim(&ex->queue, &i)) {
+    if (ex->jobs[i].type != MTAR_TREG) {
+      continue;
+    }
+    err = mtar_extract_file(ex, &ex->jobs[i], buf, buf_size);
+    if (err) {
+      mtar_queue_fail(&ex->queue, err);
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+static int mtar_extract_link(mtar_extract_t *ex, const mtar_job_t *job) {
+  const char *base, *link_base;
+  struct timespec times[2];
+  int dir, link_dir, rc, err;
+
+  err = mtar_open_parent(ex, &ex->names[job->name], &dir, &base);
+  if (err) {
+    return err;
+  }
+  unlinkat(dir, base, 0);
+  if (job->type == MTAR_TSYM) {
+    rc = symlinkat(&ex->names[job->linkname], dir, base);
+  } else if (job->type == MTAR_TLNK) {
+    /* The target is resolved inside the destination too */
+    err = mtar_open_parent(ex, &ex->names[job->linkname], &link_dir,
+                           &link_base);
+    rc = err ? 0 : linkat(link_dir, link_base, dir, base, 0);
+    if (!err) {
+      close(link_dir);
+    }
+  } else {
+    rc = mkfifoat(dir, base, (mode_t)job->mode);
+  }
+  if (!err && rc != 0) {
+    err = MTAR_EOPENFAIL;
+  }
+  if (!err && job->type != MTAR_TLNK) {
+    mtar_job_times(job, times);
+    utimensat(dir, base, times, AT_SYMLINK_NOFOLLOW);
+  }
+  close(dir);
+  return err;
 }
 
-int mtar_next(mtar_t *tar) {
-  int err;
-  size_t n;
-  mtar_header_t h;
-  /* Load header */
-  err = mtar_read_header(tar, &h);
-  if (err) {
-    return err;
+static int mtar_extract_links(mtar_extract_t *ex) {
+  struct timespec times[2];
+  size_t i;
+  int fd, err;
+
+  /* Links come after all files, so that no member is written through a
+   * symlink from the archive and hard link targets exist */
+  for (i = 0; i < ex->count; i++) {
+    const mtar_job_t *job = &ex->jobs[i];
+    if (job->type != MTAR_TSYM && job->type != MTAR_TLNK &&
+        job->type != MTAR_TFIFO) {
+      continue;
+    }
+    err = mtar_extract_link(ex, job);
+    if (err) {
+      return err;
+    }
+  }
+
+  /* Directory modes and times last, deepest first */
+  for (i = ex->count; i-- > 0; ) {
+    const mtar_job_t *job = &ex->jobs[i];
+    char *name = &ex->names[job->name];
+    if (job->type != MTAR_TDIR) {
+      continue;
+    }
+    err = mtar_open_beneath(ex->dir, name, strlen(name), 0, &fd);
+    if (err) {
+      return err;
+    }
+    mtar_job_times(job, times);
+    fchmod(fd, (mode_t)job->mode);
+    futimens(fd, times);
+    close(fd);
   }
-  /* Seek to next record */
-  n = mtar_round_up(h.size, 512) + sizeof(mtar_raw_header_t);
-  return mtar_seek(tar, tar->pos + n);
+  return MTAR_ESUCCESS;
 }
 
-int mtar_find(mtar_t *tar, const char *name, mtar_header_t *h) {
+int mtar_extract_parallel(const char *path, const char *dest_dir,
+                          int nthreads, unsigned flags) {
+  mtar_extract_t ex;
   int err;
-  mtar_header_t header;
 
-  if (strlen(name) > MTAR_NAMEMAX)
-    return MTAR_ENAMELONG;
+  memset(&ex, 0, sizeof(ex));
+  ex.fd = ex.dir = -1;
+  ex.flags = flags;
 
-  /* Start at beginning */
-  err = mtar_rewind(tar);
-  if (err) {
-    return err;
+  /* Plan the work with one pass over the headers */
+  err = mtar_extract_plan(&ex, path);
+  if (!err) {
+    err = mtar_extract_dedup(&ex);
   }
-  /* Iterate all files until we hit an error or find the file */
-  while ( (err = mtar_read_header(tar, &header)) == MTAR_ESUCCESS ) {
-    if ( !strcmp(header.name, name) ) {
-      if (h) {
-        *h = header;
-      }
-      return MTAR_ESUCCESS;
+  if (!err) {
+    mkdir(dest_dir, 0777);
+    ex.dir = open(dest_dir, O_RDONLY | O_DIRECTORY);
+    ex.fd = open(path, O_RDONLY);
+    if (ex.dir < 0 || ex.fd < 0) {
+      err = MTAR_EOPENFAIL;
     }
-    mtar_next(tar);
   }
-  /* Return error */
-  if (err == MTAR_ENULLRECORD) {
-    err = MTAR_ENOTFOUND;
+  if (!err) {
+    err = mtar_extract_dirs(&ex);
   }
+
+  /* Regular files are written concurrently */
+  if (!err) {
+    mtar_queue_init(&ex.queue, ex.count);
+    mtar_run_workers(mtar_thread_count(nthreads), mtar_extract_worker, &ex);
+    mtar_queue_free(&ex.queue);
+    err = ex.queue.err;
+  }
+  if (!err) {
+    err = mtar_extract_links(&ex);
+  }
+
+  if (ex.fd >= 0) {
+    close(ex.fd);
+  }
+  if (ex.dir >= 0) {
+    close(ex.dir);
+  }
+  free(ex.jobs);
+  free(ex.names);
   return err;
 }
 
-int mtar_read_header(mtar_t *tar, mtar_header_t *h) {
-  int err;
-  mtar_raw_header_t rh;
-  /* Save header position */
-  tar->last_header = tar->pos;
-  /* Read raw header */
-  err = mtar_tread(tar, &rh, sizeof(rh));
+typedef struct {
+  const mtar_header_t *headers;
+  const char *const *sources;
+  size_t *offsets;      /* where each member's header goes */
+  int fd;               /* output */
+  mtar_queue_t queue;
+} mtar_layout_t;
+
+static int mtar_write_member(mtar_layout_t *w, size_t i, char *buf,
+                             size_t buf_size) {
+  const mtar_header_t *h = &w->headers[i];
+  char header[MTAR_HEADERMAX];
+  size_t len, offset = w->offsets[i];
+  off_t data_offset;
+  int fd, err;
+
+  /* Same bytes as mtar_write_header() at this offset */
+  err = mtar_encode_header(h, header, &len);
   if (err) {
     return err;
   }
-  /* Seek back to start of header */
-  err = mtar_seek(tar, tar->last_header);
-  if (err) {
-    return err;
+  if (pwrite(w->fd, header, len, (off_t)offset) != (ssize_t)len) {
+    return MTAR_EWRITEFAIL;
+  }
+  /* Without a source the data stays zero, as does the padding */
+  if (!w->sources || !w->sources[i] || !h->size) {
+    return MTAR_ESUCCESS;
+  }
+  fd = open(w->sources[i], O_RDONLY);
+  if (fd < 0) {
+    return MTAR_EOPENFAIL;
   }
-  /* Load raw header into header struct and return */
-  return mtar_raw_to_header(h, &rh);
+  data_offset = (off_t)(offset + len);
+  err = mtar_copy_fd(fd, NULL, w->fd, &data_offset, h->size, buf, buf_size);
+  close(fd);
+  return err;
 }
 
-int mtar_read_data(mtar_t *tar, void *ptr, size_t size) {
+static void *mtar_write_worker(void *arg) {
+  mtar_layout_t *w = (mtar_layout_t *)arg;
+  size_t i, buf_size = 256 * 1024;
+  char *buf = (char *)malloc(buf_size);
   int err;
-  mtar_header_t h;
-  /* If we have no remaining data then this is the first read, we get the size,
-   * set the remaining data and seek to the beginning of the data */
-  if (tar->remaining_data == 0) {
-    /* Read header */
-    err = mtar_read_header(tar, &h);
-    if (err) {
-      return err;
-    }
-    /* Seek past header and init remaining data */
-    err = mtar_seek(tar, tar->pos + sizeof(mtar_raw_header_t));
+
+  if (!buf) {
+    mtar_queue_fail(&w->queue, MTAR_ENOMEM);
+    return NULL;
+  }
+  while (mtar_queue_claim(&w->queue, &i)) {
+    err = mtar_write_member(w, i, buf, buf_size);
     if (err) {
-      return err;
+      mtar_queue_fail(&w->queue, err);
     }
-    tar->remaining_data = h.size;
   }
-  /* Read data */
-  err = mtar_tread(tar, ptr, size);
+  free(buf);
+  return NULL;
+}
+
+int mtar_write_parallel(const char *path, const mtar_header_t *headers,
+                        const char *const *sources, size_t count,
+                        int nthreads) {
+  mtar_layout_t w;
+  char header[MTAR_HEADERMAX];
+  size_t i, len, end = 0;
+  int err = MTAR_ESUCCESS;
+
+  /* Lay out every member up front; the archive ends with two NULL records */
+  w.headers = headers;
+  w.sources = sources;
+  w.offsets = (size_t *)malloc((count ? count : 1) * sizeof(size_t));
+  if (!w.offsets) {
+    return MTAR_ENOMEM;
+  }
+  for (i = 0; i < count && !err; i++) {
+    err = mtar_encode_header(&headers[i], header, &len);
+    w.offsets[i] = end;
+    end += len + mtar_round_up(headers[i].size, 512);
+  }
   if (err) {
+    free(w.offsets);
     return err;
   }
-  tar->remaining_data -= size;
-  /* If there is no remaining data we've finished reading and seek back to the
-   * header */
-  if (tar->remaining_data == 0) {
-    return mtar_seek(tar, tar->last_header);
+  end += sizeof(mtar_raw_header_t) * 2;
+
+  /* Padding and the NULL records are the zeros of the resized file */
+  w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (w.fd < 0) {
+    free(w.offsets);
+    return MTAR_EOPENFAIL;
   }
-  return MTAR_ESUCCESS;
+  if (ftruncate(w.fd, (off_t)end) != 0) {
+    err = MTAR_EWRITEFAIL;
+  }
+  if (!err) {
+    mtar_queue_init(&w.queue, count);
+    mtar_run_workers(mtar_thread_count(nthreads), mtar_write_worker, &w);
+    mtar_queue_free(&w.queue);
+    err = w.queue.err;
+  }
+  if (close(w.fd) != 0 && !err) {
+    err = MTAR_EWRITEFAIL;
+  }
+  free(w.offsets);
+  return err;
 }
 
-int mtar_write_header(mtar_t *tar, const mtar_header_t *h) {
-  mtar_raw_header_t rh;
-  /* Build raw header and write */
-  mtar_header_to_raw(&rh, h);
-  tar->remaining_data = h->size;
-  return mtar_twrite(tar, &rh, sizeof(rh));
-}
+/* Goes through mtar_write_data(), for backends without a descriptor */
+static int mtar_write_data_read(mtar_t *tar, int fd, size_t size) {
+  size_t buf_size = 64 * 1024;
+  char *buf = (char *)malloc(buf_size);
+  ssize_t n;
+  int err = MTAR_ESUCCESS;
 
-int mtar_write_file_header(mtar_t *tar, const char *name, size_t size) {
-  mtar_header_t h;
-  if (strlen(name) > MTAR_NAMEMAX)
-    return MTAR_ENAMELONG;
-  /* Build header */
-  memset(&h, 0, sizeof(h));
-  strcpy(h.name, name);
-  h.size = size;
-  h.type = MTAR_TREG;
-  h.mode = 0664;
-  h.mtime = time(NULL);
-  /* Write header */
-  return mtar_write_header(tar, &h);
+  if (!buf) {
+    return MTAR_ENOMEM;
+  }
+  while (size && !err) {
+    n = read(fd, buf, size < buf_size ? size : buf_size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      err = MTAR_EREADFAIL;
+      break;
+    }
+    err = mtar_write_data(tar, buf, (size_t)n);
+    size -= (size_t)n;
+  }
+  free(buf);
+  return err;
 }
 
-int mtar_write_dir_header(mtar_t *tar, const char *name) {
-  mtar_header_t h;
-  if (strlen(name) > MTAR_NAMEMAX)
-    return MTAR_ENAMELONG;
-  /* Build header */
-  memset(&h, 0, sizeof(h));
-  strcpy(h.name, name);
-  h.type = MTAR_TDIR;
-  h.mode = 0775;
-  /* Write header */
-  return mtar_write_header(tar, &h);
-}
+int mtar_write_data_from_fd(mtar_t *tar, int fd, size_t size) {
+  FILE *fp = (FILE *)tar->stream;
+  off_t offset = (off_t)tar->pos;
+  int out, seekable, err;
 
-int mtar_write_data(mtar_t *tar, const void *data, size_t size) {
-  int err;
-  /* Write data */
-  err = mtar_twrite(tar, data, size);
+  if (!tar->write) {
+    return MTAR_EUNSUPPORTED;
+  }
+  if (tar->write != mtar_file_write || (tar->flags & MTAR_FUNSIZED)) {
+    return mtar_write_data_read(tar, fd, size);
+  }
+  /* Everything buffered goes out first, then the data is placed behind it */
+  err = mtar_flush_buffer(tar);
+  if (err) {
+    return err;
+  }
+  if (fflush(fp) != 0) {
+    return MTAR_EWRITEFAIL;
+  }
+  out = fileno(fp);
+  seekable = tar->seek && !(tar->flags & MTAR_FSTREAM) &&
+             lseek(out, 0, SEEK_CUR) >= 0;
+  err = mtar_copy_fd(fd, NULL, out, seekable ? &offset : NULL, size, NULL, 0);
   if (err) {
     return err;
   }
+  tar->pos += size;
+  tar->buffer_start = tar->pos;
+  tar->buffer_len = 0;
+  if (seekable) {
+    /* Move the stdio position past the data */
+    err = MTAR_SEEK(tar, tar->pos);
+    if (err) {
+      return err;
+    }
+  }
   tar->remaining_data -= size;
-  /* Write padding if we've written all the data for this file */
   if (tar->remaining_data == 0) {
     return mtar_write_null_bytes(tar, mtar_round_up(tar->pos, 512) - tar->pos);
   }
   return MTAR_ESUCCESS;
 }
 
-int mtar_finalize(mtar_t *tar) {
-  /* Write two NULL records */
-  return mtar_write_null_bytes(tar, sizeof(mtar_raw_header_t) * 2);
+int mtar_write_file_from_fd(mtar_t *tar, const char *name, int fd,
+                            size_t size) {
+  int err = mtar_write_file_header(tar, name, size);
+  if (err) {
+    return err;
+  }
+  return mtar_write_data_from_fd(tar, fd, size);
 }
 
-static int memory_write(mtar_t *tar, const void *data, size_t size) {
-  char *memory;
-  size_t request_size, new_capacity;
-
-  if (tar->stream)
-    return MTAR_EWRITEFAIL;
-
-  if (!size)
-    return MTAR_ESUCCESS;
+/* Goes through mtar_read_data(), for streams and other backends */
+static int mtar_read_data_write(mtar_t *tar, int fd) {
+  mtar_header_t h;
+  size_t size, buf_size = 64 * 1024;
+  char *buf;
+  int err = MTAR_ESUCCESS;
 
-  request_size = tar->memory_pos + size;
-  if (request_size > tar->memory_capacity) {
-    if (request_size <= 1024)
-      new_capacity = 1024;
-    else
-      new_capacity = request_size * 2;
-    memory = (char *)realloc(tar->memory, new_capacity);
-    if (!memory) {
-      return MTAR_EWRITEFAIL;
+  /* Whatever is left of the current member */
+  if ((tar->flags & MTAR_FSTREAM) || !tar->remaining_data) {
+    err = mtar_read_header(tar, &h);
+    if (err) {
+      return err;
     }
-    tar->memory = memory;
-    tar->memory_size = request_size;
-    tar->memory_capacity = new_capacity;
-  } else if (request_size > tar->memory_size) {
-    memory = (char *)tar->memory;
-    tar->memory_size = request_size;
-  } else {
-    memory = (char *)tar->memory;
-    if (!memory) {
-      return MTAR_EWRITEFAIL;
+  }
+  size = (tar->flags & MTAR_FSTREAM) || tar->remaining_data ?
+         tar->remaining_data : h.size;
+  buf = (char *)malloc(buf_size);
+  if (!buf) {
+    return MTAR_ENOMEM;
+  }
+  while (size && !err) {
+    size_t n = size < buf_size ? size : buf_size;
+    err = mtar_read_data(tar, buf, n);
+    if (!err) {
+      err = mtar_write_fd(fd, NULL, buf, n);
     }
+    size -= n;
   }
+  free(buf);
+  return err;
+}
 
-  memcpy(&memory[tar->memory_pos], data, size);
-  tar->memory_pos += size;
+int mtar_read_data_to_fd(mtar_t *tar, int fd) {
+  mtar_header_t h;
+  const void *ptr;
+  size_t size;
+  off_t offset;
+  int in, err;
 
-  return MTAR_ESUCCESS;
+  /* Streams can only be read in order, as can members already started */
+  if ((tar->flags & MTAR_FSTREAM) || tar->remaining_data) {
+    return mtar_read_data_write(tar, fd);
+  }
+  if (tar->read == memory_read && tar->stream) {
+    err = mtar_data_view(tar, &ptr, &size);
+    return err ? err : mtar_write_fd(fd, NULL, ptr, size);
+  }
+  if (tar->read == mtar_file_read) {
+    in = fileno((FILE *)tar->stream);
+  } else if (tar->read == mtar_cursor_read) {
+    in = ((const mtar_archive_t *)tar->stream)->fd;
+  } else {
+    return mtar_read_data_write(tar, fd);
+  }
+  /* Copied at the data offset; the archive stays at the header */
+  err = mtar_load_header(tar, &h);
+  offset = (off_t)tar->pos;
+  if (!err) {
+    err = mtar_seek(tar, tar->last_header);
+  }
+  if (err) {
+    return err;
+  }
+  return mtar_copy_fd(in, &offset, fd, NULL, h.size, NULL, 0);
 }
 
-static int memory_read(mtar_t *tar, void *data, size_t size) {
-  char *memory;
+#else
 
-  if (!size)
-    return MTAR_ESUCCESS;
+int mtar_extract_parallel(const char *path, const char *dest_dir,
+                          int nthreads, unsigned flags) {
+  (void)path;
+  (void)dest_dir;
+  (void)nthreads;
+  (void)flags;
+  return MTAR_EUNSUPPORTED;
+}
 
-  memory = (char *)tar->stream;
-  if (tar->memory_pos + size > tar->memory_size)
-    return MTAR_EREADFAIL;
+int mtar_write_parallel(const char *path, const mtar_header_t *headers,
+                        const char *const *sources, size_t count,
+                        int nthreads) {
+  (void)path;
+  (void)headers;
+  (void)sources;
+  (void)count;
+  (void)nthreads;
+  return MTAR_EUNSUPPORTED;
+}
 
-  memcpy(data, &memory[tar->memory_pos], size);
-  tar->memory_pos += size;
+int mtar_write_data_from_fd(mtar_t *tar, int fd, size_t size) {
+  (void)tar;
+  (void)fd;
+  (void)size;
+  return MTAR_EUNSUPPORTED;
+}
 
-  return MTAR_ESUCCESS;
+int mtar_write_file_from_fd(mtar_t *tar, const char *name, int fd,
+                            size_t size) {
+  (void)tar;
+  (void)name;
+  (void)fd;
+  (void)size;
+  return MTAR_EUNSUPPORTED;
 }
 
-static int memory_seek(mtar_t *tar, size_t offset) {
-  if (!tar->stream)
-    return MTAR_ESEEKFAIL;
+int mtar_read_data_to_fd(mtar_t *tar, int fd) {
+  (void)tar;
+  (void)fd;
+  return MTAR_EUNSUPPORTED;
+}
 
-  if (offset > tar->memory_size)
-    return MTAR_ESEEKFAIL;
+#endif
 
-  tar->memory_pos = offset;
-  return MTAR_ESUCCESS;
+/* Appends size bytes at offset of `in` to `out`, which is at *out_pos */
+static int mtar_compact_copy(FILE *in, size_t offset, FILE *out,
+                             size_t *out_pos, size_t size, char *buf,
+                             size_t buf_size) {
+#ifdef MTAR_PARALLEL
+  /* Whole runs of members in one go, shared blocks where supported */
+  off_t in_off = (off_t)offset, out_off = (off_t)*out_pos;
+  *out_pos += size;
+  return mtar_copy_fd(fileno(in), &in_off, fileno(out), &out_off, size, buf,
+                      buf_size);
+#else
+  int err = mtar_fseek(in, offset);
+  *out_pos += size;
+  while (!err && size) {
+    size_t n = size < buf_size ? size : buf_size;
+    if (fread(buf, 1, n, in) != n) {
+      return MTAR_EREADFAIL;
+    }
+    if (fwrite(buf, 1, n, out) != n) {
+      return MTAR_EWRITEFAIL;
+    }
+    size -= n;
+  }
+  return err;
+#endif
 }
 
-static int memory_close(mtar_t *tar) {
-  free(tar->memory);
-  tar->memory = NULL;
-  return MTAR_ESUCCESS;
-}
+static int mtar_compact_to(FILE *in, FILE *out) {
+  mtar_t tar;
+  mtar_index_t idx;
+  char *buf;
+  size_t i, start = 0, end = 0, pos = 0, buf_size = 256 * 1024;
+  int err;
 
-int mtar_open_memory(mtar_t *tar, void *data, size_t size) {
-  if (!data || !size) {
-    data = NULL;
-    size = 0;
+  err = mtar_open_fp(&tar, in);
+  if (err) {
+    return err;
+  }
+  mtar_set_buffer(&tar, 64 * 1024);
+  err = mtar_index_build(&tar, &idx);
+  /* Leave `in` to the caller */
+  tar.close = NULL;
+  mtar_close(&tar);
+  if (err) {
+    return err;
+  }
+  buf = (char *)calloc(1, buf_size);
+  if (!buf) {
+    mtar_index_free(&idx);
+    return MTAR_ENOMEM;
   }
 
-  /* Init tar struct and functions */
-  memset(tar, 0, sizeof(*tar));
-  tar->write = memory_write;
-  tar->read = memory_read;
-  tar->seek = memory_seek;
-  tar->close = memory_close;
-  tar->stream = data;   /* for input */
-  tar->memory = NULL;   /* for output */
-  tar->memory_pos = 0;
-  tar->memory_size = size;
-  tar->memory_capacity = 0;
+  /* Live members are copied verbatim, adjacent ones as a single range; tar
+   * headers hold no offsets, so nothing needs rewriting */
+  for (i = 0; i < idx.count && !err; i++) {
+    const mtar_entry_t *e = &idx.entries[i];
+    if (!mtar_entry_live(&idx, e)) {
+      continue;
+    }
+    if (e->offset != end) {
+      err = mtar_compact_copy(in, start, out, &pos, end - start, buf,
+                              buf_size);
+      start = e->offset;
+    }
+    end = e->data_offset + mtar_round_up(e->size, 512);
+  }
+  if (!err) {
+    err = mtar_compact_copy(in, start, out, &pos, end - start, buf,
+                            buf_size);
+  }
+  mtar_index_free(&idx);
 
-  /* Return ok */
-  return MTAR_ESUCCESS;
+  /* The end-of-archive marker, copied from the zeroed buffer */
+  if (!err) {
+#ifdef MTAR_PARALLEL
+    off_t out_off = (off_t)pos;
+    err = mtar_write_fd(fileno(out), &out_off, buf,
+                        sizeof(mtar_raw_header_t) * 2);
+#else
+    if (fwrite(buf, 1, sizeof(mtar_raw_header_t) * 2, out) !=
+        sizeof(mtar_raw_header_t) * 2) {
+      err = MTAR_EWRITEFAIL;
+    }
+#endif
+  }
+  free(buf);
+  return err;
+}
+
+int mtar_compact(const char *path, const char *dest) {
+  FILE *in, *out;
+  char *tmp = NULL;
+  int err;
+
+  /* Without a destination the archive is replaced once the copy is done */
+  if (!dest) {
+    tmp = (char *)malloc(strlen(path) + 9);
+    if (!tmp) {
+      return MTAR_ENOMEM;
+    }
+    strcpy(tmp, path);
+    strcat(tmp, ".compact");
+  }
+  in = fopen(path, "rb");
+  if (!in) {
+    free(tmp);
+    return MTAR_EOPENFAIL;
+  }
+  out = fopen(tmp ? tmp : dest, "wb");
+  if (!out) {
+    fclose(in);
+    free(tmp);
+    return MTAR_EOPENFAIL;
+  }
+  err = mtar_compact_to(in, out);
+  if (fclose(out) != 0 && !err) {
+    err = MTAR_EWRITEFAIL;
+  }
+  fclose(in);
+  if (tmp) {
+#ifdef _WIN32
+    if (!err) {
+      remove(path);
+    }
+#endif
+    if (!err && rename(tmp, path) != 0) {
+      err = MTAR_EWRITEFAIL;
+    }
+    if (err) {
+      remove(tmp);
+    }
+    free(tmp);
+  }
+  return err;
 }
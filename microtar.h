@@ -19,9 +19,10 @@ extern "C"
 
 #define MTAR_VERSION "0.1.3"
 #define MTAR_NAMEMAX 99
+#define MTAR_PATHMAX 1023
 
 #if defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__)
-  #define MTAR_SIZEMAX 0x1FFFFFFFFULL
+  #define MTAR_SIZEMAX 0x7FFFFFFFFFFFFFFFULL
 #else
   #define MTAR_SIZEMAX  0x7FFFFFFFUL
 #endif
@@ -37,7 +38,14 @@ enum {
   MTAR_ENULLRECORD  = -7,
   MTAR_ENOTFOUND    = -8,
   MTAR_ENAMELONG    = -9,
-  MTAR_ETOOLARGE    = -10
+  MTAR_ETOOLARGE    = -10,
+  MTAR_ENOMEM       = -11,
+  MTAR_EBADINDEX    = -12,
+  MTAR_ESTALE       = -13,
+  MTAR_EUNSUPPORTED = -14,
+  MTAR_EBADFIELD    = -15,
+  MTAR_EBADPATH     = -16,
+  MTAR_EBADDATA     = -17
 };
 
 enum {
@@ -47,7 +55,13 @@ enum {
   MTAR_TCHR   = '3',
   MTAR_TBLK   = '4',
   MTAR_TDIR   = '5',
-  MTAR_TFIFO  = '6'
+  MTAR_TFIFO  = '6',
+  MTAR_TDELETED = 0x100 /* tombstone from mtar_delete(), never a tar type */
+};
+
+enum {
+  MTAR_FSTREAM = 1,     /* forward-only, never calls `seek` */
+  MTAR_FREWRITE = 2     /* `seek` can go back over written data */
 };
 
 typedef struct {
@@ -55,13 +69,92 @@ typedef struct {
   unsigned owner;
   size_t size;
   unsigned mtime;
+  unsigned mtime_nsec;
   unsigned type;
   char name[MTAR_NAMEMAX + 1];
   char linkname[MTAR_NAMEMAX + 1];
+  const char *longname; /* full name when longer than `name`, or NULL */
+  const char *longlink; /* full link target, likewise */
 } mtar_header_t;
 
+typedef struct {
+  size_t name;          /* offset into mtar_index_t.names */
+  size_t hash;
+  size_t offset;        /* offset of the header */
+  size_t data_offset;
+  size_t size;
+  unsigned type;
+  unsigned mtime;
+} mtar_entry_t;
+
+typedef struct {
+  mtar_entry_t *entries;  /* malloc'ed */
+  size_t count;
+  size_t capacity;
+  size_t *slots;          /* malloc'ed; entry number + 1, or 0 if empty */
+  size_t slot_count;
+  char *names;            /* malloc'ed */
+  size_t names_size;
+  size_t names_capacity;
+  size_t end;             /* offset of the end-of-archive marker */
+  size_t *sorted;         /* malloc'ed, see mtar_index_sort() */
+  size_t sorted_count;
+} mtar_index_t;
+
+/* Members by name, see mtar_index_prefix(), mtar_index_children() and
+ * mtar_index_glob() */
+typedef struct {
+  mtar_index_t *idx;
+  const char *pattern;        /* glob, not copied */
+  size_t depth;               /* slashes in the pattern, or -1 with "**" */
+  size_t dir_len;             /* children of name[0..dir_len), or -1 */
+  size_t pos, end;            /* range of mtar_index_t.sorted left */
+  const mtar_entry_t *entry;  /* current match; NULL for a directory that is
+                                 only implied by deeper names */
+  char name[MTAR_PATHMAX + 2];
+} mtar_query_t;
+
 typedef struct mtar_t mtar_t;
 
+#define MTAR_HISTBUCKETS 32
+
+/* Backend activity of one mtar_t, see mtar_enable_stats(). Bucket k of a
+ * histogram counts calls that took from 2^k up to 2^(k+1) nanoseconds; the
+ * last bucket also counts anything slower */
+typedef struct {
+  size_t reads;         /* callback invocations */
+  size_t writes;
+  size_t seeks;
+  size_t bytes_read;
+  size_t bytes_written;
+  size_t seek_distance; /* bytes moved over by seeks, either way */
+  size_t padding_bytes; /* written as padding and end-of-archive marker */
+  size_t headers;       /* headers parsed */
+  size_t checksum_errors;
+  double read_time;     /* seconds inside the backend */
+  double write_time;
+  double seek_time;
+  size_t read_hist[MTAR_HISTBUCKETS];
+  size_t write_hist[MTAR_HISTBUCKETS];
+  size_t seek_hist[MTAR_HISTBUCKETS];
+  size_t position;      /* of the backend, for seek_distance */
+} mtar_stats_t;
+
+/* Memory for the memory backend's output; sizes are passed back so that
+ * arenas and pools need no bookkeeping of their own */
+typedef struct {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t size);
+  void (*free)(void *ctx, void *ptr, size_t size);
+  void *ctx;
+} mtar_allocator_t;
+
+/* Same layout as struct iovec */
+typedef struct {
+  void *iov_base;
+  size_t iov_len;
+} mtar_iovec_t;
+
 typedef int (*mtar_read_t)(mtar_t *tar, void *data, size_t size);
 typedef int (*mtar_write_t)(mtar_t *tar, const void *data, size_t size);
 typedef int (*mtar_seek_t)(mtar_t *tar, size_t pos);
@@ -80,6 +173,103 @@ struct mtar_t {
   size_t memory_pos;
   size_t memory_size;
   size_t memory_capacity;
+  const mtar_allocator_t *allocator;  /* optional, not owned */
+  mtar_iovec_t *chunks; /* see mtar_set_chunked() */
+  size_t chunk_count;   /* allocated chunks */
+  size_t chunk_capacity;
+  size_t chunk_size;
+  mtar_index_t *index;  /* optional, not owned */
+  unsigned flags;       /* MTAR_F... */
+  mtar_header_t header; /* current header in stream mode */
+  char *buffer;         /* malloc'ed, see mtar_set_buffer() */
+  size_t buffer_capacity;
+  size_t buffer_start;  /* archive offset of buffer[0] */
+  size_t buffer_len;
+  size_t buffer_limit;  /* read-ahead stops here */
+  mtar_stats_t *stats;  /* malloc'ed, see mtar_enable_stats() */
+  size_t unsized_data;  /* data offset, see mtar_write_unsized_header() */
+  char *spill;          /* malloc'ed, data held back from unseekable output */
+  size_t spill_len;
+  void *spill_file;     /* tmpfile() for data beyond MTAR_SPILLMAX */
+  char *longnames;      /* malloc'ed, names beyond MTAR_NAMEMAX bytes */
+};
+
+/* Immutable after opening; may be shared by any number of threads, each
+ * reading through its own mtar_t from mtar_open_archive() */
+typedef struct {
+  int fd;               /* -1 when mapped */
+  const void *data;     /* mapping, or NULL */
+  size_t size;
+  mtar_index_t index;
+} mtar_archive_t;
+
+/* Summaries of many archives, see mtar_catalog_next() */
+typedef struct {
+  unsigned char *data;  /* malloc'ed, or mapped */
+  size_t size;
+  size_t capacity;
+  size_t count;         /* records, replaced ones included */
+  int mapped;
+} mtar_catalog_t;
+
+typedef struct {
+  const char *path;     /* points into the catalog */
+  size_t members;
+  size_t bytes;         /* data of the members */
+} mtar_summary_t;
+
+/* A whole-member read for mtar_batch_submit() */
+typedef struct mtar_request_t mtar_request_t;
+struct mtar_request_t {
+  const char *name;             /* looked up if `entry` is NULL */
+  const mtar_entry_t *entry;
+  void *data;                   /* entry->size bytes; malloc'ed if NULL */
+  int err;                      /* result, set on completion */
+  void (*done)(mtar_request_t *req);  /* optional, called by poll */
+  void *user;
+};
+
+typedef struct mtar_batch_t mtar_batch_t;
+
+/* Reader fed with bytes as they arrive, see mtar_feed(). Set the callbacks
+ * after mtar_parser_init(); a non-zero return from one stops parsing and is
+ * returned by mtar_feed() */
+typedef struct mtar_parser_t mtar_parser_t;
+struct mtar_parser_t {
+  int (*on_header)(mtar_parser_t *p, const mtar_header_t *h);
+  int (*on_data)(mtar_parser_t *p, const void *data, size_t size);
+  void *user;
+  unsigned state;       /* internal */
+  int err;              /* sticky once parsing failed */
+  size_t pos;           /* bytes consumed */
+  size_t remaining;     /* of the current data, extension data or padding */
+  size_t record_len;
+  char record[512];     /* a header arriving in pieces */
+  char *ext;            /* malloc'ed, extension header data */
+  size_t ext_len;
+  unsigned ext_type;
+  void *overrides;      /* malloc'ed, from extension headers */
+  mtar_header_t header;
+  char *longnames;      /* malloc'ed, names beyond MTAR_NAMEMAX bytes */
+};
+
+/* Random and chunked access to the data of one member, see
+ * mtar_member_open() */
+typedef struct {
+  mtar_t *tar;
+  size_t header;        /* offset of the member's header */
+  size_t data_offset;
+  size_t size;
+  size_t pos;           /* next byte for mtar_member_read() */
+} mtar_member_t;
+
+enum {
+  MTAR_BATCH_NOURING = 1        /* use the thread pool even if io_uring works */
+};
+
+enum {
+  MTAR_EXTRACT_PERMS = 1,       /* keep setuid, setgid and sticky bits */
+  MTAR_EXTRACT_SKIPDEV = 2      /* skip device nodes instead of failing */
 };
 
 const char* mtar_strerror(int err);
@@ -89,21 +279,118 @@ int mtar_open(mtar_t *tar, const char *filename, const char *mode);
   int mtar_open_w(mtar_t *tar, const wchar_t *filename, const wchar_t *mode);
 #endif
 int mtar_open_fp(mtar_t *tar, void *fp);
+int mtar_open_append(mtar_t *tar, const char *filename, mtar_index_t *idx);
+int mtar_open_stream(mtar_t *tar, void *fp);
 int mtar_open_memory(mtar_t *tar, void *data, size_t size);
+int mtar_open_mmap(mtar_t *tar, const char *filename);
+int mtar_open_gz(mtar_t *tar, const char *filename, const char *mode);
+int mtar_open_gz_fp(mtar_t *tar, void *fp, const char *mode);
 int mtar_close(mtar_t *tar);
+int mtar_set_buffer(mtar_t *tar, size_t size);
+int mtar_set_allocator(mtar_t *tar, const mtar_allocator_t *allocator);
+int mtar_set_chunked(mtar_t *tar, size_t chunk_size);
+int mtar_set_threads(mtar_t *tar, int nthreads);
+int mtar_enable_stats(mtar_t *tar);
+int mtar_get_stats(const mtar_t *tar, mtar_stats_t *stats);
+int mtar_memory_reserve(mtar_t *tar, size_t size);
+int mtar_memory_chunks(const mtar_t *tar, const mtar_iovec_t **iov,
+                       size_t *count);
+size_t mtar_member_size(const mtar_header_t *h);
+const char *mtar_header_name(const mtar_header_t *h);
+const char *mtar_header_linkname(const mtar_header_t *h);
 
 int mtar_seek(mtar_t *tar, size_t pos);
 int mtar_rewind(mtar_t *tar);
 int mtar_next(mtar_t *tar);
+/* Without an index, reads every header to the end of the archive so that
+ * the last member of a name is found; attach one for repeated lookups */
 int mtar_find(mtar_t *tar, const char *name, mtar_header_t *h);
 int mtar_read_header(mtar_t *tar, mtar_header_t *h);
 int mtar_read_data(mtar_t *tar, void *ptr, size_t size);
+int mtar_data_view(mtar_t *tar, const void **ptr, size_t *size);
+int mtar_entry_view(mtar_t *tar, const mtar_entry_t *e, const void **ptr);
+int mtar_read_data_to_fd(mtar_t *tar, int fd);
+
+void mtar_parser_init(mtar_parser_t *p);
+int mtar_feed(mtar_parser_t *p, const void *data, size_t size);
+int mtar_parser_finish(mtar_parser_t *p);
+
+int mtar_member_open(mtar_t *tar, const char *name, mtar_member_t *m);
+int mtar_member_open_entry(mtar_t *tar, const mtar_entry_t *e,
+                           mtar_member_t *m);
+int mtar_member_read_at(mtar_member_t *m, size_t offset, void *data,
+                        size_t size);
+int mtar_member_skip(mtar_member_t *m, size_t n);
+int mtar_member_read(mtar_member_t *m, void *data, size_t size, size_t *n);
 
 int mtar_write_header(mtar_t *tar, const mtar_header_t *h);
 int mtar_write_file_header(mtar_t *tar, const char *name, size_t size);
 int mtar_write_dir_header(mtar_t *tar, const char *name);
 int mtar_write_data(mtar_t *tar, const void *data, size_t size);
+int mtar_write_unsized_header(mtar_t *tar, const mtar_header_t *h);
+int mtar_end_data(mtar_t *tar);
+int mtar_write_data_from_fd(mtar_t *tar, int fd, size_t size);
+int mtar_write_file_from_fd(mtar_t *tar, const char *name, int fd,
+                            size_t size);
 int mtar_finalize(mtar_t *tar);
+int mtar_delete(mtar_t *tar, const char *name);
+int mtar_compact(const char *path, const char *dest);
+
+void mtar_index_init(mtar_index_t *idx);
+void mtar_index_free(mtar_index_t *idx);
+int mtar_index_build(mtar_t *tar, mtar_index_t *idx);
+int mtar_index_lookup(const mtar_index_t *idx, const char *name,
+                      const mtar_entry_t **e);
+const char *mtar_entry_name(const mtar_index_t *idx, const mtar_entry_t *e);
+size_t mtar_index_dead(const mtar_index_t *idx);
+int mtar_index_sort(mtar_index_t *idx);
+int mtar_index_prefix(mtar_query_t *q, mtar_index_t *idx, const char *prefix);
+int mtar_index_children(mtar_query_t *q, mtar_index_t *idx, const char *dir);
+int mtar_index_glob(mtar_query_t *q, mtar_index_t *idx, const char *pattern);
+int mtar_query_next(mtar_query_t *q);
+int mtar_index_save(const mtar_index_t *idx, const char *filename,
+                    const char *tarname);
+int mtar_index_load(mtar_index_t *idx, const char *filename,
+                    const char *tarname);
+
+int mtar_archive_open(mtar_archive_t *ar, const char *filename,
+                      const char *index_file);
+int mtar_archive_open_mmap(mtar_archive_t *ar, const char *filename,
+                           const char *index_file);
+int mtar_archive_close(mtar_archive_t *ar);
+int mtar_open_archive(mtar_t *tar, const mtar_archive_t *ar);
+int mtar_archive_read_at(const mtar_archive_t *ar, const mtar_entry_t *e,
+                         size_t offset, void *data, size_t size);
+int mtar_archive_view(const mtar_archive_t *ar, const mtar_entry_t *e,
+                      const void **ptr);
+
+void mtar_catalog_init(mtar_catalog_t *cat);
+void mtar_catalog_free(mtar_catalog_t *cat);
+int mtar_catalog_add(mtar_catalog_t *cat, const char *path,
+                     const mtar_index_t *idx);
+int mtar_catalog_save(const mtar_catalog_t *cat, const char *filename);
+int mtar_catalog_update(const char *filename, const char *path,
+                        const mtar_index_t *idx);
+int mtar_catalog_load(mtar_catalog_t *cat, const char *filename);
+int mtar_catalog_load_mmap(mtar_catalog_t *cat, const char *filename);
+int mtar_catalog_next(const mtar_catalog_t *cat, const char *name,
+                      size_t *pos, mtar_summary_t *s);
+int mtar_catalog_locate(const mtar_catalog_t *cat, const char *name,
+                        mtar_archive_t *ar, const mtar_entry_t **e);
+
+int mtar_batch_open(mtar_batch_t **batch, const mtar_archive_t *ar,
+                    unsigned depth, unsigned flags);
+void mtar_batch_close(mtar_batch_t *b);
+const char *mtar_batch_backend(const mtar_batch_t *b);
+int mtar_batch_submit(mtar_batch_t *b, mtar_request_t *reqs, size_t count);
+int mtar_batch_poll(mtar_batch_t *b, int wait);
+int mtar_batch_wait(mtar_batch_t *b);
+
+int mtar_extract_parallel(const char *path, const char *dest_dir,
+                          int nthreads, unsigned flags);
+int mtar_write_parallel(const char *path, const mtar_header_t *headers,
+                        const char *const *sources, size_t count,
+                        int nthreads);
 
 #ifdef __cplusplus
 }
@@ -2,12 +2,25 @@
 // Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
 // This file is public domain software.
 #ifndef MTAR_WRAP_HPP_
-#define MTAR_WRAP_HPP_      3   // Version 3
+#define MTAR_WRAP_HPP_      6   // Version 6
 
 #include "microtar.h"
 #include <cstring>
 #include <cassert>
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+    #define MTAR_WRAP_MOVE          // move constructor and assignment
+#endif
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+    #define MTAR_WRAP_ENTRIES       // mtar_wrap::entries()
+    #include <cstddef>
+    #include <iterator>
+    #include <string_view>
+    #ifdef __cpp_lib_ranges
+        #include <ranges>
+    #endif
+#endif
+
 typedef int mtar_err_t;     // MTAR_E...
 
 class mtar_wrap
@@ -15,12 +28,28 @@ class mtar_wrap
 public:
     mtar_wrap();
     virtual ~mtar_wrap();
+#ifdef MTAR_WRAP_MOVE
+    mtar_wrap(mtar_wrap&& other) noexcept;
+    mtar_wrap& operator=(mtar_wrap&& other) noexcept;
+#endif
     mtar_err_t open(const char *filename, const char *mode);
+#ifdef _WIN32
     mtar_err_t open(const wchar_t *filename, const wchar_t *mode);
+#endif
     mtar_err_t open_fp(void *fp);
+    mtar_err_t open_stream(void *fp);
     mtar_err_t open_memory(void *data, size_t size);
+    mtar_err_t open_mmap(const char *filename);
+    mtar_err_t open_archive(const mtar_archive_t *ar);
     bool is_open() const;
     mtar_err_t close();
+    mtar_err_t set_buffer(size_t size);
+
+    mtar_err_t build_index();
+    mtar_err_t load_index(const char *filename, const char *tarname);
+    mtar_err_t save_index(const char *filename, const char *tarname) const;
+    const mtar_index_t *index() const;
+    mtar_err_t lookup(const char *name, const mtar_entry_t **e) const;
 
     mtar_err_t find(const char *name, mtar_header_t *h);
     mtar_err_t seek(size_t pos);
@@ -29,6 +58,8 @@ public:
 
     mtar_err_t read_header(mtar_header_t *h);
     mtar_err_t read_data(void *ptr, size_t size);
+    mtar_err_t data_view(const void **ptr, size_t *size);
+    mtar_err_t entry_view(const mtar_entry_t *e, const void **ptr);
 
     mtar_err_t write_header(const mtar_header_t *h);
     mtar_err_t write_file_header(const char *name, size_t size);
@@ -39,25 +70,164 @@ public:
     const void *memory() const;
     size_t memory_size() const;
 
+#ifdef MTAR_WRAP_ENTRIES
+    class entry;
+    class entry_iterator;
+    class entry_range;
+    entry_range entries();
+#endif
+
 protected:
     mtar_t m_tar;
+    mtar_index_t m_index;
+    mtar_header_t *m_scratch;   // new'ed on demand, see entry::linkname()
 
 private:
     mtar_wrap(const mtar_wrap&);
     mtar_wrap& operator=(const mtar_wrap&);
 };
 
+#ifdef MTAR_WRAP_ENTRIES
+// A member as recorded in the index. Nothing is copied or decoded to iterate;
+// the linkname is read from the header only when asked for. Valid as long as
+// the index is.
+class mtar_wrap::entry
+{
+public:
+    entry() : m_wrap(NULL), m_entry(NULL) { }
+    entry(mtar_wrap *wrap, const mtar_entry_t *e) : m_wrap(wrap), m_entry(e) { }
+
+    std::string_view name() const;
+    std::string_view linkname() const;
+    size_t size() const         { return m_entry->size; }
+    unsigned type() const       { return m_entry->type; }
+    unsigned mtime() const      { return m_entry->mtime; }
+    size_t offset() const       { return m_entry->offset; }
+    size_t data_offset() const  { return m_entry->data_offset; }
+    const mtar_entry_t *get() const { return m_entry; }
+
+    std::string_view data() const;
+    mtar_err_t read_data(void *ptr, size_t size) const;
+
+private:
+    mtar_wrap *m_wrap;
+    const mtar_entry_t *m_entry;
+};
+
+class mtar_wrap::entry_iterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef entry value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef void pointer;
+    typedef entry reference;
+
+    entry_iterator() : m_wrap(NULL), m_entry(NULL) { }
+    entry_iterator(mtar_wrap *wrap, const mtar_entry_t *e) : m_wrap(wrap), m_entry(e) { }
+
+    entry operator*() const { return entry(m_wrap, m_entry); }
+    entry_iterator& operator++() { ++m_entry; return *this; }
+    entry_iterator operator++(int) { entry_iterator it = *this; ++m_entry; return it; }
+    bool operator==(const entry_iterator& other) const { return m_entry == other.m_entry; }
+    bool operator!=(const entry_iterator& other) const { return m_entry != other.m_entry; }
+
+private:
+    mtar_wrap *m_wrap;
+    const mtar_entry_t *m_entry;
+};
+
+// Every member in archive order, replaced and deleted ones included. Cheap to
+// copy, so it can be used as a std::ranges view.
+class mtar_wrap::entry_range
+#ifdef __cpp_lib_ranges
+    : public std::ranges::view_base
+#endif
+{
+public:
+    entry_range() : m_wrap(NULL), m_error(MTAR_ESUCCESS) { }
+    entry_range(mtar_wrap *wrap, mtar_err_t error) : m_wrap(wrap), m_error(error) { }
+
+    entry_iterator begin() const;
+    entry_iterator end() const;
+    size_t size() const;
+    bool empty() const { return size() == 0; }
+    mtar_err_t error() const { return m_error; }
+
+private:
+    mtar_wrap *m_wrap;
+    mtar_err_t m_error;
+};
+#endif
+
+// An archive shared between threads. The const methods never touch shared
+// state and may be called concurrently; for sequential access each thread
+// opens its own cursor with mtar_wrap::open_archive(get()).
+class mtar_archive_wrap
+{
+public:
+    mtar_archive_wrap();
+    virtual ~mtar_archive_wrap();
+    mtar_err_t open(const char *filename, const char *index_file = NULL);
+    mtar_err_t open_mmap(const char *filename, const char *index_file = NULL);
+    bool is_open() const;
+    mtar_err_t close();
+
+    const mtar_archive_t *get() const;
+    mtar_err_t lookup(const char *name, const mtar_entry_t **e) const;
+    mtar_err_t read_at(const mtar_entry_t *e, size_t offset, void *data, size_t size) const;
+    mtar_err_t view(const mtar_entry_t *e, const void **ptr) const;
+
+protected:
+    mtar_archive_t m_ar;
+    bool m_open;
+
+private:
+    mtar_archive_wrap(const mtar_archive_wrap&);
+    mtar_archive_wrap& operator=(const mtar_archive_wrap&);
+};
+
 //////////////////////////////////////////////////////////////////////////////
 
-inline mtar_wrap::mtar_wrap()
+inline mtar_wrap::mtar_wrap() : m_scratch(NULL)
 {
     memset(&m_tar, 0, sizeof(m_tar));
+    mtar_index_init(&m_index);
 }
 
 inline mtar_wrap::~mtar_wrap()
 {
     close();
+    delete m_scratch;
+}
+
+#ifdef MTAR_WRAP_MOVE
+inline mtar_wrap::mtar_wrap(mtar_wrap&& other) noexcept : m_scratch(NULL)
+{
+    memset(&m_tar, 0, sizeof(m_tar));
+    mtar_index_init(&m_index);
+    *this = static_cast<mtar_wrap&&>(other);
+}
+
+inline mtar_wrap& mtar_wrap::operator=(mtar_wrap&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        delete m_scratch;
+        // The archive may point at the index it is moved with
+        m_tar = other.m_tar;
+        m_index = other.m_index;
+        m_scratch = other.m_scratch;
+        if (other.m_tar.index == &other.m_index)
+            m_tar.index = &m_index;
+        memset(&other.m_tar, 0, sizeof(other.m_tar));
+        mtar_index_init(&other.m_index);
+        other.m_scratch = NULL;
+    }
+    return *this;
 }
+#endif
 
 inline mtar_err_t mtar_wrap::open(const char *filename, const char *mode)
 {
@@ -67,6 +237,7 @@ inline mtar_err_t mtar_wrap::open(const char *filename, const char *mode)
     return ret;
 }
 
+#ifdef _WIN32
 inline mtar_err_t mtar_wrap::open(const wchar_t *filename, const wchar_t *mode)
 {
     close();
@@ -74,6 +245,7 @@ inline mtar_err_t mtar_wrap::open(const wchar_t *filename, const wchar_t *mode)
     assert(ret == 0);
     return ret;
 }
+#endif
 
 inline mtar_err_t mtar_wrap::open_fp(void *fp)
 {
@@ -83,6 +255,14 @@ inline mtar_err_t mtar_wrap::open_fp(void *fp)
     return ret;
 }
 
+inline mtar_err_t mtar_wrap::open_stream(void *fp)
+{
+    close();
+    mtar_err_t ret = mtar_open_stream(&m_tar, fp);
+    assert(ret == 0);
+    return ret;
+}
+
 inline mtar_err_t mtar_wrap::open_memory(void *data, size_t size)
 {
     close();
@@ -91,6 +271,22 @@ inline mtar_err_t mtar_wrap::open_memory(void *data, size_t size)
     return ret;
 }
 
+inline mtar_err_t mtar_wrap::open_mmap(const char *filename)
+{
+    close();
+    mtar_err_t ret = mtar_open_mmap(&m_tar, filename);
+    assert(ret == 0);
+    return ret;
+}
+
+inline mtar_err_t mtar_wrap::open_archive(const mtar_archive_t *ar)
+{
+    close();
+    mtar_err_t ret = mtar_open_archive(&m_tar, ar);
+    assert(ret == 0);
+    return ret;
+}
+
 inline bool mtar_wrap::is_open() const
 {
     return m_tar.read || m_tar.write;
@@ -104,9 +300,56 @@ inline mtar_err_t mtar_wrap::close()
         ret = mtar_close(&m_tar);
         memset(&m_tar, 0, sizeof(m_tar));
     }
+    mtar_index_free(&m_index);
     return ret;
 }
 
+inline mtar_err_t mtar_wrap::set_buffer(size_t size)
+{
+    assert(is_open());
+    mtar_err_t ret = mtar_set_buffer(&m_tar, size);
+    assert(ret == 0);
+    return ret;
+}
+
+inline mtar_err_t mtar_wrap::build_index()
+{
+    assert(is_open());
+    mtar_err_t ret = mtar_index_build(&m_tar, &m_index);
+    assert(ret == 0);
+    return ret;
+}
+
+inline mtar_err_t mtar_wrap::load_index(const char *filename, const char *tarname)
+{
+    assert(is_open());
+    mtar_index_free(&m_index);
+    m_tar.index = NULL;
+    mtar_err_t ret = mtar_index_load(&m_index, filename, tarname);
+    if (ret == 0)
+        m_tar.index = &m_index;
+    return ret;
+}
+
+inline mtar_err_t mtar_wrap::save_index(const char *filename, const char *tarname) const
+{
+    if (!m_tar.index)
+        return MTAR_EFAILURE;
+    return mtar_index_save(m_tar.index, filename, tarname);
+}
+
+inline const mtar_index_t *mtar_wrap::index() const
+{
+    return m_tar.index;
+}
+
+inline mtar_err_t mtar_wrap::lookup(const char *name, const mtar_entry_t **e) const
+{
+    if (!m_tar.index)
+        return MTAR_ENOTFOUND;
+    return mtar_index_lookup(m_tar.index, name, e);
+}
+
 inline mtar_err_t mtar_wrap::find(const char *name, mtar_header_t *h)
 {
     assert(is_open());
@@ -155,6 +398,18 @@ inline mtar_err_t mtar_wrap::read_data(void *ptr, size_t size)
     return ret;
 }
 
+inline mtar_err_t mtar_wrap::data_view(const void **ptr, size_t *size)
+{
+    assert(is_open());
+    return mtar_data_view(&m_tar, ptr, size);
+}
+
+inline mtar_err_t mtar_wrap::entry_view(const mtar_entry_t *e, const void **ptr)
+{
+    assert(is_open());
+    return mtar_entry_view(&m_tar, e, ptr);
+}
+
 inline mtar_err_t mtar_wrap::write_header(const mtar_header_t *h)
 {
     assert(is_open());
@@ -208,4 +463,149 @@ inline size_t mtar_wrap::memory_size() const
     return m_tar.memory_size;
 }
 
+#ifdef MTAR_WRAP_ENTRIES
+// Uses the attached index, building one if there is none. The range is empty
+// and error() says why if that fails.
+inline mtar_wrap::entry_range mtar_wrap::entries()
+{
+    mtar_err_t ret = MTAR_ESUCCESS;
+    if (!is_open())
+        ret = MTAR_EFAILURE;
+    else if (!m_tar.index)
+        ret = mtar_index_build(&m_tar, &m_index);
+    return entry_range(ret ? NULL : this, ret);
+}
+
+inline std::string_view mtar_wrap::entry::name() const
+{
+    return mtar_entry_name(m_wrap->m_tar.index, m_entry);
+}
+
+// Moves the archive to the member's header; the view is valid until the
+// wrapper reads another header
+inline std::string_view mtar_wrap::entry::linkname() const
+{
+    if (m_entry->type != MTAR_TLNK && m_entry->type != MTAR_TSYM)
+        return std::string_view();
+    if (!m_wrap->m_scratch)
+        m_wrap->m_scratch = new mtar_header_t;
+    if (mtar_seek(&m_wrap->m_tar, m_entry->offset) ||
+        mtar_read_header(&m_wrap->m_tar, m_wrap->m_scratch))
+        return std::string_view();
+    return mtar_header_linkname(m_wrap->m_scratch);
+}
+
+// The data in place for memory and mapped archives, otherwise empty
+inline std::string_view mtar_wrap::entry::data() const
+{
+    const void *ptr;
+    if (mtar_entry_view(&m_wrap->m_tar, m_entry, &ptr))
+        return std::string_view();
+    return std::string_view(static_cast<const char *>(ptr), m_entry->size);
+}
+
+// Reads the start of the data from any backend
+inline mtar_err_t mtar_wrap::entry::read_data(void *ptr, size_t size) const
+{
+    if (!size)
+        return MTAR_ESUCCESS;
+    mtar_err_t ret = mtar_seek(&m_wrap->m_tar, m_entry->data_offset);
+    if (ret)
+        return ret;
+    // As if mtar_read_data() had just read the header
+    m_wrap->m_tar.last_header = m_entry->offset;
+    m_wrap->m_tar.remaining_data = m_entry->size;
+    return mtar_read_data(&m_wrap->m_tar, ptr, size);
+}
+
+inline mtar_wrap::entry_iterator mtar_wrap::entry_range::begin() const
+{
+    if (!m_wrap)
+        return entry_iterator();
+    return entry_iterator(m_wrap, m_wrap->m_tar.index->entries);
+}
+
+inline mtar_wrap::entry_iterator mtar_wrap::entry_range::end() const
+{
+    if (!m_wrap)
+        return entry_iterator();
+    return entry_iterator(m_wrap, m_wrap->m_tar.index->entries + size());
+}
+
+inline size_t mtar_wrap::entry_range::size() const
+{
+    return m_wrap ? m_wrap->m_tar.index->count : 0;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+
+inline mtar_archive_wrap::mtar_archive_wrap() : m_open(false)
+{
+    memset(&m_ar, 0, sizeof(m_ar));
+    m_ar.fd = -1;
+}
+
+inline mtar_archive_wrap::~mtar_archive_wrap()
+{
+    close();
+}
+
+inline mtar_err_t mtar_archive_wrap::open(const char *filename, const char *index_file)
+{
+    close();
+    mtar_err_t ret = mtar_archive_open(&m_ar, filename, index_file);
+    m_open = (ret == 0);
+    return ret;
+}
+
+inline mtar_err_t mtar_archive_wrap::open_mmap(const char *filename, const char *index_file)
+{
+    close();
+    mtar_err_t ret = mtar_archive_open_mmap(&m_ar, filename, index_file);
+    m_open = (ret == 0);
+    return ret;
+}
+
+inline bool mtar_archive_wrap::is_open() const
+{
+    return m_open;
+}
+
+inline mtar_err_t mtar_archive_wrap::close()
+{
+    mtar_err_t ret = MTAR_EFAILURE;
+    if (m_open)
+    {
+        ret = mtar_archive_close(&m_ar);
+        m_open = false;
+    }
+    return ret;
+}
+
+inline const mtar_archive_t *mtar_archive_wrap::get() const
+{
+    assert(is_open());
+    return &m_ar;
+}
+
+inline mtar_err_t mtar_archive_wrap::lookup(const char *name, const mtar_entry_t **e) const
+{
+    assert(is_open());
+    return mtar_index_lookup(&m_ar.index, name, e);
+}
+
+inline mtar_err_t mtar_archive_wrap::read_at(const mtar_entry_t *e, size_t offset,
+                                             void *data, size_t size) const
+{
+    assert(is_open());
+    return mtar_archive_read_at(&m_ar, e, offset, data, size);
+}
+
+inline mtar_err_t mtar_archive_wrap::view(const mtar_entry_t *e, const void **ptr) const
+{
+    assert(is_open());
+    return mtar_archive_view(&m_ar, e, ptr);
+}
+
 #endif  // ndef MTAR_WRAP_HPP_
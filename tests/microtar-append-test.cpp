@@ -0,0 +1,126 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+static void add(mtar_t *tar, const string& name, size_t size)
+{
+    string data(size, name[0]);
+    mtar_write_file_header(tar, name.c_str(), data.size());
+    mtar_write_data(tar, data.data(), data.size());
+}
+
+/* Reads every member in order and compares with the expected names */
+static bool check(const string& filename, const vector<string>& names)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    vector<string> found;
+    if (mtar_open(&tar, filename.c_str(), "r"))
+        return names.empty();
+    while (mtar_read_header(&tar, &h) == MTAR_ESUCCESS)
+    {
+        found.push_back(h.name);
+        mtar_next(&tar);
+    }
+    mtar_close(&tar);
+    return found == names;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_index_t idx;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const string filename = argv[1];
+    const string sidecar = filename + ".idx";
+    remove(filename.c_str());
+
+    /* A missing archive is created */
+    if (mtar_open(&tar, filename.c_str(), "a") || tar.pos != 0)
+    {
+        printf("error: cannot create\n");
+        return 2;
+    }
+    add(&tar, "a.txt", 100);
+    add(&tar, "b.txt", 600);
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    /* Appending overwrites the marker and leaves exactly one behind */
+    mtar_open(&tar, filename.c_str(), "a");
+    if (tar.pos != 512 * 5)
+    {
+        printf("error: appending at %d\n", (int)tar.pos);
+        return 3;
+    }
+    add(&tar, "c.txt", 1);
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+    if (!check(filename, { "a.txt", "b.txt", "c.txt" }) ||
+        load(filename).size() != 512 * 9)
+    {
+        printf("error: after append\n");
+        return 4;
+    }
+
+    /* Through an index, which picks up the new members */
+    mtar_open(&tar, filename.c_str(), "r");
+    mtar_index_build(&tar, &idx);
+    mtar_close(&tar);
+    mtar_index_save(&idx, sidecar.c_str(), filename.c_str());
+    mtar_index_free(&idx);
+    if (mtar_index_load(&idx, sidecar.c_str(), filename.c_str()) ||
+        mtar_open_append(&tar, filename.c_str(), &idx) || tar.pos != 512 * 7 ||
+        tar.index != &idx)
+    {
+        printf("error: indexed append\n");
+        return 5;
+    }
+    add(&tar, "d.txt", 2000);
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+    const mtar_entry_t *e;
+    if (idx.count != 4 || idx.end != 512 * 12 ||
+        mtar_index_lookup(&idx, "d.txt", &e) || e->offset != 512 * 7 ||
+        !check(filename, { "a.txt", "b.txt", "c.txt", "d.txt" }))
+    {
+        printf("error: after indexed append\n");
+        return 6;
+    }
+
+    /* An index of something else is rebuilt */
+    idx.end = 512;
+    if (mtar_open_append(&tar, filename.c_str(), &idx) || tar.pos != 512 * 12 ||
+        idx.count != 4 || idx.end != 512 * 12)
+    {
+        printf("error: stale index\n");
+        return 7;
+    }
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+
+    /* Archives never finalized are continued at their end */
+    mtar_open(&tar, filename.c_str(), "w");
+    add(&tar, "e.txt", 10);
+    mtar_close(&tar);
+    mtar_open(&tar, filename.c_str(), "a");
+    add(&tar, "f.txt", 10);
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+    if (!check(filename, { "e.txt", "f.txt" }))
+    {
+        printf("error: unfinished archive\n");
+        return 8;
+    }
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "mtar_wrap.hpp"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+static const int s_count = 100;
+
+static size_t size_of(int i)
+{
+    return 100 + i * 61;
+}
+
+/* Each thread walks its own cursor and reads ranges from the shared handle */
+static int reader(const mtar_archive_t *ar, int seed)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    const mtar_entry_t *e;
+    char name[64], data[8192];
+
+    if (mtar_open_archive(&tar, ar))
+        return 1;
+    for (int round = 0; round < 200; round++)
+    {
+        int i = (seed * 31 + round * 17) % s_count;
+        string expected = content(i, size_of(i));
+        sprintf(name, "file-%d.txt", i);
+        if (mtar_find(&tar, name, &h) || h.size != expected.size() ||
+            mtar_read_data(&tar, data, h.size) ||
+            memcmp(data, expected.data(), h.size) != 0)
+            return 2;
+
+        size_t offset = (size_t)(round * 7) % expected.size();
+        size_t size = (expected.size() - offset) / 2;
+        if (mtar_index_lookup(&ar->index, name, &e) ||
+            mtar_archive_read_at(ar, e, offset, data, size) ||
+            memcmp(data, &expected[offset], size) != 0)
+            return 3;
+    }
+    mtar_close(&tar);
+    return 0;
+}
+
+static int run_readers(const mtar_archive_t *ar)
+{
+    vector<thread> threads;
+    vector<int> results(8);
+    for (int t = 0; t < 8; t++)
+        threads.push_back(thread([&results, ar, t] { results[t] = reader(ar, t); }));
+    for (auto& t : threads)
+        t.join();
+    for (int result : results)
+    {
+        if (result)
+            return result;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_archive_t ar;
+    const mtar_entry_t *e;
+    const void *ptr;
+    char data[16];
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+
+    mtar_open(&tar, argv[1], "w");
+    for (int i = 0; i < s_count; i++)
+    {
+        string data = content(i, size_of(i));
+        string name = "file-" + to_string(i) + ".txt";
+        mtar_write_file_header(&tar, name.c_str(), data.size());
+        mtar_write_data(&tar, data.data(), data.size());
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    /* pread() backend */
+    if (int error = mtar_archive_open(&ar, argv[1], NULL))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 2;
+    }
+    if (ar.index.count != s_count)
+    {
+        printf("error: %d members indexed\n", (int)ar.index.count);
+        return 3;
+    }
+    if (int error = run_readers(&ar))
+    {
+        printf("error: reader %d\n", error);
+        return 4;
+    }
+    mtar_index_lookup(&ar.index, "file-1.txt", &e);
+    if (mtar_archive_read_at(&ar, e, e->size - 4, data, 5) != MTAR_EREADFAIL)
+    {
+        printf("error: read past member\n");
+        return 5;
+    }
+    if (ar.fd >= 0 && mtar_archive_view(&ar, e, &ptr) != MTAR_EUNSUPPORTED)
+    {
+        printf("error: view without mapping\n");
+        return 6;
+    }
+
+    /* Cursors are read-only */
+    mtar_open_archive(&tar, &ar);
+    if (mtar_write_file_header(&tar, "new.txt", 0) != MTAR_EUNSUPPORTED ||
+        ar.index.count != s_count)
+    {
+        printf("error: wrote through cursor\n");
+        return 7;
+    }
+    mtar_close(&tar);
+
+    /* Sidecar index */
+    string sidecar = string(argv[1]) + ".idx";
+    mtar_index_save(&ar.index, sidecar.c_str(), argv[1]);
+    mtar_archive_close(&ar);
+    if (mtar_archive_open(&ar, argv[1], sidecar.c_str()) || ar.index.count != s_count)
+    {
+        printf("error: sidecar\n");
+        return 8;
+    }
+    mtar_archive_close(&ar);
+
+    /* Mapped archive, through the wrapper */
+    mtar_archive_wrap shared;
+    if (int error = shared.open_mmap(argv[1]))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 9;
+    }
+    if (int error = run_readers(shared.get()))
+    {
+        printf("error: mapped reader %d\n", error);
+        return 10;
+    }
+    if (shared.lookup("file-2.txt", &e) || shared.view(e, &ptr) ||
+        memcmp(ptr, content(2, size_of(2)).data(), e->size) != 0)
+    {
+        printf("error: view\n");
+        return 11;
+    }
+    mtar_wrap cursor;
+    mtar_header_t h;
+    cursor.open_archive(shared.get());
+    if (cursor.find("file-3.txt", &h) || h.size != content(3, size_of(3)).size())
+    {
+        printf("error: wrapped cursor\n");
+        return 12;
+    }
+    cursor.close();
+    shared.close();
+
+    puts("success");
+    return 0;
+}
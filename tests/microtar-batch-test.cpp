@@ -0,0 +1,144 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+static const int s_count = 500;
+static int s_completed;
+
+static size_t size_of(int i)
+{
+    return i * 97 % 20000;
+}
+
+static void on_done(mtar_request_t *req)
+{
+    s_completed++;
+    (void)req;
+}
+
+/* Fetch every member plus a missing one, checking each result */
+static int run_batch(const mtar_archive_t *ar, unsigned flags, const char *backend)
+{
+    mtar_batch_t *b;
+    vector<mtar_request_t> reqs(s_count + 1);
+    vector<string> names(s_count + 1);
+
+    if (mtar_batch_open(&b, ar, 32, flags))
+        return 1;
+    if (strcmp(mtar_batch_backend(b), backend) != 0)
+    {
+        printf("backend %s\n", mtar_batch_backend(b));
+        return 2;
+    }
+    for (int i = 0; i <= s_count; i++)
+    {
+        names[i] = (i == s_count) ? "missing.txt" : "member-" + to_string(i);
+        memset(&reqs[i], 0, sizeof(reqs[i]));
+        reqs[i].name = names[i].c_str();
+        reqs[i].done = on_done;
+    }
+    /* Half by name, half by index entry */
+    for (int i = 0; i < s_count / 2; i++)
+        mtar_index_lookup(&ar->index, names[i].c_str(), &reqs[i].entry);
+
+    s_completed = 0;
+    if (mtar_batch_submit(b, &reqs[0], 200) ||
+        mtar_batch_submit(b, &reqs[200], reqs.size() - 200))
+        return 3;
+    while (s_completed < (int)reqs.size())
+    {
+        if (mtar_batch_poll(b, 1) < 0)
+            return 4;
+    }
+    if (mtar_batch_poll(b, 1) != 0 || mtar_batch_wait(b))
+        return 5;
+    for (int i = 0; i < s_count; i++)
+    {
+        string expected = content(i, size_of(i));
+        if (reqs[i].err || reqs[i].entry->size != expected.size() ||
+            memcmp(reqs[i].data, expected.data(), expected.size()) != 0)
+            return 6;
+        free(reqs[i].data);
+    }
+    if (reqs[s_count].err != MTAR_ENOTFOUND)
+        return 7;
+
+    /* Buffers supplied by the caller, completed through wait alone */
+    char buf[4][20000];
+    for (int i = 0; i < 4; i++)
+    {
+        memset(&reqs[i], 0, sizeof(reqs[i]));
+        reqs[i].name = names[i * 100 + 7].c_str();
+        reqs[i].data = buf[i];
+    }
+    if (mtar_batch_submit(b, &reqs[0], 4) || mtar_batch_wait(b))
+        return 8;
+    for (int i = 0; i < 4; i++)
+    {
+        string expected = content(i * 100 + 7, size_of(i * 100 + 7));
+        if (reqs[i].err || memcmp(buf[i], expected.data(), expected.size()) != 0)
+            return 9;
+    }
+    mtar_batch_close(b);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_archive_t ar;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    mtar_open(&tar, argv[1], "w");
+    for (int i = 0; i < s_count; i++)
+    {
+        string data = content(i, size_of(i));
+        mtar_write_file_header(&tar, ("member-" + to_string(i)).c_str(), data.size());
+        mtar_write_data(&tar, data.data(), data.size());
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    if (int error = mtar_archive_open(&ar, argv[1], NULL))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 2;
+    }
+#ifdef __linux__
+    /* io_uring may be disabled, in which case the pool takes over */
+    mtar_batch_t *b;
+    mtar_batch_open(&b, &ar, 32, 0);
+    const char *native = mtar_batch_backend(b);
+    mtar_batch_close(b);
+    printf("native backend: %s\n", native);
+    if (int error = run_batch(&ar, 0, native))
+    {
+        printf("error: native batch %d\n", error);
+        return 3;
+    }
+#endif
+    if (int error = run_batch(&ar, MTAR_BATCH_NOURING, ar.fd >= 0 ? "threads" : "sync"))
+    {
+        printf("error: thread batch %d\n", error);
+        return 4;
+    }
+    mtar_archive_close(&ar);
+
+    mtar_archive_open_mmap(&ar, argv[1], NULL);
+    if (int error = run_batch(&ar, 0, "sync"))
+    {
+        printf("error: mapped batch %d\n", error);
+        return 5;
+    }
+    mtar_archive_close(&ar);
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include "microtar.h"
+#include <cstring>
+#include <string>
+using namespace std;
+
+struct counted_stream
+{
+    string data;
+    size_t pos;
+    int reads, writes, seeks;
+};
+
+static int counted_read(mtar_t *tar, void *data, size_t size)
+{
+    counted_stream *s = (counted_stream *)tar->stream;
+    if (s->pos + size > s->data.size())
+        return MTAR_EREADFAIL;
+    memcpy(data, &s->data[s->pos], size);
+    s->pos += size;
+    s->reads++;
+    return MTAR_ESUCCESS;
+}
+
+static int counted_write(mtar_t *tar, const void *data, size_t size)
+{
+    counted_stream *s = (counted_stream *)tar->stream;
+    s->data.append((const char *)data, size);
+    s->pos += size;
+    s->writes++;
+    return MTAR_ESUCCESS;
+}
+
+static int counted_seek(mtar_t *tar, size_t pos)
+{
+    counted_stream *s = (counted_stream *)tar->stream;
+    if (pos > s->data.size())
+        return MTAR_ESEEKFAIL;
+    s->pos = pos;
+    s->seeks++;
+    return MTAR_ESUCCESS;
+}
+
+static void open_counted(mtar_t *tar, counted_stream *s)
+{
+    memset(tar, 0, sizeof(*tar));
+    tar->read = counted_read;
+    tar->write = counted_write;
+    tar->seek = counted_seek;
+    tar->stream = s;
+    s->pos = 0;
+    s->reads = s->writes = s->seeks = 0;
+}
+
+static void write_members(mtar_t *tar, int count)
+{
+    mtar_header_t h;
+    char data[64];
+    for (int i = 0; i < count; i++)
+    {
+        memset(&h, 0, sizeof(h));
+        sprintf(h.name, "member-%d.txt", i);
+        sprintf(data, "%d", i * 13);
+        h.size = strlen(data);
+        h.mode = 0644;
+        h.type = MTAR_TREG;
+        mtar_write_header(tar, &h);
+        mtar_write_data(tar, data, h.size);
+    }
+    mtar_finalize(tar);
+}
+
+static int read_members(mtar_t *tar, int count)
+{
+    mtar_header_t h;
+    char data[64], expected[64];
+    for (int i = 0; i < count; i++)
+    {
+        if (mtar_read_header(tar, &h) || mtar_read_data(tar, data, h.size))
+            return 1;
+        sprintf(expected, "%d", i * 13);
+        if (h.size != strlen(expected) || memcmp(data, expected, h.size) != 0)
+            return 2;
+        mtar_next(tar);
+    }
+    if (mtar_read_header(tar, &h) != MTAR_ENULLRECORD)
+        return 3;
+    return 0;
+}
+
+int main(void)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    counted_stream plain, buffered;
+    const int count = 200;
+
+    /* Unbuffered reference */
+    open_counted(&tar, &plain);
+    write_members(&tar, count);
+    mtar_close(&tar);
+
+    /* Buffered output is identical and takes far fewer writes */
+    open_counted(&tar, &buffered);
+    if (int error = mtar_set_buffer(&tar, 64 * 1024))
+    {
+        printf("error: %d\n", error);
+        return 1;
+    }
+    write_members(&tar, count);
+    if (buffered.data != plain.data)
+    {
+        printf("error: data differs\n");
+        return 2;
+    }
+    if (buffered.writes > 4)
+    {
+        printf("error: %d writes\n", buffered.writes);
+        return 3;
+    }
+    mtar_close(&tar);
+
+    /* Buffered reads */
+    open_counted(&tar, &plain);
+    if (int error = read_members(&tar, count))
+    {
+        printf("error: unbuffered read %d\n", error);
+        return 4;
+    }
+    int plain_calls = plain.reads + plain.seeks;
+    open_counted(&tar, &plain);
+    mtar_set_buffer(&tar, 64 * 1024);
+    if (int error = read_members(&tar, count))
+    {
+        printf("error: buffered read %d\n", error);
+        return 5;
+    }
+    if ((plain.reads + plain.seeks) * 4 > plain_calls)
+    {
+        printf("error: %d calls, %d unbuffered\n", plain.reads + plain.seeks, plain_calls);
+        return 6;
+    }
+
+    /* Random access through the buffer */
+    if (mtar_find(&tar, "member-150.txt", &h) ||
+        mtar_find(&tar, "member-3.txt", &h))
+    {
+        printf("error: cannot find\n");
+        return 7;
+    }
+    char data[64];
+    if (mtar_read_data(&tar, data, h.size) || memcmp(data, "39", 2) != 0)
+    {
+        printf("error: bad data\n");
+        return 8;
+    }
+
+    /* A buffer can be dropped mid-archive */
+    mtar_next(&tar);
+    if (mtar_set_buffer(&tar, 0) || mtar_read_header(&tar, &h) ||
+        strcmp(h.name, "member-4.txt") != 0)
+    {
+        printf("error: cannot unbuffer\n");
+        return 9;
+    }
+    mtar_close(&tar);
+
+    /* Stream mode with read-ahead: one read per member */
+    open_counted(&tar, &plain);
+    tar.seek = NULL;
+    tar.flags = MTAR_FSTREAM;
+    mtar_set_buffer(&tar, 4096);
+    if (int error = read_members(&tar, count))
+    {
+        printf("error: stream read %d\n", error);
+        return 10;
+    }
+    if (plain.seeks || plain.reads > count + 1)
+    {
+        printf("error: %d reads\n", plain.reads);
+        return 11;
+    }
+    mtar_close(&tar);
+
+    puts("success");
+    return 0;
+}
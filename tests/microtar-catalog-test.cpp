@@ -0,0 +1,202 @@
+#include "microtar.h"
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+static const int s_archives = 20;
+static const int s_members = 200;
+
+static string archive_path(const string& dir, int a)
+{
+    char name[32];
+    sprintf(name, "/shard-%02d.tar", a);
+    return dir + name;
+}
+
+static string member(int a, int m)
+{
+    char name[64];
+    sprintf(name, "data/%02d/file-%04d.bin", a, m);
+    return name;
+}
+
+/* Every member is a few bytes, one archive has an extra member */
+static void write_archive(const string& path, int a, bool extra)
+{
+    mtar_t tar;
+    mtar_open(&tar, path.c_str(), "w");
+    for (int m = 0; m < s_members; m++)
+    {
+        string name = member(a, m);
+        mtar_write_file_header(&tar, name.c_str(), 10);
+        mtar_write_data(&tar, "0123456789", 10);
+    }
+    if (extra)
+    {
+        mtar_write_file_header(&tar, "extra.txt", 5);
+        mtar_write_data(&tar, "extra", 5);
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+}
+
+static vector<string> candidates(const mtar_catalog_t *cat, const char *name)
+{
+    vector<string> found;
+    mtar_summary_t s;
+    size_t pos = 0;
+    while (mtar_catalog_next(cat, name, &pos, &s) == MTAR_ESUCCESS)
+        found.push_back(s.path);
+    return found;
+}
+
+/* Lookups of members that exist, and of many that do not */
+static int check(const mtar_catalog_t *cat, const string& dir, size_t archives)
+{
+    mtar_archive_t ar;
+    const mtar_entry_t *e;
+    if (candidates(cat, NULL).size() != archives)
+        return 1;
+    for (int a = 0; a < s_archives; a += 7)
+    {
+        string name = member(a, a * 3);
+        vector<string> found = candidates(cat, name.c_str());
+        bool listed = false;
+        for (size_t i = 0; i < found.size(); i++)
+            listed |= found[i] == archive_path(dir, a);
+        if (!listed)
+            return 2;
+        if (mtar_catalog_locate(cat, name.c_str(), &ar, &e) || e->size != 10 ||
+            strcmp(mtar_entry_name(&ar.index, e), name.c_str()) != 0)
+            return 3;
+        mtar_archive_close(&ar);
+    }
+    size_t false_positives = 0;
+    for (int m = 0; m < 1000; m++)
+        false_positives += candidates(cat, member(99, m).c_str()).size();
+    if (false_positives > 1000 * archives / 20)
+        return 4;
+    if (mtar_catalog_locate(cat, member(99, 0).c_str(), &ar, &e) != MTAR_ENOTFOUND)
+        return 5;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_catalog_t cat;
+    mtar_summary_t s;
+    mtar_t tar;
+    mtar_index_t idx;
+    mtar_archive_t ar;
+    const mtar_entry_t *e;
+    size_t pos = 0;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const string dir = argv[1];
+    const string catalog = dir + "/shards.cat";
+    for (int a = 0; a < s_archives; a++)
+        write_archive(archive_path(dir, a), a, false);
+
+    /* In memory, from an index or by reading the archive */
+    mtar_catalog_init(&cat);
+    for (int a = 0; a < s_archives; a++)
+    {
+        string path = archive_path(dir, a);
+        int err;
+        if (a % 2)
+        {
+            mtar_open(&tar, path.c_str(), "r");
+            mtar_index_build(&tar, &idx);
+            mtar_close(&tar);
+            err = mtar_catalog_add(&cat, path.c_str(), &idx);
+            mtar_index_free(&idx);
+        }
+        else
+            err = mtar_catalog_add(&cat, path.c_str(), NULL);
+        if (err)
+        {
+            printf("error: %s\n", mtar_strerror(err));
+            return 2;
+        }
+    }
+    if (mtar_catalog_next(&cat, NULL, &pos, &s) || s.members != s_members ||
+        s.bytes != 10 * s_members)
+    {
+        printf("error: summary\n");
+        return 3;
+    }
+    if (int error = check(&cat, dir, s_archives))
+    {
+        printf("error: memory catalog %d\n", error);
+        return 4;
+    }
+
+    /* Saved, then loaded and mapped */
+    if (mtar_catalog_save(&cat, catalog.c_str()))
+    {
+        printf("error: save\n");
+        return 5;
+    }
+    mtar_catalog_free(&cat);
+    for (int mapped = 0; mapped < 2; mapped++)
+    {
+        int err = mapped ? mtar_catalog_load_mmap(&cat, catalog.c_str())
+                         : mtar_catalog_load(&cat, catalog.c_str());
+        if (err || check(&cat, dir, s_archives))
+        {
+            printf("error: loaded catalog %d\n", mapped);
+            return 6;
+        }
+        mtar_catalog_free(&cat);
+    }
+
+    /* A changed archive replaces its record in the file, a new one is added */
+    write_archive(archive_path(dir, 5), 5, true);
+    write_archive(archive_path(dir, s_archives), s_archives, false);
+    if (mtar_catalog_update(catalog.c_str(), archive_path(dir, 5).c_str(), NULL) ||
+        mtar_catalog_update(catalog.c_str(), archive_path(dir, s_archives).c_str(), NULL) ||
+        mtar_catalog_load_mmap(&cat, catalog.c_str()))
+    {
+        printf("error: update\n");
+        return 7;
+    }
+    if (cat.count != s_archives + 2 || check(&cat, dir, s_archives + 1) ||
+        mtar_catalog_locate(&cat, "extra.txt", &ar, &e) ||
+        strcmp(mtar_entry_name(&ar.index, e), "extra.txt") != 0)
+    {
+        printf("error: updated catalog\n");
+        return 8;
+    }
+    mtar_archive_close(&ar);
+
+    /* Adding to a mapped catalog copies it first; saving drops old records */
+    if (mtar_catalog_add(&cat, archive_path(dir, 0).c_str(), NULL) ||
+        candidates(&cat, NULL).size() != s_archives + 1 ||
+        mtar_catalog_save(&cat, catalog.c_str()))
+    {
+        printf("error: add to mapped catalog\n");
+        return 9;
+    }
+    mtar_catalog_free(&cat);
+    if (mtar_catalog_load(&cat, catalog.c_str()) || cat.count != s_archives + 1)
+    {
+        printf("error: compacted catalog\n");
+        return 10;
+    }
+    mtar_catalog_free(&cat);
+
+    /* Anything else is rejected */
+    if (mtar_catalog_load(&cat, archive_path(dir, 0).c_str()) != MTAR_EBADINDEX)
+    {
+        printf("error: not a catalog\n");
+        return 11;
+    }
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include "microtar.h"
+#include <cstring>
+#include <string>
+using namespace std;
+
+/* Counts calls and bytes outstanding */
+struct counting_allocator
+{
+    int allocs, reallocs, frees;
+    size_t live;
+};
+
+static void *counted_alloc(void *ctx, size_t size)
+{
+    counting_allocator *a = (counting_allocator *)ctx;
+    a->allocs++;
+    a->live += size;
+    return malloc(size);
+}
+
+static void *counted_realloc(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+    counting_allocator *a = (counting_allocator *)ctx;
+    a->reallocs++;
+    a->live += size - old_size;
+    return realloc(ptr, size);
+}
+
+static void counted_free(void *ctx, void *ptr, size_t size)
+{
+    counting_allocator *a = (counting_allocator *)ctx;
+    a->frees++;
+    a->live -= size;
+    free(ptr);
+}
+
+static size_t write_members(mtar_t *tar, int count)
+{
+    mtar_header_t h;
+    size_t total = 1024;
+    for (int i = 0; i < count; i++)
+    {
+        string data(i * 131 % 5000, (char)('A' + i % 26));
+        memset(&h, 0, sizeof(h));
+        sprintf(h.name, "chunk/member-%d.bin", i);
+        h.size = data.size();
+        h.mode = 0644;
+        h.mtime = 1500000000;
+        h.type = MTAR_TREG;
+        total += mtar_member_size(&h);
+        mtar_write_header(tar, &h);
+        mtar_write_data(tar, data.data(), data.size());
+    }
+    mtar_finalize(tar);
+    return total;
+}
+
+int main(void)
+{
+    mtar_t tar;
+    counting_allocator counts;
+    mtar_allocator_t allocator = { counted_alloc, counted_realloc, counted_free, &counts };
+    const int count = 300;
+
+    /* Reference output */
+    mtar_open_memory(&tar, NULL, 0);
+    size_t expected_size = write_members(&tar, count);
+    string reference((const char *)tar.memory, tar.memory_size);
+    mtar_close(&tar);
+    if (reference.size() != expected_size)
+    {
+        printf("error: member sizes add up to %d, not %d\n",
+               (int)expected_size, (int)reference.size());
+        return 1;
+    }
+
+    /* User allocator */
+    memset(&counts, 0, sizeof(counts));
+    mtar_open_memory(&tar, NULL, 0);
+    if (mtar_set_allocator(&tar, &allocator))
+    {
+        printf("error: cannot set allocator\n");
+        return 2;
+    }
+    write_members(&tar, count);
+    if (string((const char *)tar.memory, tar.memory_size) != reference ||
+        counts.allocs != 1 || counts.reallocs == 0)
+    {
+        printf("error: allocator output\n");
+        return 3;
+    }
+    if (mtar_set_allocator(&tar, NULL) != MTAR_EUNSUPPORTED)
+    {
+        printf("error: allocator changed after writing\n");
+        return 4;
+    }
+    mtar_close(&tar);
+    if (counts.live != 0 || counts.frees != 1)
+    {
+        printf("error: %d bytes leaked\n", (int)counts.live);
+        return 5;
+    }
+
+    /* Exact reservation: one allocation, no growth */
+    memset(&counts, 0, sizeof(counts));
+    mtar_open_memory(&tar, NULL, 0);
+    mtar_set_allocator(&tar, &allocator);
+    mtar_memory_reserve(&tar, expected_size);
+    write_members(&tar, count);
+    if (counts.allocs != 1 || counts.reallocs != 0 ||
+        tar.memory_capacity != expected_size ||
+        string((const char *)tar.memory, tar.memory_size) != reference)
+    {
+        printf("error: reserved output\n");
+        return 6;
+    }
+    mtar_close(&tar);
+
+    /* Chunked output, gathered from the iovec array */
+    memset(&counts, 0, sizeof(counts));
+    mtar_open_memory(&tar, NULL, 0);
+    mtar_set_allocator(&tar, &allocator);
+    if (mtar_set_chunked(&tar, 4096))
+    {
+        printf("error: cannot chunk\n");
+        return 7;
+    }
+    write_members(&tar, count);
+    const mtar_iovec_t *iov;
+    size_t n;
+    if (mtar_memory_chunks(&tar, &iov, &n) || tar.memory)
+    {
+        printf("error: no chunks\n");
+        return 8;
+    }
+    string gathered;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i + 1 < n && iov[i].iov_len != 4096)
+        {
+            printf("error: short chunk %d\n", (int)i);
+            return 9;
+        }
+        gathered.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+    if (gathered != reference || counts.reallocs > 8)
+    {
+        printf("error: chunked output\n");
+        return 10;
+    }
+
+    /* Overwriting across a chunk boundary */
+    char patch[100];
+    memset(patch, 'x', sizeof(patch));
+    mtar_seek(&tar, 4096 - 50);
+    tar.write(&tar, patch, sizeof(patch));
+    if (memcmp((const char *)iov[0].iov_base + 4046, patch, 50) != 0 ||
+        memcmp(iov[1].iov_base, patch, 50) != 0 || iov[0].iov_len != 4096)
+    {
+        printf("error: patch\n");
+        return 11;
+    }
+    mtar_close(&tar);
+    if (counts.live != 0)
+    {
+        printf("error: %d bytes leaked\n", (int)counts.live);
+        return 12;
+    }
+
+    puts("success");
+    return 0;
+}
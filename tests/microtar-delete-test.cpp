@@ -0,0 +1,185 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+static void add(mtar_t *tar, const string& name, const string& data)
+{
+    mtar_write_file_header(tar, name.c_str(), data.size());
+    mtar_write_data(tar, data.data(), data.size());
+}
+
+/* Every member in order, tombstones marked with a '-' */
+static vector<string> list(const string& filename)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    vector<string> found;
+    mtar_open(&tar, filename.c_str(), "r");
+    while (mtar_read_header(&tar, &h) == MTAR_ESUCCESS)
+    {
+        found.push_back((h.type == MTAR_TDELETED ? "-" : "") + string(h.name));
+        mtar_next(&tar);
+    }
+    mtar_close(&tar);
+    return found;
+}
+
+/* What mtar_find() sees, with and without an index */
+static int check(const string& filename, const string& b)
+{
+    mtar_t tar;
+    mtar_index_t idx;
+    mtar_header_t h;
+    char buf[2000];
+    mtar_open(&tar, filename.c_str(), "r");
+    for (int indexed = 0; indexed < 2; indexed++)
+    {
+        if (indexed && mtar_index_build(&tar, &idx))
+            return 1;
+        if (mtar_find(&tar, "a.txt", &h) != MTAR_ENOTFOUND)
+            return 2;
+        if (mtar_find(&tar, "b.txt", &h) || h.size != b.size() ||
+            mtar_read_data(&tar, buf, h.size) || string(buf, h.size) != b)
+            return 3;
+        if (mtar_find(&tar, "c.txt", &h) || h.size != 10)
+            return 4;
+    }
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_index_t idx;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const string filename = argv[1];
+    const string compacted = filename + ".compacted";
+    const string b1(600, 'b'), b2(1500, 'B');
+    remove(filename.c_str());
+
+    mtar_open(&tar, filename.c_str(), "w");
+    add(&tar, "a.txt", string(100, 'a'));
+    add(&tar, "b.txt", b1);
+    add(&tar, "c.txt", string(10, 'c'));
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+    const size_t original = load(filename).size();
+
+    /* Replacing appends a new version, deleting appends a tombstone */
+    mtar_index_init(&idx);
+    mtar_open_append(&tar, filename.c_str(), &idx);
+    add(&tar, "b.txt", b2);
+    if (int error = mtar_delete(&tar, "a.txt"))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 2;
+    }
+    if (mtar_delete(&tar, "a.txt") != MTAR_ENOTFOUND ||
+        mtar_delete(&tar, "missing.txt") != MTAR_ENOTFOUND)
+    {
+        printf("error: deleted twice\n");
+        return 3;
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+    if (list(filename) != vector<string>{ "a.txt", "b.txt", "c.txt", "b.txt", "-a.txt" } ||
+        load(filename).size() != original + 512 * 7)
+    {
+        printf("error: appended members\n");
+        return 4;
+    }
+    if (int error = check(filename, b2))
+    {
+        printf("error: find %d\n", error);
+        return 5;
+    }
+
+    /* Old a.txt and b.txt, and the three records of the tombstone */
+    if (mtar_index_dead(&idx) != 1024 + 1536 + 1536)
+    {
+        printf("error: %d bytes dead\n", (int)mtar_index_dead(&idx));
+        return 6;
+    }
+    mtar_index_free(&idx);
+
+    /* Live members are copied in archive order */
+    if (int error = mtar_compact(filename.c_str(), compacted.c_str()))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 7;
+    }
+    if (list(compacted) != vector<string>{ "c.txt", "b.txt" } ||
+        load(compacted).size() != 512 * 2 + 512 * 4 + 1024 || check(compacted, b2))
+    {
+        printf("error: compacted archive\n");
+        return 8;
+    }
+    mtar_open(&tar, compacted.c_str(), "r");
+    mtar_index_build(&tar, &idx);
+    mtar_close(&tar);
+    if (mtar_index_dead(&idx) != 0)
+    {
+        printf("error: dead space after compaction\n");
+        return 9;
+    }
+    mtar_index_free(&idx);
+
+    /* In place */
+    if (mtar_compact(filename.c_str(), NULL) || load(filename) != load(compacted) ||
+        load(filename + ".compact") != "<missing>")
+    {
+        printf("error: compaction in place\n");
+        return 10;
+    }
+
+    /* Without an index the archive is read back for the name */
+    mtar_open(&tar, filename.c_str(), "a");
+    add(&tar, "d.txt", "d");
+    if (mtar_delete(&tar, "missing.txt") != MTAR_ENOTFOUND ||
+        mtar_delete(&tar, "b.txt") || mtar_delete(&tar, "b.txt") != MTAR_ENOTFOUND ||
+        mtar_delete(&tar, "c.txt") || mtar_delete(&tar, "d.txt"))
+    {
+        printf("error: delete without index\n");
+        return 11;
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    /* Deleting everything leaves an empty archive */
+    if (mtar_compact(filename.c_str(), NULL) || load(filename).size() != 1024)
+    {
+        printf("error: empty compaction\n");
+        return 12;
+    }
+
+    /* Without end records the archive ends after its last member */
+    const string open = filename + ".open";
+    mtar_header_t h;
+    char buf[3];
+    mtar_open(&tar, open.c_str(), "w");
+    add(&tar, "a.txt", "abc");
+    add(&tar, "b.txt", "b");
+    mtar_close(&tar);
+    mtar_open(&tar, open.c_str(), "r");
+    if (mtar_find(&tar, "a.txt", &h) || h.size != 3 || mtar_read_data(&tar, buf, 3) ||
+        string(buf, 3) != "abc" || mtar_find(&tar, "b.txt", &h) || h.size != 1 ||
+        mtar_find(&tar, "c.txt", &h) == MTAR_ESUCCESS)
+    {
+        printf("error: archive without end records\n");
+        return 13;
+    }
+    mtar_close(&tar);
+
+    puts("success");
+    return 0;
+}
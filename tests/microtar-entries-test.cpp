@@ -0,0 +1,135 @@
+#include "mtar_wrap.hpp"
+#include "microtar-test.hpp"
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+static size_t size_of(int i)
+{
+    return i * 97 % 700;
+}
+
+/* Files, one directory and one symlink */
+static void write_members(mtar_wrap& tar)
+{
+    mtar_header_t h;
+    char name[64];
+    for (int i = 0; i < 50; i++)
+    {
+        string data = content(i, size_of(i));
+        sprintf(name, "dir/file-%02d.%s", i, i % 3 ? "txt" : "bin");
+        tar.write_file_header(name, data.size());
+        tar.write_data(data.data(), data.size());
+    }
+    tar.write_dir_header("dir");
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, "dir/link");
+    strcpy(h.linkname, "file-01.txt");
+    h.type = MTAR_TSYM;
+    h.mode = 0777;
+    tar.write_header(&h);
+    tar.finalize();
+}
+
+static int check_entries(mtar_wrap& tar, bool in_memory)
+{
+    mtar_wrap::entry_range entries = tar.entries();
+    if (entries.error() || entries.size() != 52)
+        return 1;
+    int i = 0;
+    char name[64];
+    vector<char> buf(1000);
+    for (mtar_wrap::entry e : entries)
+    {
+        if (i < 50)
+        {
+            string data = content(i, size_of(i));
+            sprintf(name, "dir/file-%02d.%s", i, i % 3 ? "txt" : "bin");
+            if (e.name() != name || e.size() != data.size() || e.type() != MTAR_TREG ||
+                !e.linkname().empty())
+                return 2;
+            if (in_memory ? e.data() != data : !e.data().empty())
+                return 3;
+            if (e.read_data(&buf[0], e.size()) || string(&buf[0], e.size()) != data)
+                return 4;
+        }
+        i++;
+    }
+    mtar_wrap::entry link = *++find_if(entries.begin(), entries.end(),
+        [](mtar_wrap::entry e) { return e.type() == MTAR_TDIR; });
+    if (link.name() != "dir/link" || link.linkname() != "file-01.txt")
+        return 5;
+#ifdef __cpp_lib_ranges
+    auto texts = entries | std::views::filter([](mtar_wrap::entry e) {
+        return e.type() == MTAR_TREG && e.name().ends_with(".txt");
+    });
+    if (std::ranges::distance(texts) != 33)
+        return 6;
+#endif
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const char *filename = argv[1];
+
+    mtar_wrap writer;
+    writer.open_memory(NULL, 0);
+    write_members(writer);
+    string archive((const char *)writer.memory(), writer.memory_size());
+    writer.close();
+
+    /* In memory, data is viewed in place */
+    mtar_wrap tar;
+    tar.open_memory(&archive[0], archive.size());
+    if (int error = check_entries(tar, true))
+    {
+        printf("error: memory entries %d\n", error);
+        return 2;
+    }
+
+    /* Moving keeps the index working */
+    mtar_wrap moved(std::move(tar));
+    const mtar_entry_t *e;
+    if (tar.is_open() || tar.index() || !moved.is_open() ||
+        moved.lookup("dir/file-07.txt", &e) || moved.entries().size() != 52)
+    {
+        printf("error: move\n");
+        return 3;
+    }
+    tar = std::move(moved);
+    if (int error = check_entries(tar, true))
+    {
+        printf("error: moved entries %d\n", error);
+        return 4;
+    }
+
+    /* From a file, data is read */
+    FILE *fp = fopen(filename, "wb");
+    fwrite(archive.data(), 1, archive.size(), fp);
+    fclose(fp);
+    tar.open(filename, "r");
+    if (int error = check_entries(tar, false))
+    {
+        printf("error: file entries %d\n", error);
+        return 5;
+    }
+    tar.close();
+
+    /* Nothing to iterate */
+    if (tar.entries().error() != MTAR_EFAILURE || !tar.entries().empty())
+    {
+        printf("error: closed entries\n");
+        return 6;
+    }
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+static size_t size_of(int i)
+{
+    return i * 37 % 3000;
+}
+
+static void add_file(mtar_t *tar, const string& name, const string& data)
+{
+    mtar_write_file_header(tar, name.c_str(), data.size());
+    mtar_write_data(tar, data.data(), data.size());
+}
+
+static void add_link(mtar_t *tar, const char *name, const char *target, unsigned type)
+{
+    mtar_header_t h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, name);
+    strcpy(h.linkname, target);
+    h.type = type;
+    h.mode = 0777;
+    mtar_write_header(tar, &h);
+}
+
+static void add_special(mtar_t *tar, const char *name, unsigned type, unsigned mode)
+{
+    mtar_header_t h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, name);
+    h.type = type;
+    h.mode = mode;
+    mtar_write_header(tar, &h);
+}
+
+static bool save(mtar_t *tar, const string& filename)
+{
+    mtar_finalize(tar);
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(tar->memory, 1, tar->memory_size, fp) == tar->memory_size;
+    fclose(fp);
+    mtar_close(tar);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    char name[64];
+    const int count = 300;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const string dir = argv[1];
+    const string archive = dir + ".tar";
+    const string dest = dir + "/out";
+    mkdir(dir.c_str(), 0777);
+
+    /* Files with and without directory entries, a replaced member, links */
+    mtar_open_memory(&tar, NULL, 0);
+    mtar_write_dir_header(&tar, "./top");
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(name, "top/sub-%d/file-%d.txt", i % 7, i);
+        add_file(&tar, name, content(i, size_of(i)));
+    }
+    add_file(&tar, "top/replaced.txt", "old");
+    add_link(&tar, "top/sym", "sub-0/file-0.txt", MTAR_TSYM);
+    add_link(&tar, "top/hard", "top/replaced.txt", MTAR_TLNK);
+    add_file(&tar, "top/replaced.txt", "new");
+    add_file(&tar, string(60, 'd') + "/" + string(150, 'f'), "long");
+    if (!save(&tar, archive))
+    {
+        printf("error: cannot save\n");
+        return 2;
+    }
+
+    if (int error = mtar_extract_parallel(archive.c_str(), dest.c_str(), 4, 0))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 3;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(name, "/top/sub-%d/file-%d.txt", i % 7, i);
+        if (load(dest + name) != content(i, size_of(i)))
+        {
+            printf("error: bad %s\n", name);
+            return 4;
+        }
+    }
+    if (load(dest + "/top/replaced.txt") != "new" || load(dest + "/top/hard") != "new")
+    {
+        printf("error: replaced member\n");
+        return 5;
+    }
+    char target[64];
+    ssize_t n = readlink((dest + "/top/sym").c_str(), target, sizeof(target));
+    if (n != 16 || memcmp(target, "sub-0/file-0.txt", 16) != 0 ||
+        load(dest + "/top/sym") != content(0, size_of(0)))
+    {
+        printf("error: symlink\n");
+        return 6;
+    }
+    if (load(dest + "/" + string(60, 'd') + "/" + string(150, 'f')) != "long")
+    {
+        printf("error: long name\n");
+        return 7;
+    }
+
+    /* Serial extraction gives the same result */
+    if (mtar_extract_parallel(archive.c_str(), (dir + "/serial").c_str(), 1, 0) ||
+        load(dir + "/serial/top/sub-3/file-10.txt") != content(10, size_of(10)))
+    {
+        printf("error: serial extraction\n");
+        return 8;
+    }
+
+    /* Members may not leave the destination */
+    const char *bad[] = { "../escaped.txt", "/tmp/escaped.txt", "a/../../escaped.txt" };
+    for (int i = 0; i < 3; i++)
+    {
+        mtar_open_memory(&tar, NULL, 0);
+        add_file(&tar, "harmless.txt", "x");
+        add_file(&tar, bad[i], "x");
+        save(&tar, archive);
+        if (mtar_extract_parallel(archive.c_str(), (dir + "/bad").c_str(), 2, 0) != MTAR_EBADPATH)
+        {
+            printf("error: accepted %s\n", bad[i]);
+            return 9;
+        }
+    }
+    if (load(dir + "/bad/harmless.txt") != "<missing>")
+    {
+        printf("error: extracted part of an unsafe archive\n");
+        return 10;
+    }
+
+    /* Nothing is written through a symlink from the archive */
+    mtar_open_memory(&tar, NULL, 0);
+    add_link(&tar, "escape", "..", MTAR_TSYM);
+    add_file(&tar, "escape/through.txt", "x");
+    save(&tar, archive);
+    mtar_extract_parallel(archive.c_str(), (dir + "/sym").c_str(), 2, 0);
+    if (load(dir + "/through.txt") != "<missing>")
+    {
+        printf("error: wrote through symlink\n");
+        return 11;
+    }
+
+    /* Nor through one already in the destination, as a directory or link */
+    const string outside = dir + "/outside";
+    mkdir(outside.c_str(), 0777);
+    mkdir((dir + "/pre").c_str(), 0777);
+    symlink(outside.c_str(), (dir + "/pre/a").c_str());
+    const char *through[] = { "a/x.txt", "a/sub/x.txt" };
+    for (int i = 0; i < 2; i++)
+    {
+        mtar_open_memory(&tar, NULL, 0);
+        add_file(&tar, through[i], "x");
+        save(&tar, archive);
+        if (mtar_extract_parallel(archive.c_str(), (dir + "/pre").c_str(), 2, 0) != MTAR_EBADPATH)
+        {
+            printf("error: accepted %s through an existing symlink\n", through[i]);
+            return 12;
+        }
+    }
+    FILE *fp = fopen((outside + "/secret.txt").c_str(), "wb");
+    fclose(fp);
+    mtar_open_memory(&tar, NULL, 0);
+    add_link(&tar, "copy", "a/secret.txt", MTAR_TLNK);
+    save(&tar, archive);
+    if (mtar_extract_parallel(archive.c_str(), (dir + "/pre").c_str(), 2, 0) != MTAR_EBADPATH ||
+        load(outside + "/x.txt") != "<missing>" || load(outside + "/sub/x.txt") != "<missing>" ||
+        load(dir + "/pre/copy") != "<missing>")
+    {
+        printf("error: resolved a name outside the destination\n");
+        return 13;
+    }
+
+    /* Special bits need opting in, device nodes are reported */
+    struct stat st;
+    mtar_open_memory(&tar, NULL, 0);
+    add_special(&tar, "setuid", MTAR_TREG, 04755);
+    save(&tar, archive);
+    if (mtar_extract_parallel(archive.c_str(), (dir + "/perms").c_str(), 2, 0) ||
+        stat((dir + "/perms/setuid").c_str(), &st) || (st.st_mode & 07777) != 0755 ||
+        mtar_extract_parallel(archive.c_str(), (dir + "/perms").c_str(), 2, MTAR_EXTRACT_PERMS) ||
+        stat((dir + "/perms/setuid").c_str(), &st) || (st.st_mode & 07777) != 04755)
+    {
+        printf("error: special bits\n");
+        return 14;
+    }
+    mtar_open_memory(&tar, NULL, 0);
+    add_file(&tar, "before.txt", "x");
+    add_special(&tar, "null", MTAR_TCHR, 0666);
+    save(&tar, archive);
+    remove((dir + "/dev/before.txt").c_str());
+    if (mtar_extract_parallel(archive.c_str(), (dir + "/dev").c_str(), 2, 0) != MTAR_EUNSUPPORTED ||
+        load(dir + "/dev/before.txt") != "<missing>" ||
+        mtar_extract_parallel(archive.c_str(), (dir + "/dev").c_str(), 2, MTAR_EXTRACT_SKIPDEV) ||
+        load(dir + "/dev/before.txt") != "x" || load(dir + "/dev/null") != "<missing>")
+    {
+        printf("error: device node\n");
+        return 15;
+    }
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+using namespace std;
+
+static void save(const string& filename, const string& data)
+{
+    FILE *fp = fopen(filename.c_str(), "wb");
+    fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+}
+
+static mtar_header_t make_header(const char *name, size_t size)
+{
+    mtar_header_t h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, name);
+    h.size = size;
+    h.mode = 0644;
+    h.mtime = 1500000000;
+    h.type = MTAR_TREG;
+    return h;
+}
+
+/* Two members around one ingested from a file descriptor */
+static int write_archive(mtar_t *tar, const string& source, const string& data,
+                         bool from_fd)
+{
+    mtar_header_t h = make_header("before.txt", 5);
+    mtar_write_header(tar, &h);
+    mtar_write_data(tar, "12345", 5);
+    h = make_header("big.bin", data.size());
+    mtar_write_header(tar, &h);
+    if (from_fd)
+    {
+        int fd = open(source.c_str(), O_RDONLY);
+        int err = mtar_write_data_from_fd(tar, fd, data.size());
+        close(fd);
+        if (err)
+            return err;
+    }
+    else
+    {
+        mtar_write_data(tar, data.data(), data.size());
+    }
+    h = make_header("after.txt", 3);
+    mtar_write_header(tar, &h);
+    mtar_write_data(tar, "abc", 3);
+    return mtar_finalize(tar);
+}
+
+/* Extracts "big.bin" to a file and checks the archive is still at it */
+static int extract(mtar_t *tar, const string& filename, const string& data)
+{
+    mtar_header_t h;
+    if (mtar_find(tar, "big.bin", &h))
+        return 1;
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int err = mtar_read_data_to_fd(tar, fd);
+    close(fd);
+    if (err || load(filename) != data)
+        return 2;
+    if (mtar_read_header(tar, &h) || strcmp(h.name, "big.bin") != 0 ||
+        mtar_next(tar) || mtar_read_header(tar, &h) ||
+        strcmp(h.name, "after.txt") != 0)
+        return 3;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_archive_t ar;
+    mtar_header_t h;
+    int fds[2];
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const string dir = argv[1];
+    mkdir(dir.c_str(), 0777);
+
+    string data;
+    for (int i = 0; i < 300000; i++)
+        data += (char)(i * 7 + i / 1000);
+    const string source = dir + "/source.bin";
+    save(source, data);
+
+    /* Reference archive from the ordinary writer */
+    const string reference = dir + "/reference.tar";
+    mtar_open(&tar, reference.c_str(), "w");
+    write_archive(&tar, source, data, false);
+    mtar_close(&tar);
+
+    /* From a file, with and without a buffer, and into memory */
+    const string archive = dir + "/fd.tar";
+    for (int buffered = 0; buffered < 2; buffered++)
+    {
+        mtar_open(&tar, archive.c_str(), "w");
+        if (buffered)
+            mtar_set_buffer(&tar, 4096);
+        if (int error = write_archive(&tar, source, data, true))
+        {
+            printf("error: %s\n", mtar_strerror(error));
+            return 2;
+        }
+        mtar_close(&tar);
+        if (load(archive) != load(reference))
+        {
+            printf("error: archive differs, buffered %d\n", buffered);
+            return 3;
+        }
+    }
+    mtar_open_memory(&tar, NULL, 0);
+    if (write_archive(&tar, source, data, true) ||
+        string((const char *)tar.memory, tar.memory_size) != load(reference))
+    {
+        printf("error: memory archive differs\n");
+        return 4;
+    }
+    mtar_close(&tar);
+
+    /* From a pipe, header included */
+    const string piped = dir + "/piped.tar";
+    if (pipe(fds) != 0 || write(fds[1], data.data(), 4000) != 4000)
+        return 5;
+    close(fds[1]);
+    mtar_open(&tar, piped.c_str(), "w");
+    if (mtar_write_file_from_fd(&tar, "piped.bin", fds[0], 4000) ||
+        mtar_finalize(&tar))
+    {
+        printf("error: piped input\n");
+        return 6;
+    }
+    mtar_close(&tar);
+    close(fds[0]);
+    mtar_open(&tar, piped.c_str(), "r");
+    char buf[4000];
+    if (mtar_find(&tar, "piped.bin", &h) || h.size != 4000 ||
+        mtar_read_data(&tar, buf, 4000) || memcmp(buf, data.data(), 4000) != 0)
+    {
+        printf("error: piped member\n");
+        return 7;
+    }
+    mtar_close(&tar);
+
+    /* Running out of source data */
+    mtar_open(&tar, piped.c_str(), "w");
+    int fd = open(source.c_str(), O_RDONLY);
+    if (mtar_write_file_from_fd(&tar, "short.bin", fd, data.size() + 1) != MTAR_EREADFAIL)
+    {
+        printf("error: short source\n");
+        return 8;
+    }
+    close(fd);
+    mtar_close(&tar);
+
+    /* To files, from each kind of backend */
+    const string extracted = dir + "/extracted.bin";
+    mtar_open(&tar, archive.c_str(), "r");
+    if (int error = extract(&tar, extracted, data))
+    {
+        printf("error: file extraction %d\n", error);
+        return 9;
+    }
+    mtar_close(&tar);
+    mtar_open(&tar, archive.c_str(), "r");
+    mtar_set_buffer(&tar, 4096);
+    if (int error = extract(&tar, extracted, data))
+    {
+        printf("error: buffered extraction %d\n", error);
+        return 10;
+    }
+    mtar_close(&tar);
+    mtar_open_mmap(&tar, archive.c_str());
+    if (int error = extract(&tar, extracted, data))
+    {
+        printf("error: mapped extraction %d\n", error);
+        return 11;
+    }
+    mtar_close(&tar);
+    mtar_archive_open(&ar, archive.c_str(), NULL);
+    mtar_open_archive(&tar, &ar);
+    if (int error = extract(&tar, extracted, data))
+    {
+        printf("error: cursor extraction %d\n", error);
+        return 12;
+    }
+    mtar_close(&tar);
+    mtar_archive_close(&ar);
+
+    /* From a stream, partly read already */
+    mtar_open_stream(&tar, fopen(archive.c_str(), "rb"));
+    mtar_next(&tar);
+    fd = open(extracted.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (mtar_read_header(&tar, &h) || mtar_read_data(&tar, buf, 100) ||
+        mtar_read_data_to_fd(&tar, fd) || load(extracted) != data.substr(100) ||
+        mtar_next(&tar) || mtar_read_header(&tar, &h) ||
+        strcmp(h.name, "after.txt") != 0)
+    {
+        printf("error: stream extraction\n");
+        return 13;
+    }
+    close(fd);
+    mtar_close(&tar);
+
+    /* To a pipe */
+    mtar_open(&tar, piped.c_str(), "w");
+    mtar_write_file_header(&tar, "small.bin", 3000);
+    mtar_write_data(&tar, data.data(), 3000);
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+    mtar_open(&tar, piped.c_str(), "r");
+    if (pipe(fds) != 0 || mtar_read_data_to_fd(&tar, fds[1]) ||
+        read(fds[0], buf, sizeof(buf)) != 3000 || memcmp(buf, data.data(), 3000) != 0)
+    {
+        printf("error: piped output\n");
+        return 14;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    mtar_close(&tar);
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+/* Members as the parser reports them */
+struct member_t
+{
+    string name;
+    unsigned type;
+    size_t size;
+    string data;
+    bool ended;
+};
+
+static int on_header(mtar_parser_t *p, const mtar_header_t *h)
+{
+    vector<member_t> *found = (vector<member_t> *)p->user;
+    if (!found->empty() && !found->back().ended)
+        return MTAR_EFAILURE;
+    member_t m = { mtar_header_name(h), h->type, h->size, "", false };
+    found->push_back(m);
+    return MTAR_ESUCCESS;
+}
+
+static int on_data(mtar_parser_t *p, const void *data, size_t size)
+{
+    member_t& m = ((vector<member_t> *)p->user)->back();
+    if (m.ended)
+        return MTAR_EFAILURE;
+    if (!size)
+        m.ended = true;
+    else
+        m.data.append((const char *)data, size);
+    return MTAR_ESUCCESS;
+}
+
+/* Feeds the archive in pieces of 1 to max bytes, 0 meaning all at once */
+static int parse(const string& archive, size_t max, vector<member_t> *found)
+{
+    mtar_parser_t p;
+    mtar_parser_init(&p);
+    p.on_header = on_header;
+    p.on_data = on_data;
+    p.user = found;
+    for (size_t i = 0; i < archive.size();)
+    {
+        size_t n = max ? 1 + rand() % max : archive.size();
+        if (n > archive.size() - i)
+            n = archive.size() - i;
+        if (int error = mtar_feed(&p, &archive[i], n))
+        {
+            mtar_parser_finish(&p);
+            return error;
+        }
+        i += n;
+    }
+    return mtar_parser_finish(&p);
+}
+
+/* What the regular reader sees */
+static vector<member_t> read_all(string& archive)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    vector<member_t> found;
+    mtar_open_memory(&tar, &archive[0], archive.size());
+    while (mtar_read_header(&tar, &h) == MTAR_ESUCCESS)
+    {
+        member_t m = { mtar_header_name(&h), h.type, (size_t)h.size,
+                       string((size_t)h.size, '\0'), true };
+        if (h.size)
+            mtar_read_data(&tar, &m.data[0], h.size);
+        found.push_back(m);
+        mtar_next(&tar);
+    }
+    mtar_close(&tar);
+    return found;
+}
+
+static bool same(const vector<member_t>& a, const vector<member_t>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (a[i].name != b[i].name || a[i].type != b[i].type || a[i].size != b[i].size ||
+            a[i].data != b[i].data || a[i].ended != b[i].ended)
+            return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    vector<member_t> expected, found;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const char *filename = argv[1];
+    srand(1);
+
+    /* Short and long names, empty members and a directory */
+    const string long_name = "deep/" + string(180, 'n') + "/file.txt";
+    mtar_open(&tar, filename, "w");
+    mtar_write_file_header(&tar, "a.txt", 5);
+    mtar_write_data(&tar, "hello", 5);
+    mtar_write_file_header(&tar, "empty.txt", 0);
+    mtar_write_dir_header(&tar, "dir");
+    mtar_write_file_header(&tar, long_name.c_str(), 1000);
+    mtar_write_data(&tar, string(1000, 'L').data(), 1000);
+    mtar_write_file_header(&tar, "b.bin", 2048);
+    mtar_write_data(&tar, string(2048, 'b').data(), 2048);
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    string archive = load(filename);
+    expected = read_all(archive);
+    if (expected.size() != 5 || expected[3].name != long_name)
+    {
+        printf("error: reader found %d members\n", (int)expected.size());
+        return 2;
+    }
+
+    /* Every fragmentation yields the same members */
+    const size_t sizes[] = { 0, 1, 7, 511, 513, 4096 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        found.clear();
+        if (int error = parse(archive, sizes[i], &found))
+        {
+            printf("error: pieces of %d: %s\n", (int)sizes[i], mtar_strerror(error));
+            return 3;
+        }
+        if (!same(found, expected))
+        {
+            printf("error: pieces of %d: different members\n", (int)sizes[i]);
+            return 4;
+        }
+    }
+
+    /* Garbage after the end marker is ignored */
+    found.clear();
+    if (parse(archive + string(100, 'x'), 64, &found) || !same(found, expected))
+    {
+        printf("error: trailing bytes\n");
+        return 5;
+    }
+
+    /* Truncated in the middle of a header and of the data */
+    found.clear();
+    if (parse(archive.substr(0, 300), 64, &found) != MTAR_EREADFAIL ||
+        parse(archive.substr(0, 512 + 3), 64, &found) != MTAR_EREADFAIL)
+    {
+        printf("error: truncation not detected\n");
+        return 6;
+    }
+
+    /* Damaged headers stop the parser */
+    string damaged = archive;
+    damaged[10] ^= 1;
+    found.clear();
+    if (parse(damaged, 100, &found) != MTAR_EBADCHKSUM || !found.empty())
+    {
+        printf("error: damaged header\n");
+        return 7;
+    }
+
+    /* Callbacks can stop it too, and the error sticks */
+    mtar_parser_t p;
+    mtar_parser_init(&p);
+    p.on_header = on_header;
+    p.on_data = on_data;
+    p.user = &found;
+    found.clear();
+    found.push_back(member_t());
+    if (mtar_feed(&p, archive.data(), archive.size()) != MTAR_EFAILURE ||
+        mtar_feed(&p, "", 1) != MTAR_EFAILURE || mtar_parser_finish(&p) != MTAR_EFAILURE)
+    {
+        printf("error: callback error\n");
+        return 8;
+    }
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <zlib.h>
+#include <cstring>
+#include <string>
+using namespace std;
+
+static const int s_count = 300;
+
+static size_t size_of(int i)
+{
+    return i * 173 % 9000;
+}
+
+/* Decompressed the way gzip does it, all members in a row */
+static string gunzip(const string& filename)
+{
+    string data;
+    char buf[4096];
+    gzFile gz = gzopen(filename.c_str(), "rb");
+    int n;
+    while ((n = gzread(gz, buf, sizeof(buf))) > 0)
+        data.append(buf, n);
+    gzclose(gz);
+    return data;
+}
+
+/* Output stays seekable to its end, however many frames are in flight */
+static int write_members(mtar_t *tar)
+{
+    mtar_header_t h;
+    for (int i = 0; i < s_count; i++)
+    {
+        string data = content(i, size_of(i));
+        memset(&h, 0, sizeof(h));
+        sprintf(h.name, "gz/member-%d.txt", i);
+        h.size = data.size();
+        h.mode = 0644;
+        h.mtime = 1500000000;
+        h.type = MTAR_TREG;
+        mtar_write_header(tar, &h);
+        mtar_write_data(tar, data.data(), data.size());
+        if (mtar_seek(tar, tar->pos))
+            return MTAR_ESEEKFAIL;
+    }
+    return mtar_finalize(tar);
+}
+
+/* Finds members out of order and checks their data */
+static int read_members(mtar_t *tar, int step)
+{
+    mtar_header_t h;
+    char name[64];
+    static char data[9000];
+    for (int k = 0; k < s_count; k++)
+    {
+        int i = k * step % s_count;
+        string expected = content(i, size_of(i));
+        sprintf(name, "gz/member-%d.txt", i);
+        if (mtar_find(tar, name, &h) || h.size != expected.size() ||
+            mtar_read_data(tar, data, h.size) ||
+            memcmp(data, expected.data(), h.size) != 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_index_t idx;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const string plain = string(argv[1]) + ".tar";
+    const string framed = string(argv[1]) + ".tar.gz";
+    const string gzipped = string(argv[1]) + "-plain.tar.gz";
+
+    mtar_open(&tar, plain.c_str(), "w");
+    write_members(&tar);
+    mtar_close(&tar);
+    if (int error = mtar_open_gz(&tar, framed.c_str(), "w6"))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 2;
+    }
+    write_members(&tar);
+    if (mtar_close(&tar))
+    {
+        printf("error: close\n");
+        return 3;
+    }
+    const string reference = load(plain);
+    if (gunzip(framed) != reference || load(framed).size() >= reference.size())
+    {
+        printf("error: not a gzip of the archive\n");
+        return 4;
+    }
+
+    /* Compressed by threads, frame for frame the same */
+    const string threaded = string(argv[1]) + "-threads.tar.gz";
+    mtar_open_gz_fp(&tar, fopen(threaded.c_str(), "wb"), "w6");
+    if (int error = mtar_set_threads(&tar, 4))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 11;
+    }
+    if (int error = write_members(&tar))
+    {
+        printf("error: threads: %s\n", mtar_strerror(error));
+        return 14;
+    }
+    if (mtar_set_threads(&tar, 2) != MTAR_EUNSUPPORTED || mtar_close(&tar) ||
+        load(threaded) != load(framed))
+    {
+        printf("error: threaded output\n");
+        return 12;
+    }
+
+    /* Random access, by scanning and through an index */
+    if (int error = mtar_open_gz(&tar, framed.c_str(), "r"))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 5;
+    }
+    if (int error = read_members(&tar, 37))
+    {
+        printf("error: member %d\n", error - 1);
+        return 6;
+    }
+    if (mtar_index_build(&tar, &idx) || idx.count != (size_t)s_count)
+    {
+        printf("error: index\n");
+        return 7;
+    }
+    if (int error = read_members(&tar, 101))
+    {
+        printf("error: indexed member %d\n", error - 1);
+        return 8;
+    }
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+
+    /* Plain gzip files are read in order */
+    gzFile gz = gzopen(gzipped.c_str(), "wb");
+    gzwrite(gz, reference.data(), (unsigned)reference.size());
+    gzclose(gz);
+    if (mtar_open_gz(&tar, gzipped.c_str(), "r") || !(tar.flags & MTAR_FSTREAM) ||
+        read_members(&tar, 1))
+    {
+        printf("error: plain gzip\n");
+        return 9;
+    }
+    mtar_close(&tar);
+
+    /* Damage inside a frame is detected */
+    string damaged = load(framed);
+    damaged[damaged.size() / 2] ^= 0x55;
+    FILE *fp = fopen(framed.c_str(), "wb");
+    fwrite(damaged.data(), 1, damaged.size(), fp);
+    fclose(fp);
+    mtar_header_t h;
+    if (mtar_open_gz(&tar, framed.c_str(), "r") ||
+        mtar_find(&tar, "gz/member-299.txt", &h) != MTAR_EBADDATA)
+    {
+        printf("error: damage not detected\n");
+        return 10;
+    }
+    mtar_close(&tar);
+
+    /* So are frames running past the end of the file or claiming a size no
+     * data compresses to */
+    string truncated = damaged.substr(0, damaged.size() - 100);
+    string oversized = damaged;
+    memset(&oversized[16], 0xff, 4);
+    for (int i = 0; i < 2; i++)
+    {
+        fp = fopen(framed.c_str(), "wb");
+        const string& bad = i ? oversized : truncated;
+        fwrite(bad.data(), 1, bad.size(), fp);
+        fclose(fp);
+        if (mtar_open_gz(&tar, framed.c_str(), "r") != MTAR_EBADDATA)
+        {
+            printf("error: bad frame size %d accepted\n", i);
+            return 13;
+        }
+    }
+
+    puts("success");
+    return 0;
+}
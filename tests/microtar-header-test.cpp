@@ -0,0 +1,117 @@
+#include "microtar.h"
+#include <cstring>
+using namespace std;
+
+/* Builds a raw record; fields are copied verbatim */
+static void make_record(char *rec, const char *mode, const char *size,
+                        const char *mtime)
+{
+    memset(rec, 0, 512);
+    strcpy(rec, "file.txt");
+    memcpy(rec + 100, mode, strlen(mode));
+    memcpy(rec + 108, "0000000", 7);
+    memcpy(rec + 124, size, strlen(size));
+    memcpy(rec + 136, mtime, strlen(mtime));
+    rec[156] = '0';
+    unsigned sum = 8 * ' ';
+    for (int i = 0; i < 512; i++)
+    {
+        if (i < 148 || i >= 156)
+            sum += (unsigned char)rec[i];
+    }
+    sprintf(rec + 148, "%06o", sum);
+    rec[155] = ' ';
+}
+
+static int parse_record(const char *rec, mtar_header_t *h)
+{
+    static char buf[512 * 3];
+    mtar_t tar;
+    memcpy(buf, rec, 512);
+    memset(buf + 512, 0, 1024);
+    mtar_open_memory(&tar, buf, sizeof(buf));
+    return mtar_read_header(&tar, h);
+}
+
+int main(void)
+{
+    mtar_header_t h, h2;
+    char rec[512];
+
+    /* Padding styles used by different writers */
+    make_record(rec, "0000644", "00000000013", "14174756062");
+    if (parse_record(rec, &h) || h.mode != 0644 || h.size != 11 ||
+        h.mtime != 014174756062U)
+    {
+        printf("error: zero-padded fields\n");
+        return 1;
+    }
+    make_record(rec, "   644 ", "         13 ", "0");
+    if (parse_record(rec, &h) || h.mode != 0644 || h.size != 11 || h.mtime)
+    {
+        printf("error: space-padded fields\n");
+        return 2;
+    }
+    make_record(rec, "644", "", "");
+    if (parse_record(rec, &h) || h.mode != 0644 || h.size)
+    {
+        printf("error: empty fields\n");
+        return 3;
+    }
+
+    /* Malformed fields are rejected */
+    make_record(rec, "0000648", "13", "0");
+    if (parse_record(rec, &h) != MTAR_EBADFIELD)
+    {
+        printf("error: accepted non-octal digit\n");
+        return 4;
+    }
+    make_record(rec, "644", "1 3", "0");
+    if (parse_record(rec, &h) != MTAR_EBADFIELD)
+    {
+        printf("error: accepted embedded space\n");
+        return 5;
+    }
+    make_record(rec, "644", "13", "12x");
+    if (parse_record(rec, &h) != MTAR_EBADFIELD)
+    {
+        printf("error: accepted trailing garbage\n");
+        return 6;
+    }
+    make_record(rec, "644", "13", "0");
+    rec[300] = 1;
+    if (parse_record(rec, &h) != MTAR_EBADCHKSUM)
+    {
+        printf("error: accepted bad checksum\n");
+        return 7;
+    }
+
+    /* Round trip */
+    mtar_t tar;
+    mtar_open_memory(&tar, NULL, 0);
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, "round/trip.bin");
+    strcpy(h.linkname, "target");
+    h.mode = 07777;
+    h.owner = 01750;
+    h.size = MTAR_SIZEMAX;
+    h.mtime = 0xFFFFFFFFU;
+    h.type = MTAR_TSYM;
+    if (int error = mtar_write_header(&tar, &h))
+    {
+        printf("error: %d\n", error);
+        return 8;
+    }
+    if (parse_record((const char *)tar.memory, &h2) ||
+        h2.mode != h.mode || h2.owner != h.owner || h2.size != h.size ||
+        h2.mtime != h.mtime || h2.type != h.type ||
+        strcmp(h2.name, h.name) != 0 || strcmp(h2.linkname, h.linkname) != 0)
+    {
+        printf("error: round trip\n");
+        return 9;
+    }
+    mtar_close(&tar);
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "microtar.h"
+#include <cstring>
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    mtar_index_t idx;
+    const mtar_entry_t *e;
+    char name[64], data[64];
+    const int count = 2000;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+
+    if (int error = mtar_open(&tar, argv[1], "r"))
+    {
+        printf("error: %d\n", error);
+        return 2;
+    }
+
+    if (int error = mtar_index_build(&tar, &idx))
+    {
+        printf("error: %d\n", error);
+        return 3;
+    }
+
+    if (int error = mtar_find(&tar, "test-file2.txt", &h))
+    {
+        printf("error: %d\n", error);
+        return 4;
+    }
+    if (h.size + 1 > sizeof(data))
+    {
+        printf("error: too large\n");
+        return 5;
+    }
+    if (int error = mtar_read_data(&tar, data, h.size))
+    {
+        printf("error: %d\n", error);
+        return 6;
+    }
+    data[h.size] = 0;
+    puts(data);
+
+    if (mtar_find(&tar, "no-such-file", &h) != MTAR_ENOTFOUND)
+    {
+        printf("error: found missing file\n");
+        return 7;
+    }
+
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+
+    /* Many members in memory */
+    mtar_open_memory(&tar, NULL, 0);
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(name, "dir/file-%d.txt", i);
+        sprintf(data, "contents of %d", i);
+        mtar_write_file_header(&tar, name, strlen(data));
+        mtar_write_data(&tar, data, strlen(data));
+    }
+    mtar_finalize(&tar);
+
+    mtar_t reader;
+    mtar_open_memory(&reader, tar.memory, tar.memory_size);
+    if (int error = mtar_index_build(&reader, &idx))
+    {
+        printf("error: %d\n", error);
+        return 8;
+    }
+    if (idx.count != (size_t)count)
+    {
+        printf("error: %d entries\n", (int)idx.count);
+        return 9;
+    }
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        char expected[64];
+        sprintf(name, "dir/file-%d.txt", i);
+        sprintf(expected, "contents of %d", i);
+        if (mtar_index_lookup(&idx, name, &e) ||
+            strcmp(mtar_entry_name(&idx, e), name) != 0 ||
+            e->size != strlen(expected) ||
+            e->data_offset != e->offset + 512)
+        {
+            printf("error: bad entry %s\n", name);
+            return 10;
+        }
+        if (mtar_find(&reader, name, &h) ||
+            mtar_read_data(&reader, data, h.size))
+        {
+            printf("error: cannot read %s\n", name);
+            return 11;
+        }
+        if (memcmp(data, expected, h.size) != 0)
+        {
+            printf("error: data differs in %s\n", name);
+            return 12;
+        }
+    }
+
+    if (mtar_index_lookup(&idx, "dir/file-2000.txt", &e) != MTAR_ENOTFOUND)
+    {
+        printf("error: found missing file\n");
+        return 13;
+    }
+
+    mtar_index_free(&idx);
+    mtar_close(&reader);
+    mtar_close(&tar);
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "microtar.h"
+#include <cstring>
+#include <string>
+using namespace std;
+
+static const string s_dir = [] {
+    string s;
+    for (int i = 0; i < 30; i++)
+        s += "dir-";
+    return s + "/";
+}();
+static const string s_file = s_dir + string(150, 'x') + ".txt";
+
+/* Archives written by GNU tar in its gnu and pax formats */
+static int read_gnu_tar(const char *filename, bool pax)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    char data[64];
+
+    if (mtar_open(&tar, filename, "r"))
+        return 1;
+    if (mtar_read_header(&tar, &h) || h.type != MTAR_TDIR || s_dir != mtar_header_name(&h))
+        return 2;
+    mtar_next(&tar);
+    if (mtar_read_header(&tar, &h) || h.type != MTAR_TREG || s_file != mtar_header_name(&h) ||
+        h.size != 14 || mtar_read_data(&tar, data, h.size) ||
+        memcmp(data, "long gnu name\n", 14) != 0)
+        return 3;
+    if (pax && (h.mtime != 1500000000 || h.mtime_nsec != 250000000))
+        return 4;
+    mtar_next(&tar);
+    if (mtar_read_header(&tar, &h) || h.type != MTAR_TSYM ||
+        strcmp(h.name, "link-yyyyyyyyyy") != 0 || h.longname ||
+        s_file != mtar_header_linkname(&h) || s_file.compare(0, MTAR_NAMEMAX, h.linkname) != 0)
+        return 5;
+    mtar_next(&tar);
+    if (mtar_read_header(&tar, &h) != MTAR_ENULLRECORD)
+        return 6;
+    if (mtar_find(&tar, s_file.c_str(), &h) || h.size != 14)
+        return 7;
+    mtar_close(&tar);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    mtar_index_t idx;
+    const mtar_entry_t *e;
+    char data[64];
+
+    if (argc < 3)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    if (int error = read_gnu_tar(argv[1], false))
+    {
+        printf("error: gnu format %d\n", error);
+        return 2;
+    }
+    if (int error = read_gnu_tar(argv[2], true))
+    {
+        printf("error: pax format %d\n", error);
+        return 3;
+    }
+
+    /* Short names keep the plain v7 layout */
+    const string prefixed = string(80, 'p') + "/" + string(90, 'n');
+    const string paxed = string(300, 'q');
+    mtar_open_memory(&tar, NULL, 0);
+    mtar_write_file_header(&tar, "short.txt", 5);
+    mtar_write_data(&tar, "short", 5);
+    if (((const char *)tar.memory)[257] != '\0')
+    {
+        printf("error: short name has ustar magic\n");
+        return 4;
+    }
+
+    /* Long names go to the ustar prefix when they can, else to pax */
+    mtar_write_file_header(&tar, prefixed.c_str(), 8);
+    mtar_write_data(&tar, "prefixed", 8);
+    if (tar.memory_size != 512 * 4)
+    {
+        printf("error: prefixed header is %d bytes\n", (int)tar.memory_size);
+        return 5;
+    }
+    memset(&h, 0, sizeof(h));
+    h.longname = paxed.c_str();
+    h.longlink = prefixed.c_str();
+    h.mode = 0644;
+    h.mtime = 1500000000;
+    h.mtime_nsec = 5;
+    h.type = MTAR_TSYM;
+    if (int error = mtar_write_header(&tar, &h))
+    {
+        printf("error: %d\n", error);
+        return 6;
+    }
+    mtar_finalize(&tar);
+
+    memset(&h, 0, sizeof(h));
+    const string overlong(MTAR_PATHMAX + 1, 'z');
+    h.longname = overlong.c_str();
+    if (mtar_write_header(&tar, &h) != MTAR_ENAMELONG)
+    {
+        printf("error: accepted overlong name\n");
+        return 7;
+    }
+
+    mtar_t reader;
+    mtar_open_memory(&reader, tar.memory, tar.memory_size);
+    if (mtar_find(&reader, prefixed.c_str(), &h) ||
+        mtar_read_data(&reader, data, h.size) || memcmp(data, "prefixed", 8) != 0)
+    {
+        printf("error: prefixed name\n");
+        return 8;
+    }
+    if (mtar_find(&reader, paxed.c_str(), &h) || prefixed != mtar_header_linkname(&h) ||
+        h.mtime != 1500000000 || h.mtime_nsec != 5 || h.type != MTAR_TSYM)
+    {
+        printf("error: pax name\n");
+        return 9;
+    }
+    if (mtar_index_build(&reader, &idx) || idx.count != 3 ||
+        mtar_index_lookup(&idx, paxed.c_str(), &e) || e->offset != 512 * 4 ||
+        e->data_offset != 512 * 8)
+    {
+        printf("error: pax member not indexed\n");
+        return 10;
+    }
+    mtar_index_free(&idx);
+    mtar_close(&tar);
+
+    /* Sizes past the octal field use base-256 */
+    if (sizeof(size_t) > 4)
+    {
+        mtar_open_memory(&tar, NULL, 0);
+        memset(&h, 0, sizeof(h));
+        strcpy(h.name, "huge.bin");
+        h.size = (size_t)20 << 30;
+        h.type = MTAR_TREG;
+        mtar_write_header(&tar, &h);
+        if ((unsigned char)((const char *)tar.memory)[124] != 0x80)
+        {
+            printf("error: size not in base-256\n");
+            return 11;
+        }
+        mtar_open_memory(&reader, tar.memory, tar.memory_size);
+        if (mtar_read_header(&reader, &h) || h.size != (size_t)20 << 30)
+        {
+            printf("error: huge size\n");
+            return 12;
+        }
+        mtar_close(&tar);
+    }
+
+    puts("success");
+    return 0;
+}
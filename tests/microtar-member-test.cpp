@@ -0,0 +1,133 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+using namespace std;
+
+static const size_t s_big = 3 * 1024 * 1024 + 123;
+
+/* Range reads at the start, the middle and the end, then chunked reads from
+ * an offset */
+static int check_member(mtar_t *tar, const string& data)
+{
+    mtar_member_t m;
+    static char buf[70000];
+    size_t n;
+    if (mtar_member_open(tar, "big.bin", &m) || m.size != data.size())
+        return 1;
+    const size_t offsets[] = { 2000000, 0, s_big - 100, 65536, 1 };
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+    {
+        size_t len = offsets[i] + 5000 <= s_big ? 5000 : s_big - offsets[i];
+        if (mtar_member_read_at(&m, offsets[i], buf, len) ||
+            memcmp(buf, &data[offsets[i]], len) != 0)
+            return 2;
+    }
+    if (mtar_member_read_at(&m, s_big - 10, buf, 11) != MTAR_EREADFAIL)
+        return 3;
+
+    /* Sequential reads carry on from the last range read */
+    string got;
+    if (mtar_member_skip(&m, 1000))
+        return 4;
+    while (mtar_member_read(&m, buf, sizeof(buf), &n) == MTAR_ESUCCESS && n)
+        got.append(buf, n);
+    if (got != data.substr(1 + 5000 + 1000))
+        return 5;
+    if (mtar_member_skip(&m, 1) != MTAR_EREADFAIL)
+        return 6;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_index_t idx;
+    mtar_member_t m;
+    mtar_header_t h;
+    char buf[16];
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const char *filename = argv[1];
+    const string data = content(0, s_big);
+
+    mtar_open(&tar, filename, "w");
+    mtar_write_file_header(&tar, "small.txt", 5);
+    mtar_write_data(&tar, "hello", 5);
+    mtar_write_file_header(&tar, "big.bin", data.size());
+    mtar_write_data(&tar, data.data(), data.size());
+    mtar_write_file_header(&tar, "after.txt", 5);
+    mtar_write_data(&tar, "after", 5);
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    /* Plain, buffered and indexed */
+    for (int mode = 0; mode < 3; mode++)
+    {
+        mtar_open(&tar, filename, "r");
+        if (mode == 1)
+            mtar_set_buffer(&tar, 64 * 1024);
+        if (mode == 2)
+            mtar_index_build(&tar, &idx);
+        if (int error = check_member(&tar, data))
+        {
+            printf("error: mode %d, check %d\n", mode, error);
+            return 2;
+        }
+        /* The rest of the archive is still there */
+        if (mtar_member_open(&tar, "after.txt", &m) || m.size != 5 ||
+            mtar_member_read_at(&m, 2, buf, 3) || memcmp(buf, "ter", 3) != 0 ||
+            mtar_member_open(&tar, "missing", &m) != MTAR_ENOTFOUND)
+        {
+            printf("error: mode %d, other members\n", mode);
+            return 3;
+        }
+        mtar_close(&tar);
+        if (mode == 2)
+            mtar_index_free(&idx);
+    }
+
+    /* Memory */
+    mtar_open(&tar, filename, "r");
+    mtar_index_build(&tar, &idx);
+    mtar_close(&tar);
+    string archive;
+    FILE *fp = fopen(filename, "rb");
+    archive.resize(s_big + 8192);
+    archive.resize(fread(&archive[0], 1, archive.size(), fp));
+    fclose(fp);
+    mtar_open_memory(&tar, &archive[0], archive.size());
+    const mtar_entry_t *e;
+    mtar_index_lookup(&idx, "big.bin", &e);
+    if (mtar_member_open_entry(&tar, e, &m) ||
+        mtar_member_read_at(&m, 3000000, buf, 16) ||
+        memcmp(buf, &data[3000000], 16) != 0)
+    {
+        printf("error: memory entry\n");
+        return 4;
+    }
+    mtar_close(&tar);
+
+    /* Streams only go forward, and mtar_next() skips what is left */
+    mtar_open_stream(&tar, fopen(filename, "rb"));
+    if (mtar_member_open(&tar, "big.bin", &m) ||
+        mtar_member_read_at(&m, 100000, buf, 16) ||
+        memcmp(buf, &data[100000], 16) != 0 ||
+        mtar_member_read_at(&m, 0, buf, 16) != MTAR_ESEEKFAIL ||
+        mtar_member_open_entry(&tar, e, &m) != MTAR_EUNSUPPORTED ||
+        mtar_next(&tar) || mtar_read_header(&tar, &h) ||
+        strcmp(h.name, "after.txt") != 0)
+    {
+        printf("error: stream\n");
+        return 5;
+    }
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+
+    puts("success");
+    return 0;
+}
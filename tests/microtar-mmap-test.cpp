@@ -0,0 +1,98 @@
+#include "microtar.h"
+#include <cstring>
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    mtar_index_t idx;
+    const mtar_entry_t *e;
+    const void *ptr;
+    size_t size;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+
+    if (int error = mtar_open_mmap(&tar, argv[1]))
+    {
+        printf("error: %d\n", error);
+        return 2;
+    }
+
+    for (;;)
+    {
+        if (int error = mtar_read_header(&tar, &h))
+        {
+            if (error == MTAR_ENULLRECORD)
+            {
+                break;
+            }
+            printf("error: %d\n", error);
+            return 3;
+        }
+
+        if (int error = mtar_data_view(&tar, &ptr, &size))
+        {
+            printf("error: %d\n", error);
+            return 4;
+        }
+
+        char data[256];
+        if (size != h.size || h.size + 1 > sizeof(data))
+        {
+            printf("error: bad size\n");
+            return 5;
+        }
+        if (int error = mtar_read_data(&tar, data, h.size))
+        {
+            printf("error: %d\n", error);
+            return 6;
+        }
+        if (memcmp(ptr, data, size) != 0)
+        {
+            printf("error: data differs\n");
+            return 7;
+        }
+        printf("%s (%d bytes)\n", h.name, (int)h.size);
+        mtar_next(&tar);
+    }
+
+    /* Views through the index */
+    if (int error = mtar_index_build(&tar, &idx))
+    {
+        printf("error: %d\n", error);
+        return 8;
+    }
+    if (mtar_index_lookup(&idx, "test-file1.txt", &e) ||
+        mtar_entry_view(&tar, e, &ptr))
+    {
+        printf("error: no view\n");
+        return 9;
+    }
+    fwrite(ptr, 1, e->size, stdout);
+    puts("");
+    mtar_index_free(&idx);
+    mtar_close(&tar);
+
+    /* Stdio archives cannot hand out pointers */
+    mtar_open(&tar, argv[1], "r");
+    if (mtar_data_view(&tar, &ptr, &size) != MTAR_EUNSUPPORTED)
+    {
+        printf("error: view on stdio archive\n");
+        return 10;
+    }
+    mtar_close(&tar);
+
+    if (mtar_open_mmap(&tar, "no-such-file.tar") != MTAR_EOPENFAIL)
+    {
+        printf("error: opened missing file\n");
+        return 11;
+    }
+
+    puts("success");
+    return 0;
+}
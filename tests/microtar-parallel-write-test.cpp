@@ -0,0 +1,119 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    const int count = 200;
+    vector<mtar_header_t> headers(count + 2);
+    vector<string> paths(count + 2), names(count + 2);
+    vector<const char *> sources(count + 2);
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const string dir = argv[1];
+    mkdir(dir.c_str(), 0777);
+
+    /* Sources of assorted sizes, some without data */
+    for (int i = 0; i < count + 2; i++)
+    {
+        mtar_header_t& h = headers[i];
+        memset(&h, 0, sizeof(h));
+        h.mode = 0644;
+        h.mtime = 1500000000 + i;
+        h.type = MTAR_TREG;
+        if (i == count)
+        {
+            strcpy(h.name, "dir/");
+            h.type = MTAR_TDIR;
+            continue;
+        }
+        if (i == count + 1)
+        {
+            strcpy(h.name, "link");
+            names[i] = string(200, 'l');
+            h.longlink = names[i].c_str();
+            h.type = MTAR_TSYM;
+            continue;
+        }
+        names[i] = "dir/" + string(i % 3 ? 10 : 120, 'n') + "-" + to_string(i) + ".bin";
+        h.longname = names[i].c_str();
+        paths[i] = dir + "/source-" + to_string(i);
+        sources[i] = paths[i].c_str();
+        string data((size_t)(i * i * 13) % 70000, (char)i);
+        h.size = data.size();
+        FILE *fp = fopen(sources[i], "wb");
+        fwrite(data.data(), 1, data.size(), fp);
+        fclose(fp);
+    }
+
+    /* Reference archive from the serial writer */
+    mtar_t tar;
+    const string serial = dir + "/serial.tar";
+    mtar_open(&tar, serial.c_str(), "w");
+    for (int i = 0; i < count + 2; i++)
+    {
+        mtar_write_header(&tar, &headers[i]);
+        if (sources[i] && headers[i].size)
+        {
+            string data = load(sources[i]);
+            mtar_write_data(&tar, data.data(), data.size());
+        }
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    const string parallel = dir + "/parallel.tar";
+    if (int error = mtar_write_parallel(parallel.c_str(), &headers[0], &sources[0],
+                                        headers.size(), 4))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 2;
+    }
+    if (load(parallel) != load(serial))
+    {
+        printf("error: archives differ\n");
+        return 3;
+    }
+
+    /* Single-threaded and empty archives */
+    if (mtar_write_parallel(parallel.c_str(), &headers[0], &sources[0], 10, 1) ||
+        mtar_open(&tar, parallel.c_str(), "r") ||
+        mtar_find(&tar, mtar_header_name(&headers[9]), NULL))
+    {
+        printf("error: serial fallback\n");
+        return 4;
+    }
+    mtar_close(&tar);
+    if (mtar_write_parallel(parallel.c_str(), NULL, NULL, 0, 4) ||
+        load(parallel) != string(1024, '\0'))
+    {
+        printf("error: empty archive\n");
+        return 5;
+    }
+
+    /* Missing sources and bad headers are reported */
+    sources[5] = "no-such-file";
+    if (mtar_write_parallel(parallel.c_str(), &headers[0], &sources[0], 10, 4) != MTAR_EOPENFAIL)
+    {
+        printf("error: missing source\n");
+        return 6;
+    }
+    const string overlong(MTAR_PATHMAX + 1, 'x');
+    headers[3].longname = overlong.c_str();
+    if (mtar_write_parallel(parallel.c_str(), &headers[0], &sources[0], 10, 4) != MTAR_ENAMELONG)
+    {
+        printf("error: bad header\n");
+        return 7;
+    }
+
+    puts("success");
+    return 0;
+}
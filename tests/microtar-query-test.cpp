@@ -0,0 +1,138 @@
+#include "microtar.h"
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+static void add(mtar_t *tar, const char *name)
+{
+    mtar_write_file_header(tar, name, strlen(name));
+    mtar_write_data(tar, name, strlen(name));
+}
+
+/* Every match, directories only implied by deeper names marked with a '+' */
+static vector<string> run(mtar_query_t *q, int err)
+{
+    vector<string> found;
+    if (err)
+        return vector<string>(1, mtar_strerror(err));
+    while (mtar_query_next(q) == MTAR_ESUCCESS)
+        found.push_back((q->entry ? "" : "+") + string(q->name));
+    return found;
+}
+
+static vector<string> prefix(mtar_index_t *idx, const char *s)
+{
+    mtar_query_t q;
+    return run(&q, mtar_index_prefix(&q, idx, s));
+}
+
+static vector<string> children(mtar_index_t *idx, const char *s)
+{
+    mtar_query_t q;
+    return run(&q, mtar_index_children(&q, idx, s));
+}
+
+static vector<string> glob(mtar_index_t *idx, const char *s)
+{
+    mtar_query_t q;
+    return run(&q, mtar_index_glob(&q, idx, s));
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_index_t idx;
+    mtar_query_t q;
+    char name[64];
+
+    (void)argc;
+    (void)argv;
+
+    /* Written out of order, with a replaced and a deleted member */
+    mtar_index_init(&idx);
+    mtar_open_memory(&tar, NULL, 0);
+    tar.index = &idx;
+    add(&tar, "top.txt");
+    add(&tar, "assets/imgx.png");
+    add(&tar, "assets/img/b.jpg");
+    add(&tar, "assets/img/sub/c.png");
+    add(&tar, "assets/img-old/d.png");
+    add(&tar, "assets/img/a.png");
+    add(&tar, "assets/img/gone.png");
+    add(&tar, "assets/js/app.js");
+    add(&tar, "docs/readme.md");
+    mtar_write_dir_header(&tar, "assets/");
+    add(&tar, "top.txt");
+    mtar_delete(&tar, "assets/img/gone.png");
+
+    /* A directory is followed by everything below it */
+    if (prefix(&idx, "assets/img") != vector<string>{ "assets/img/a.png", "assets/img/b.jpg",
+        "assets/img/sub/c.png", "assets/img-old/d.png", "assets/imgx.png" } ||
+        prefix(&idx, "").size() != 9 || !prefix(&idx, "zzz").empty())
+    {
+        printf("error: prefix\n");
+        return 1;
+    }
+    if (children(&idx, "") != vector<string>{ "assets", "+docs", "top.txt" } ||
+        children(&idx, "assets/") != vector<string>{ "+assets/img", "+assets/img-old",
+        "assets/imgx.png", "+assets/js" } ||
+        children(&idx, "assets/img") != vector<string>{ "assets/img/a.png",
+        "assets/img/b.jpg", "+assets/img/sub" } ||
+        !children(&idx, "top.txt").empty())
+    {
+        printf("error: children\n");
+        return 2;
+    }
+    if (glob(&idx, "assets/img/*.png") != vector<string>{ "assets/img/a.png" } ||
+        glob(&idx, "assets/**.png") != vector<string>{ "assets/img/a.png",
+        "assets/img/sub/c.png", "assets/img-old/d.png", "assets/imgx.png" } ||
+        glob(&idx, "*/img/[ab].*") != vector<string>{ "assets/img/a.png", "assets/img/b.jpg" } ||
+        glob(&idx, "[!d]*.txt") != vector<string>{ "top.txt" } ||
+        glob(&idx, "assets/img?old/?.png") != vector<string>{ "assets/img-old/d.png" } ||
+        glob(&idx, "docs/[r-t]eadme.md").size() != 1 || !glob(&idx, "[").empty())
+    {
+        printf("error: glob\n");
+        return 3;
+    }
+
+    /* Adding members rebuilds the order on next use */
+    add(&tar, "assets/img/new.png");
+    if (glob(&idx, "assets/img/*.png") != vector<string>{ "assets/img/a.png",
+        "assets/img/new.png" })
+    {
+        printf("error: added member\n");
+        return 4;
+    }
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+
+    /* Enough members for the searches to matter */
+    mtar_index_init(&idx);
+    mtar_open_memory(&tar, NULL, 0);
+    tar.index = &idx;
+    for (int i = 0; i < 10000; i++)
+    {
+        sprintf(name, "d%03d/f%03d.%s", i % 100, i / 100, i % 3 ? "txt" : "bin");
+        add(&tar, name);
+    }
+    mtar_close(&tar);
+    if (int error = mtar_index_sort(&idx))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 5;
+    }
+    size_t bins = glob(&idx, "d04?/*.bin").size();
+    if (children(&idx, "").size() != 100 || children(&idx, "d042").size() != 100 ||
+        prefix(&idx, "d04").size() != 1000 || bins < 320 || bins > 350 ||
+        mtar_index_glob(&q, &idx, "d099/f099.*") || mtar_query_next(&q) ||
+        strcmp(q.name, "d099/f099.bin") != 0 || mtar_query_next(&q) != MTAR_ENOTFOUND)
+    {
+        printf("error: large index\n");
+        return 6;
+    }
+    mtar_index_free(&idx);
+
+    puts("success");
+    return 0;
+}
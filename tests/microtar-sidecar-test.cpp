@@ -0,0 +1,125 @@
+#include "microtar.h"
+#include <cstring>
+#include <string>
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    mtar_index_t idx;
+    const mtar_entry_t *e;
+    char name[64], data[64];
+    const int count = 300;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    string idxname = string(argv[1]) + ".idx";
+
+    /* Index the members while writing */
+    if (int error = mtar_open(&tar, argv[1], "w"))
+    {
+        printf("error: %d\n", error);
+        return 2;
+    }
+    mtar_index_init(&idx);
+    tar.index = &idx;
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(name, "file-%d.txt", i);
+        sprintf(data, "data %d", i * 7);
+        mtar_write_file_header(&tar, name, strlen(data));
+        mtar_write_data(&tar, data, strlen(data));
+    }
+    mtar_finalize(&tar);
+    mtar_close(&tar);
+
+    if (int error = mtar_index_save(&idx, idxname.c_str(), argv[1]))
+    {
+        printf("error: %d\n", error);
+        return 3;
+    }
+    size_t end = idx.end;
+    mtar_index_free(&idx);
+
+    /* Attach the sidecar instead of scanning */
+    if (int error = mtar_index_load(&idx, idxname.c_str(), argv[1]))
+    {
+        printf("error: %d\n", error);
+        return 4;
+    }
+    if (idx.count != (size_t)count || idx.end != end)
+    {
+        printf("error: bad index\n");
+        return 5;
+    }
+    if (int error = mtar_open(&tar, argv[1], "r"))
+    {
+        printf("error: %d\n", error);
+        return 6;
+    }
+    tar.index = &idx;
+    for (int i = 0; i < count; i++)
+    {
+        char expected[64];
+        sprintf(name, "file-%d.txt", i);
+        sprintf(expected, "data %d", i * 7);
+        if (mtar_index_lookup(&idx, name, &e) || e->type != MTAR_TREG)
+        {
+            printf("error: no entry %s\n", name);
+            return 7;
+        }
+        if (mtar_find(&tar, name, &h) ||
+            mtar_read_data(&tar, data, h.size) ||
+            h.size != strlen(expected) ||
+            memcmp(data, expected, h.size) != 0)
+        {
+            printf("error: cannot read %s\n", name);
+            return 8;
+        }
+    }
+    mtar_close(&tar);
+    mtar_index_free(&idx);
+
+    /* A modified archive makes the sidecar stale */
+    FILE *fp = fopen(argv[1], "ab");
+    fputs("garbage", fp);
+    fclose(fp);
+    if (int error = mtar_index_load(&idx, idxname.c_str(), argv[1]))
+    {
+        if (error != MTAR_ESTALE)
+        {
+            printf("error: %d\n", error);
+            return 9;
+        }
+    }
+    else
+    {
+        printf("error: stale index loaded\n");
+        return 10;
+    }
+
+    /* A truncated sidecar is rejected */
+    fp = fopen(idxname.c_str(), "r+b");
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fclose(fp);
+    string buf(n, '\0');
+    fp = fopen(idxname.c_str(), "rb");
+    fread(&buf[0], 1, n, fp);
+    fclose(fp);
+    fp = fopen(idxname.c_str(), "wb");
+    fwrite(buf.data(), 1, n - 10, fp);
+    fclose(fp);
+    if (mtar_index_load(&idx, idxname.c_str(), NULL) != MTAR_EBADINDEX)
+    {
+        printf("error: truncated index loaded\n");
+        return 11;
+    }
+
+    puts("success");
+    return 0;
+}
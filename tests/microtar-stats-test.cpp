@@ -0,0 +1,125 @@
+#include "microtar.h"
+#include <cstring>
+#include <string>
+using namespace std;
+
+static size_t total(const size_t *hist)
+{
+    size_t n = 0;
+    for (int i = 0; i < MTAR_HISTBUCKETS; i++)
+        n += hist[i];
+    return n;
+}
+
+/* Three members: 100 bytes, 512 bytes and empty */
+static void write_members(mtar_t *tar)
+{
+    string data(512, 'x');
+    mtar_write_file_header(tar, "a.txt", 100);
+    mtar_write_data(tar, data.data(), 100);
+    mtar_write_file_header(tar, "b.txt", 512);
+    mtar_write_data(tar, data.data(), 512);
+    mtar_write_file_header(tar, "c.txt", 0);
+    mtar_finalize(tar);
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    mtar_stats_t st;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const char *filename = argv[1];
+
+    /* Off until enabled */
+    mtar_open(&tar, filename, "w");
+    if (mtar_get_stats(&tar, &st) != MTAR_EUNSUPPORTED)
+    {
+        printf("error: stats before enabling\n");
+        return 2;
+    }
+
+    /* Unbuffered, every write reaches the backend */
+    if (int error = mtar_enable_stats(&tar))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 3;
+    }
+    write_members(&tar);
+    mtar_get_stats(&tar, &st);
+    mtar_close(&tar);
+    /* Headers, data, padding of a.txt and the two marker records */
+    if (st.writes != 3 + 2 + 1 + 2 || st.bytes_written != 512 * 7 ||
+        st.padding_bytes != 412 + 1024 || st.reads || st.seeks ||
+        total(st.write_hist) != st.writes || st.write_time < 0)
+    {
+        printf("error: write stats %d calls %d bytes\n", (int)st.writes,
+               (int)st.bytes_written);
+        return 4;
+    }
+
+    /* Buffered, the same bytes in one call */
+    mtar_open(&tar, filename, "w");
+    mtar_set_buffer(&tar, 64 * 1024);
+    mtar_enable_stats(&tar);
+    write_members(&tar);
+    mtar_get_stats(&tar, &st);
+    mtar_close(&tar);
+    if (st.writes != 1 || st.bytes_written != 512 * 7)
+    {
+        printf("error: buffered write stats\n");
+        return 5;
+    }
+
+    /* Reading seeks back to each header after mtar_read_header(), then
+     * mtar_next() parses it again and seeks over the data */
+    mtar_open(&tar, filename, "r");
+    mtar_enable_stats(&tar);
+    while (mtar_read_header(&tar, &h) == MTAR_ESUCCESS)
+        mtar_next(&tar);
+    mtar_get_stats(&tar, &st);
+    if (st.headers != 6 || st.reads != 7 || st.bytes_read != 512 * 7 ||
+        st.seeks != 7 || st.seek_distance != 512 * 6 ||
+        total(st.read_hist) != st.reads || total(st.seek_hist) != st.seeks ||
+        st.checksum_errors)
+    {
+        printf("error: read stats %d headers %d reads %d seeks %d distance\n",
+               (int)st.headers, (int)st.reads, (int)st.seeks, (int)st.seek_distance);
+        return 6;
+    }
+
+    /* Enabling again starts over */
+    mtar_enable_stats(&tar);
+    mtar_get_stats(&tar, &st);
+    if (st.reads || st.headers)
+    {
+        printf("error: not reset\n");
+        return 7;
+    }
+    mtar_close(&tar);
+
+    /* Damaged headers are counted */
+    mtar_open_memory(&tar, NULL, 0);
+    write_members(&tar);
+    string damaged((const char *)tar.memory, tar.memory_size);
+    mtar_close(&tar);
+    damaged[512 * 2 + 10] ^= 1;
+    mtar_open_memory(&tar, &damaged[0], damaged.size());
+    mtar_enable_stats(&tar);
+    mtar_find(&tar, "c.txt", &h);
+    mtar_get_stats(&tar, &st);
+    mtar_close(&tar);
+    if (st.checksum_errors != 1 || st.headers != 1)
+    {
+        printf("error: checksum errors %d\n", (int)st.checksum_errors);
+        return 8;
+    }
+
+    puts("success");
+    return 0;
+}
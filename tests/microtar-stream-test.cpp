@@ -0,0 +1,163 @@
+#include "microtar.h"
+#include <cstring>
+using namespace std;
+
+static const char *s_data;
+static size_t s_size;
+static int s_reads;
+
+static int pipe_read(mtar_t *tar, void *data, size_t size)
+{
+    if (tar->memory_pos + size > s_size)
+        return MTAR_EREADFAIL;
+    memcpy(data, s_data + tar->memory_pos, size);
+    tar->memory_pos += size;
+    s_reads++;
+    return MTAR_ESUCCESS;
+}
+
+static void open_pipe(mtar_t *tar)
+{
+    memset(tar, 0, sizeof(*tar));
+    tar->read = pipe_read;
+    tar->flags = MTAR_FSTREAM;
+    s_reads = 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_header_t h;
+    char name[64], data[1024];
+    const int count = 100;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp)
+    {
+        printf("error: unable to open\n");
+        return 2;
+    }
+    static char buf[4000];
+    s_size = fread(buf, 1, sizeof(buf), fp);
+    s_data = buf;
+    fclose(fp);
+
+    /* The usual loop works without seeking */
+    open_pipe(&tar);
+    int members = 0;
+    for (;;)
+    {
+        if (int error = mtar_read_header(&tar, &h))
+        {
+            if (error == MTAR_ENULLRECORD)
+            {
+                break;
+            }
+            printf("error: %d\n", error);
+            return 3;
+        }
+        if (int error = mtar_read_header(&tar, &h))
+        {
+            printf("error: %d\n", error);
+            return 4;
+        }
+        printf("%s (%d bytes)\n", h.name, (int)h.size);
+        if (h.size + 1 > sizeof(data))
+        {
+            printf("error: too large\n");
+            return 5;
+        }
+        if (int error = mtar_read_data(&tar, data, h.size))
+        {
+            printf("error: %d\n", error);
+            return 6;
+        }
+        data[h.size] = 0;
+        puts(data);
+        mtar_next(&tar);
+        members++;
+    }
+    /* One header read, one data read and one padding skip per member,
+     * plus the null record */
+    if (s_reads != members * 3 + 1)
+    {
+        printf("error: %d reads\n", s_reads);
+        return 7;
+    }
+
+    /* Generated archive: skip members, read partially, find forward */
+    mtar_open_memory(&tar, NULL, 0);
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(name, "file-%d.txt", i);
+        sprintf(data, "%0*d", 10 + i * 7, i);
+        mtar_write_file_header(&tar, name, strlen(data));
+        mtar_write_data(&tar, data, strlen(data));
+    }
+    mtar_finalize(&tar);
+    s_data = (const char *)tar.memory;
+    s_size = tar.memory_size;
+
+    mtar_t reader;
+    open_pipe(&reader);
+    for (int i = 0; i < count; i++)
+    {
+        if (mtar_read_header(&reader, &h))
+        {
+            printf("error: no header %d\n", i);
+            return 8;
+        }
+        sprintf(name, "file-%d.txt", i);
+        if (strcmp(h.name, name) != 0)
+        {
+            printf("error: got %s\n", h.name);
+            return 9;
+        }
+        if (i % 3 == 1 && mtar_read_data(&reader, data, 5))
+        {
+            printf("error: partial read %d\n", i);
+            return 10;
+        }
+        if (i % 3 == 2 && mtar_read_data(&reader, data, h.size + 1) != MTAR_EREADFAIL)
+        {
+            printf("error: read past member %d\n", i);
+            return 11;
+        }
+        mtar_next(&reader);
+    }
+    if (mtar_read_header(&reader, &h) != MTAR_ENULLRECORD)
+    {
+        printf("error: no end\n");
+        return 12;
+    }
+
+    open_pipe(&reader);
+    if (mtar_find(&reader, "file-40.txt", &h) ||
+        mtar_read_data(&reader, data, h.size) ||
+        mtar_find(&reader, "file-41.txt", &h))
+    {
+        printf("error: cannot find\n");
+        return 13;
+    }
+    if (mtar_find(&reader, "file-3.txt", &h) != MTAR_ENOTFOUND)
+    {
+        printf("error: found member behind the stream\n");
+        return 14;
+    }
+    if (mtar_rewind(&reader) != MTAR_ESEEKFAIL)
+    {
+        printf("error: rewound stream\n");
+        return 15;
+    }
+
+    mtar_close(&tar);
+
+    puts("success");
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef MICROTAR_TEST_HPP
+#define MICROTAR_TEST_HPP
+
+#include <cstdio>
+#include <string>
+
+/* The whole of a file, or "<missing>" if it cannot be opened */
+static inline std::string load(const std::string& filename)
+{
+    std::string data;
+    char buf[4096];
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return "<missing>";
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        data.append(buf, n);
+    fclose(fp);
+    return data;
+}
+
+/* Letters that differ from member to member and from block to block, so a
+ * misplaced block shows while the data still compresses */
+static inline std::string content(int i, size_t size)
+{
+    std::string data(size, '\0');
+    for (size_t k = 0; k < size; k++)
+        data[k] = (char)('a' + (i + k + k / 509) % 26);
+    return data;
+}
+
+#endif
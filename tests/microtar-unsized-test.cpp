@@ -0,0 +1,187 @@
+#include "microtar.h"
+#include "microtar-test.hpp"
+#include <cstring>
+#include <string>
+using namespace std;
+
+static const size_t s_big = 3 * 1024 * 1024 + 77;
+
+/* Output that cannot seek, like a pipe */
+static int string_write(mtar_t *tar, const void *data, size_t size)
+{
+    ((string *)tar->stream)->append((const char *)data, size);
+    return MTAR_ESUCCESS;
+}
+
+static int string_close(mtar_t *tar)
+{
+    (void)tar;
+    return MTAR_ESUCCESS;
+}
+
+static void header(mtar_header_t *h, const char *name)
+{
+    memset(h, 0, sizeof(*h));
+    strcpy(h->name, name);
+    h->type = MTAR_TREG;
+    h->mode = 0644;
+    h->mtime = 1700000000;
+}
+
+/* A large member written in pieces, an empty one, a sized one, and one
+ * ended by mtar_finalize() */
+static int write_members(mtar_t *tar, const string& data)
+{
+    mtar_header_t h;
+    int err;
+    header(&h, "big.bin");
+    if ((err = mtar_write_unsized_header(tar, &h)))
+        return err;
+    for (size_t i = 0; i < data.size(); i += 100000)
+    {
+        size_t n = data.size() - i < 100000 ? data.size() - i : 100000;
+        if ((err = mtar_write_data(tar, &data[i], n)))
+            return err;
+    }
+    if ((err = mtar_end_data(tar)))
+        return err;
+    header(&h, "empty.txt");
+    mtar_write_unsized_header(tar, &h);
+    header(&h, "sized.txt");
+    h.size = 5;
+    mtar_write_header(tar, &h);
+    mtar_write_data(tar, "sized", 5);
+    header(&h, "last.txt");
+    mtar_write_unsized_header(tar, &h);
+    mtar_write_data(tar, "last", 4);
+    return mtar_finalize(tar);
+}
+
+static int check_members(mtar_t *tar, const string& data)
+{
+    mtar_header_t h;
+    string got;
+    if (mtar_find(tar, "big.bin", &h) || h.size != data.size())
+        return 1;
+    got.resize(data.size());
+    if (mtar_read_data(tar, &got[0], got.size()) || got != data)
+        return 2;
+    if (mtar_find(tar, "empty.txt", &h) || h.size != 0)
+        return 3;
+    if (mtar_find(tar, "sized.txt", &h) || h.size != 5)
+        return 4;
+    got.resize(4);
+    if (mtar_find(tar, "last.txt", &h) || h.size != 4 ||
+        mtar_read_data(tar, &got[0], 4) || got != "last")
+        return 5;
+    return 0;
+}
+
+static int check(string& archive, const string& data)
+{
+    mtar_t tar;
+    mtar_open_memory(&tar, &archive[0], archive.size());
+    int error = check_members(&tar, data);
+    mtar_close(&tar);
+    if (error)
+        return error;
+    if (archive.size() != 512 + (s_big + 511) / 512 * 512 + 512 * 5 + 1024)
+        return 6;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    mtar_t tar;
+    mtar_index_t idx;
+    const mtar_entry_t *e;
+
+    if (argc < 2)
+    {
+        printf("error: no argument\n");
+        return 1;
+    }
+    const char *filename = argv[1];
+    const string data = content(0, s_big);
+
+    /* Seekable file, unbuffered and buffered, with an index attached */
+    for (int buffered = 0; buffered < 2; buffered++)
+    {
+        mtar_index_init(&idx);
+        mtar_open(&tar, filename, "w");
+        if (buffered)
+            mtar_set_buffer(&tar, 64 * 1024);
+        tar.index = &idx;
+        if (int error = write_members(&tar, data))
+        {
+            printf("error: %s\n", mtar_strerror(error));
+            return 2;
+        }
+        mtar_close(&tar);
+        string archive = load(filename);
+        if (int error = check(archive, data))
+        {
+            printf("error: file %d, check %d\n", buffered, error);
+            return 3;
+        }
+        if (mtar_index_lookup(&idx, "big.bin", &e) || e->size != s_big ||
+            mtar_index_lookup(&idx, "last.txt", &e) || e->size != 4)
+        {
+            printf("error: index sizes\n");
+            return 4;
+        }
+        mtar_index_free(&idx);
+    }
+    const string expected = load(filename);
+
+    /* Memory */
+    mtar_open_memory(&tar, NULL, 0);
+    write_members(&tar, data);
+    string archive((const char *)tar.memory, tar.memory_size);
+    mtar_close(&tar);
+    if (archive != expected)
+    {
+        printf("error: memory archive differs\n");
+        return 5;
+    }
+
+    /* Without seeking the data is held back, partly in a temporary file */
+    string out;
+    memset(&tar, 0, sizeof(tar));
+    tar.write = string_write;
+    tar.close = string_close;
+    tar.stream = &out;
+    if (int error = write_members(&tar, data))
+    {
+        printf("error: %s\n", mtar_strerror(error));
+        return 6;
+    }
+    mtar_close(&tar);
+    if (out != expected)
+    {
+        printf("error: spilled archive differs\n");
+        return 7;
+    }
+
+#ifdef HAVE_ZLIB
+    /* Gzip output only appends, so it is spilled too */
+    const string gzname = string(filename) + ".gz";
+    mtar_open_gz(&tar, gzname.c_str(), "w");
+    if (int error = write_members(&tar, data))
+    {
+        printf("error: gz: %s\n", mtar_strerror(error));
+        return 8;
+    }
+    mtar_close(&tar);
+    mtar_open_gz(&tar, gzname.c_str(), "r");
+    if (int error = check_members(&tar, data))
+    {
+        printf("error: gz, check %d\n", error);
+        return 9;
+    }
+    mtar_close(&tar);
+#endif
+
+    puts("success");
+    return 0;
+}